@@ -0,0 +1,136 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef _SYS_SYSCTL_H
+#define _SYS_SYSCTL_H
+
+#include <aos/types.h>
+
+/*
+ * Top-level identifiers
+ */
+#define CTL_VM          2               /* Virtual memory */
+
+/*
+ * CTL_VM identifiers
+ */
+#define VM_PMEM         1               /* struct pmem_stat */
+#define VM_KMEM         2               /* struct kmem_stat */
+#define VM_PROC         3               /* struct proc_mem_stat */
+
+/*
+ * Physical memory statistics (VM_PMEM)
+ */
+#define PMEM_STAT_NZONES        20      /* The number of zones */
+#define PMEM_STAT_NORDERS       19      /* The number of buddy orders */
+#define PMEM_STAT_NBUCKETS      32      /* The number of latency buckets */
+
+struct pmem_zone_stat {
+    /* The number of usable pages */
+    unsigned long long total;
+    /* The number of pages out of the buddy system (allocated, or cached by the
+       processors) */
+    unsigned long long used;
+    /* The number of free blocks at each order */
+    unsigned long long nfree[PMEM_STAT_NORDERS];
+    /* The number of allocations, failed allocations, and deallocations */
+    unsigned long long nalloc;
+    unsigned long long nfail;
+    unsigned long long nrelease;
+    /* Fragmentation index at each order in thousandths; close to 0 if an
+       allocation fails for the lack of memory, and close to 1000 if it fails
+       for the fragmentation.  -1000 if the allocation succeeds. */
+    int frag[PMEM_STAT_NORDERS];
+};
+
+struct pmem_stat {
+    struct pmem_zone_stat zones[PMEM_STAT_NZONES];
+    /* Histograms of the latency of pmem_alloc_pages() and pmem_free_pages();
+       bucket b counts the calls taking 2^b to 2^(b+1)-1 TSC cycles */
+    unsigned long long alloc_cycles[PMEM_STAT_NBUCKETS];
+    unsigned long long free_cycles[PMEM_STAT_NBUCKETS];
+    /* TSC cycles spent to initialize the physical page array at the boot
+       time, in the deferred sections summed over the processors, and elapsed
+       until the whole array is initialized (0 while sections are pending) */
+    unsigned long long init_boot_cycles;
+    unsigned long long init_deferred_cycles;
+    unsigned long long init_elapsed_cycles;
+    /* The number of sections of the array whose initialization is pending */
+    unsigned long long init_pending;
+};
+
+/*
+ * Kernel memory allocator statistics (VM_KMEM); the size classes of kmalloc(),
+ * i.e., the 6 power-of-two slab classes from 32 bytes to 1 KiB followed by the
+ * 40 classes of the segregated fit up to 1 MiB
+ */
+#define KMEM_STAT_NCLASSES      46      /* The number of size classes */
+
+struct kmem_class_stat {
+    /* Object size */
+    unsigned long long size;
+    /* The number of allocations and deallocations served by the per-processor
+       magazines (fast path) and by the slabs (slow path) */
+    unsigned long long nalloc_fast;
+    unsigned long long nalloc_slow;
+    unsigned long long nfree_fast;
+    unsigned long long nfree_slow;
+    /* The number of slabs created and released */
+    unsigned long long nslab_created;
+    unsigned long long nslab_released;
+    /* The number of partial and empty slabs */
+    unsigned long long npartial;
+    unsigned long long nempty;
+    /* TSC cycles spent waiting for the lock of the slabs */
+    unsigned long long lock_cycles;
+};
+
+struct kmem_stat {
+    struct kmem_class_stat classes[KMEM_STAT_NCLASSES];
+};
+
+/*
+ * Memory usage of a process (VM_PROC); the third component of the name is the
+ * process ID
+ */
+struct proc_mem_stat {
+    /* The number of the pages mapped to physical pages; the pages shared
+       copy-on-write are counted by each process */
+    unsigned long long resident;
+    /* The number of the pages reserved in the virtual memory space */
+    unsigned long long virt;
+};
+
+int sysctl(const int *, unsigned int, void *, size_t *, const void *, size_t);
+
+#endif /* _SYS_SYSCTL_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -33,6 +33,7 @@
 
 /* Prototype declarations */
 static int _load_trampoline(void);
+static u64 _task_cr3(struct arch_task *);
 
 /* System call table */
 void *syscall_table[SYS_MAXSYSCALL];
@@ -156,11 +157,14 @@ bsp_init(void)
 
     idt_setup_intr_gate(6, intr_iof);
     idt_setup_intr_gate(13, intr_gpf);
-    idt_setup_intr_gate(14, intr_pf);
+    /* The page fault handler runs on its own stack because the faulting stack
+       may be a copy-on-write page */
+    idt_setup_intr_gate_ist(14, intr_pf, 1);
     idt_setup_intr_gate(16, intr_x87_fpe);
     idt_setup_intr_gate(19, intr_simd_fpe);
     idt_setup_intr_gate(IV_LOC_TMR, intr_apic_loc_tmr);
     idt_setup_intr_gate(IV_CRASH, intr_crash);
+    idt_setup_intr_gate(IV_TLB, intr_tlb);
 
     /* ToDo: Prepare the virtual pages for ACPI etc. */
 
@@ -178,11 +182,23 @@ bsp_init(void)
     /* Get the proximity domain */
     prox = acpi_lapic_prox_domain(&arch_acpi, lapic_id());
 
+    /* Enable the process-context identifiers before the kernel pages are
+       mapped (see _vmem_pg_entry()) */
+    (void)arch_vmem_pcid_init();
+
     /* Initialize the physical memory manager */
     if ( arch_memory_init(bi, &arch_acpi) < 0 ) {
         panic("Fatal: Could not initialize the memory manager.");
         return;
     }
+    if ( kmem_init() < 0 ) {
+        panic("Fatal: Could not initialize the kernel memory allocator.");
+        return;
+    }
+
+    /* Protect the read-only pages from the kernel too, so that the writes of
+       the system calls to copy-on-write pages raise page faults */
+    set_cr0(get_cr0() | (1ULL << CR0_WP));
 
     /* Load LDT */
     lldt(0);
@@ -211,9 +227,16 @@ bsp_init(void)
     syscall_table[SYS_mmap] = sys_mmap;
     syscall_table[SYS_munmap] = sys_munmap;
     syscall_table[SYS_lseek] = sys_lseek;
+    syscall_table[SYS___sysctl] = sys___sysctl;
     syscall_table[SYS_sysarch] = sys_sysarch;
     syscall_setup(syscall_table, SYS_MAXSYSCALL);
 
+    /* Create the object caches of the kernel data structures */
+    if ( kernel_cache_init() < 0 || task_cache_init() < 0 ) {
+        panic("Fatal: Could not create the object caches.");
+        return;
+    }
+
     /* Initialize the process table */
     proc_table = kmalloc(sizeof(struct proc_table));
     if ( NULL == proc_table ) {
@@ -313,6 +336,7 @@ ap_init(void)
 {
     struct cpu_data *pdata;
     int prox;
+    int ret;
 
     /* Load global descriptor table */
     gdt_load();
@@ -329,6 +353,8 @@ ap_init(void)
     set_cr3(((struct arch_vmem_space *)g_kmem->space->arch)->pgt);
     /* Enable the global page feature */
     set_cr4(get_cr4() | (1ULL << CR4_PGE));
+    /* Enable the process-context identifiers */
+    (void)arch_vmem_pcid_init();
 
     /* Enable this processor */
     pdata = this_cpu();
@@ -346,6 +372,10 @@ ap_init(void)
         return;
     }
 
+    /* Protect the read-only pages from the kernel too, so that the writes of
+       the system calls to copy-on-write pages raise page faults */
+    set_cr0(get_cr0() | (1ULL << CR0_WP));
+
     /* Load LDT */
     lldt(0);
 
@@ -354,6 +384,15 @@ ap_init(void)
 
     /* Initialize the local APIC */
     lapic_init();
+
+    /* Initialize the physical pages of this proximity domain deferred at the
+       boot time in parallel with the other processors of the domain; the
+       TLB shootdowns already wait for this processor, so they are answered
+       between the chunks while interrupts are still disabled */
+    do {
+        ret = arch_memory_init_deferred(prox);
+        arch_vmem_shootdown_ack();
+    } while ( ret > 0 );
 }
 
 /*
@@ -370,6 +409,25 @@ this_cpu(void)
     return pdata;
 }
 
+/*
+ * Get the ID of this processor; this is the index to the per-processor data
+ * structures in the architecture-independent part
+ */
+int
+this_cpu_id(void)
+{
+    return lapic_id();
+}
+
+/*
+ * Get the proximity domain of this processor; -1 if unknown
+ */
+int
+this_cpu_domain(void)
+{
+    return this_cpu()->prox_domain;
+}
+
 /*
  * Execute a process
  */
@@ -387,6 +445,24 @@ arch_exec(struct arch_task *t, void (*entry)(void), size_t size, int policy,
     u64 cs;
     u64 ss;
     u64 flags;
+    void *paddr;
+    size_t npg;
+
+    /*
+     * Allocate the pages of the new program and prepare its page tables
+     * before touching the current one, so that the original program is kept
+     * on failure
+     */
+    npg = DIV_CEIL(size, PAGESIZE);
+    paddr = pmem_policy_alloc_pages(NULL, bitwidth(npg), 0);
+    if ( NULL == paddr ) {
+        return -1;
+    }
+    if ( arch_vmem_prepare_range(t->ktask->proc->vmem, (void *)CODE_INIT,
+                                 npg) < 0 ) {
+        pmem_free_pages(paddr);
+        return -1;
+    }
 
     /* Set the user stack address */
     ustack = t->ustack;
@@ -435,28 +511,18 @@ arch_exec(struct arch_task *t, void (*entry)(void), size_t size, int policy,
         break;
     }
 
-    /* For exec */
-    void *paddr;
-    paddr = pmem_alloc_pages(PMEM_ZONE_LOWMEM,
-                             bitwidth(DIV_CEIL(size, PAGESIZE)));
-    if ( NULL == paddr ) {
-        return -1;
+    /*
+     * Release the original one, which may be shared with other processes, and
+     * map the new one; the page tables are prepared, so this does not fail.
+     */
+    proc_release_code(t->ktask->proc);
+    if ( arch_vmem_map_range(t->ktask->proc->vmem, (void *)CODE_INIT, paddr,
+                             npg, VMEM_USABLE | VMEM_USED) < 0 ) {
+        panic("FATAL: Cannot map the prepared code pages.");
     }
-    ssize_t i;
-    int ret;
-    for ( i = 0; i < (ssize_t)DIV_CEIL(size, PAGESIZE); i++ ) {
-        ret = arch_vmem_map(t->ktask->proc->vmem,
-                            (void *)(CODE_INIT + PAGESIZE * i),
-                            paddr + PAGESIZE * i, VMEM_USABLE | VMEM_USED);
-        if ( ret < 0 ) {
-            /* FIXME: Handle this error */
-            return -1;
-        }
-    }
-
-    /* Release the original one */
-    pmem_free_pages(t->ktask->proc->code_paddr);
     t->ktask->proc->code_paddr = paddr;
+    t->ktask->proc->mem_resident += npg;
+    t->ktask->proc->mem_virtual += npg;
 
     kmemcpy((void *)CODE_INIT, entry, size);
     kmemset(t->rp, 0, sizeof(struct stackframe64));
@@ -476,6 +542,11 @@ arch_exec(struct arch_task *t, void (*entry)(void), size_t size, int policy,
     /* Specify the code size */
     t->ktask->proc->code_size = size;
 
+    /* Resolve CR3 of the replaced task; the interrupts are re-enabled by
+       task_replace() with the flags of the new stack frame */
+    cli();
+    this_cpu()->cr3 = _task_cr3(t);
+
     /* Restart the task */
     task_replace(t);
 
@@ -491,6 +562,25 @@ arch_exec(struct arch_task *t, void (*entry)(void), size_t size, int policy,
 void
 arch_task_switched(struct arch_task *prev, struct arch_task *next)
 {
+    /* Resolve CR3 to be loaded by _task_restart */
+    this_cpu()->cr3 = _task_cr3(next);
+}
+
+/*
+ * Resolve the value of CR3 to run a task on this processor, or 0 to keep the
+ * current one.  The tasks without process (i.e., the idle task) borrow the
+ * space loaded by the previous task since the kernel region is shared by all
+ * the spaces, so that switching back from the idle task costs no TLB refill.
+ */
+static u64
+_task_cr3(struct arch_task *t)
+{
+    if ( NULL != t->ktask && NULL != t->ktask->proc
+         && NULL != t->ktask->proc->vmem ) {
+        return arch_vmem_cr3(t->ktask->proc->vmem);
+    }
+
+    return 0;
 }
 
 /*
@@ -535,8 +625,33 @@ void set_next_idle(void)
 void
 arch_idle(void)
 {
+    int ret;
+
     while ( 1 ) {
-        halt();
+        /* Initialize the deferred physical pages, give cached memory back
+           when the free pages run low, zero free pages, and compact fragmented
+           zones in the background while idle; interrupts are disabled because
+           the zone locks are also taken in the syscalls and the page windows
+           are per processor.  Each call takes a bounded step, and interrupts
+           are enabled between the steps. */
+        cli();
+        ret = arch_memory_init_deferred(this_cpu_domain());
+        if ( ret <= 0 ) {
+            ret = arch_memory_init_deferred(-1);
+        }
+        if ( ret <= 0 ) {
+            ret = pmem_shrink_background();
+        }
+        if ( ret <= 0 ) {
+            ret = pmem_zero_pool_fill();
+        }
+        if ( ret <= 0 ) {
+            ret = pmem_compact_background();
+        }
+        sti();
+        if ( ret <= 0 ) {
+            halt();
+        }
     }
 }
 
@@ -595,6 +710,27 @@ isr_page_fault(void *rip, void *addr, u64 error)
         return;
     }
 
+    /* Write to a present page: copy-on-write */
+    if ( (error & 0x3) == 0x3 && 0 == proc_cow_fault(t->proc, addr) ) {
+        /* Resolved; restart the instruction */
+        return;
+    }
+    /* Page not present: demand-zero */
+    if ( !(error & 0x1) && 0 == task_zero_fault(t, addr) ) {
+        /* Resolved; restart the instruction */
+        return;
+    }
+
+    if ( (u64)addr < (u64)((struct arch_task *)t->arch)->ustack
+         && (u64)addr >= (u64)((struct arch_task *)t->arch)->ustack
+         - USTACK_GUARD_SIZE ) {
+        /* Guard page */
+        ksnprintf(buf, sizeof(buf), "Stack Overflow: %016x @%016x %d", y, x,
+                  t->proc->id);
+        panic(buf);
+        return;
+    }
+
     ksnprintf(buf, sizeof(buf), "Page Fault (%c%c%c%c[%d]): %016x @%016x %d",
               (error & 0x10) ? 'I' : 'D', (error & 0x4) ? 'U' : 'S',
               (error & 0x2) ? 'W' : 'R', (error & 0x1) ? 'P' : '*',
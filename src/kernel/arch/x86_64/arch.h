@@ -51,8 +51,9 @@
 #define KMEM_REGION_SPEC_BASE   0xd8000000ULL
 #define KMEM_REGION_SPEC_SIZE   0x28000000ULL
 
-/* Maximum number of processors supported in this operating system */
-#define MAX_PROCESSORS          256
+/* Maximum number of processors supported in this operating system; the same
+   as the bound of the architecture-independent part (see kernel.h) */
+#define MAX_PROCESSORS          MAX_CPUS
 
 /* Kernel variable */
 #define KVAR_ADDR               0x78000ULL
@@ -181,6 +182,13 @@ struct arch_vmem_space {
     u64 **array;
     /* Leaves for virtual memory */
     u64 **vls;
+    /* PCID and its generation assigned on each processor (generation << 12 |
+       PCID); the generation also tells whether the TLB entries cached on the
+       processor are still valid without the PCIDs (PCID 0).  NULL for the
+       kernel space. */
+    u64 *pcids;
+    /* Lock to mark the space loaded on a processor (see arch_vmem_cr3()) */
+    spinlock_t lock;
 };
 
 /*
@@ -200,6 +208,8 @@ struct arch_task {
     void *ustack;
     /* Parent structure (architecture-independent generic task structure) */
     struct ktask *ktask;
+    /* User stack pointer at the entry of the current system call */
+    void *syscall_sp;
 } __attribute__ ((packed));
 
 
@@ -221,6 +231,14 @@ struct cpu_data {
     struct arch_task *next_task;
     /* Idle task */
     struct arch_task *idle_task;
+    /* P_CR3_OFFSET: CR3 of the next task resolved by arch_task_switched(); 0
+       to keep the current one */
+    u64 cr3;
+    /* Generation of the PCID pool and the PCID to be assigned next */
+    u64 pcid_gen;
+    u64 pcid_next;
+    /* Page table of the user space loaded (or borrowed by the idle task) */
+    void *cur_pgt;
     /* Stack and stack guard follow */
 } __attribute__ ((packed));
 
@@ -264,6 +282,7 @@ void intr_x87_fpe(void);
 void intr_simd_fpe(void);
 void intr_apic_loc_tmr(void);
 void intr_crash(void);
+void intr_tlb(void);
 void task_restart(void);
 void task_replace(void *);
 void syscall_setup(void *, u64);
@@ -286,6 +305,7 @@ void set_cr3(void *);
 u64 get_cr4(void);
 void set_cr4(u64);
 void invlpg(void *);
+void kmemzero_nt(void *, size_t);
 int vmxon(void *);
 int vmclear(void *);
 int vmptrld(void *);
@@ -301,8 +321,15 @@ void trampoline(void);
 void trampoline_end(void);
 
 /* in task.c */
+struct proc;
+struct ktask;
 struct arch_task * task_create_idle(void);
 int proc_create(const char *, const char *, pid_t);
+int proc_cow_fault(struct proc *, void *);
+int task_zero_fault(struct ktask *, void *);
+void task_syscall_prefault(void *);
+void proc_release_code(struct proc *);
+int task_cache_init(void);
 
 /* In-line assembly */
 #define set_cr3(cr3)    __asm__ __volatile__ ("movq %%rax,%%cr3" :: "a"((cr3)))
@@ -59,10 +59,14 @@
 #define CPU_DATA_BASE           0x01000000
 #define CPU_DATA_SIZE           0x10000
 #define CPU_STACK_GUARD         0x10
+/* Top of the stack of the page fault handler (IST1) placed after struct
+   cpu_data; the stack of the processor grows down from the end */
+#define CPU_PF_STACK_TOP        0x4000
 #define CPU_TSS_SIZE            104     /* sizeof(struct tss) */
 #define CPU_TSS_OFFSET          (0x20 + IDT_NR * 8)     /* struct tss */
 #define CPU_CUR_TASK_OFFSET     (CPU_TSS_OFFSET + CPU_TSS_SIZE) /* cur_task */
 #define CPU_NEXT_TASK_OFFSET    (CPU_CUR_TASK_OFFSET + 8)   /* next_task */
+#define CPU_CR3_OFFSET          (CPU_NEXT_TASK_OFFSET + 16) /* cr3 */
 /* Task information (struct arch_task) */
 #define TASK_RP                 0
 #define TASK_SP0                8
@@ -172,6 +172,22 @@ idt_setup_intr_gate(int nr, void *target)
                         IDT_PRESENT | IDT_INTGATE);
 }
 
+/*
+ * Setup interrupt gate that switches the stack to the ist-th interrupt stack of
+ * the task state segment
+ */
+void
+idt_setup_intr_gate_ist(int nr, void *target, int ist)
+{
+    struct idt_gate_desc *idt;
+
+    idt = (struct idt_gate_desc *)(IDT_ADDR
+                                   + nr * sizeof(struct idt_gate_desc));
+    idt_setup_gate_desc(idt, (u64)target, GDT_RING0_CODE_SEL,
+                        IDT_PRESENT | IDT_INTGATE);
+    idt->reserved1 = ist & 0x7;
+}
+
 /*
  * Initialize interrupt descriptor table
  */
@@ -226,8 +242,9 @@ tss_init(void)
         tss->rsp2h = 0;
         tss->reserved2 = 0;
         tss->reserved3 = 0;
-        tss->ist1l = 0;
-        tss->ist1h = 0;
+        /* Stack for the page fault handler */
+        tss->ist1l = (u32)((u64)pdata + CPU_PF_STACK_TOP);
+        tss->ist1h = (u32)(((u64)pdata + CPU_PF_STACK_TOP) >> 32);
         tss->ist2l = 0;
         tss->ist2h = 0;
         tss->ist3l = 0;
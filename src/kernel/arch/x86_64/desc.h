@@ -107,6 +107,7 @@ void gdt_load(void);
 void idt_init(void);
 void idt_load(void);
 void idt_setup_intr_gate(int, void *);
+void idt_setup_intr_gate_ist(int, void *, int);
 void tss_init(void);
 void tr_load(int);
 
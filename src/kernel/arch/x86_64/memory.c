@@ -24,9 +24,11 @@
 #include <aos/const.h>
 #include "arch.h"
 #include "memory.h"
+#include "apic.h"
 #include "../../kernel.h"
 
 extern struct kmem *g_kmem;
+extern int mp_enabled;
 
 #define KMEM_LOW_P2V(a)         ((u64)(a))
 
@@ -38,9 +40,20 @@ extern struct kmem *g_kmem;
 #define VMEM_PG_GRW(a)          ((a) | 0x187ULL)
 #define VMEM_IS_PAGE(a)         ((a) & 0x080ULL)
 #define VMEM_IS_PRESENT(a)      ((a) & 0x001ULL)
+#define VMEM_IS_WRITABLE(a)     ((a) & 0x002ULL)
+/* Copy-on-write page: read-only, and marked with an available bit */
+#define VMEM_COW(a)             (((a) & ~0x002ULL) | 0x200ULL)
+#define VMEM_IS_COW(a)          ((a) & 0x200ULL)
 #define VMEM_PT(a)              (u64 *)((a) & 0x7ffffffffffff000ULL)
 #define VMEM_PDPG(a)            (void *)((a) & 0x7fffffffffe00000ULL)
 
+/* Process-context identifiers: CR3 bits 11:0 select the PCID, and bit 63 keeps
+   the TLB entries tagged with it on the write to CR3 */
+#define CR3_PCID_NOFLUSH        (1ULL << 63)
+#define VMEM_PCID_MAX           0xfffULL
+#define VMEM_PCID(a)            ((a) & VMEM_PCID_MAX)
+#define VMEM_PCID_GEN(a)        ((a) >> 12)
+
 /* Type of memory area */
 #define BSE_USABLE              1
 #define BSE_RESERVED            2
@@ -51,6 +64,23 @@ extern struct kmem *g_kmem;
 #define KMEM_VMEM_NPD   6
 #define VMEM_NPD    6
 
+/* Virtual pages to access physical pages to be zeroed or copied; two for each
+   processor in a superpage reserved at the initialization */
+#define PAGE_WINDOWS_PER_CPU    2
+static void *_page_windows;
+
+/* Information to initialize the physical page array */
+static struct pmem_init _pmem_init;
+
+/* Set if the process-context identifiers are enabled */
+static int _vmem_pcid;
+
+/* TLB shootdown requests to the processors, serialized by the lock; set while
+   requested, polled by spin_lock() (see asm.S) */
+static spinlock_t _vmem_shootdown_lock;
+static volatile u32 _vmem_shootdown_req[MAX_PROCESSORS];
+volatile u32 arch_vmem_shootdown_pending;
+
 /*
  * Prototype declarations of static functions
  */
@@ -61,21 +91,38 @@ static int _kmem_create_mm_region(struct kmem *, void *);
 static void _kmem_mm_page_free(struct kmem *, void *);
 static struct vmem_space * _kmem_vmem_space_create(void *, u64, u64 *);
 static int _kmem_vmem_space_pgt_reflect(struct kmem *);
-static int _kmem_vmem_map(struct kmem *, u64, u64, int);
-static int _kmem_superpage_map(struct kmem *, u64, u64, int);
+static __inline__ u64 _vmem_pg_entry(u64, int, int);
+static u64 *
+_vmem_pt(struct kmem *, struct arch_vmem_space *, int, int, int,
+         struct vmem_flush *, void *);
+static int
+_vmem_map_range(struct kmem *, struct vmem_space *, void *, void *, void **,
+                size_t, int);
+static int _vmem_unmap_range(struct kmem *, struct vmem_space *, void *, size_t);
+static __inline__ void _vmem_flush_add(struct vmem_flush *, void *);
+static void _vmem_flush(struct arch_vmem_space *, struct vmem_flush *, int);
+static void _vmem_pcid_invalidate(struct arch_vmem_space *);
+static void _vmem_shootdown(void);
 static int
 _pmem_init_stage1(struct bootinfo *, struct acpi *, struct kstring *,
                   struct kstring *, struct kstring *);
 static int
 _pmem_init_stage2(struct kmem *, struct kstring *, struct kstring *,
                   struct kstring *);
-static int _pmem_buddy_init(struct pmem *);
-static int _pmem_buddy_order(struct pmem *, size_t);
+static int _pmem_init_ranges(struct bootinfo *, struct acpi *);
+static int _pmem_init_cma(void);
+static void _pmem_init_pages(struct pmem_page *, u64, u64);
+static void _pmem_init_mark(struct pmem_page *, u64, u64, u64, u64);
+static int _pmem_init_deferred(struct pmem *);
+static int _pmem_section_domain(u64);
+static int _pmem_buddy_init(struct pmem *, u64, u64);
+static int _pmem_buddy_order(struct pmem *, size_t, size_t);
 static u64 _resolve_phys_mem_size(struct bootinfo *);
 static void * _find_pmem_region(struct bootinfo *, u64 );
 static __inline__ int _pmem_page_zone(void *, int);
 static void _enable_page_global(void);
 static void _disable_page_global(void);
+static int _page_windows_init(struct kmem *);
 
 
 /*
@@ -91,6 +138,11 @@ static void _disable_page_global(void);
  *      The third argument acpi is used to determine the proximity domain of the
  *      memory spaces.
  *
+ *      If the kernel is built with PMEM_DEFERRED_INIT, only the pages below
+ *      PMEM_INIT_BOOT_SIZE are initialized here, and the others are left to
+ *      arch_memory_init_deferred().  The time spent is recorded in the pmem
+ *      data structure.
+ *
  * RETURN VALUES
  *      If successful, the arch_memory_init() function returns the value of 0.
  *      It returns the value of -1 on failure.
@@ -104,6 +156,8 @@ arch_memory_init(struct bootinfo *bi, struct acpi *acpi)
     struct kstring pmem_pages;
     int ret;
 
+    _pmem_init.t0 = rdtsc();
+
     /* Stage 1: Initialize the physical memory with the page table of linear
        addressing.  This allocates the data structure for the physical memory
        manager, and also stores the physical page zone in each page data
@@ -131,9 +185,187 @@ arch_memory_init(struct bootinfo *bi, struct acpi *acpi)
         return -1;
     }
 
+    /* Reserve the windows to zero and copy physical pages */
+    ret = _page_windows_init(kmem);
+    if ( ret < 0 ) {
+        return -1;
+    }
+
+    /* Prepare the sections to be initialized later */
+    ret = _pmem_init_deferred(kmem->pmem);
+    if ( ret < 0 ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Initialize a section of the physical pages deferred at the boot time
+ *
+ * SYNOPSIS
+ *      int
+ *      arch_memory_init_deferred(int domain);
+ *
+ * DESCRIPTION
+ *      The arch_memory_init_deferred() function initializes a chunk of a
+ *      section that has not been initialized by arch_memory_init().  The
+ *      pages of all the chunks of the section are initialized first, and then
+ *      the usable pages of each chunk are added to the buddy systems, which
+ *      merge them with the blocks of the preceding chunks.  The section is
+ *      taken from the proximity domain specified by the domain argument, or
+ *      from any domain if domain is negative.  Sections that do not belong to
+ *      any domain are taken regardless of the argument.  This is called by the
+ *      application processors at their initialization, by idle processors,
+ *      and on allocation failures.
+ *
+ * RETURN VALUES
+ *      The arch_memory_init_deferred() function returns the value of 1 if a
+ *      chunk is initialized, and the value of 0 if there is no pending
+ *      section in the domain.
+ */
+int
+arch_memory_init_deferred(int domain)
+{
+    struct pmem *pmem;
+    u64 s;
+    u64 a;
+    u64 b;
+    u64 n;
+    u64 c;
+    u64 t0;
+    int d;
+
+    pmem = g_kmem->pmem;
+    if ( 0 == pmem->ndeferred ) {
+        return 0;
+    }
+
+    t0 = rdtsc();
+
+    /* Claim a pending (or partially initialized) section */
+    spin_lock(&_pmem_init.lock);
+    for ( s = 0; s < _pmem_init.nsections; s++ ) {
+        if ( PMEM_SECTION_PENDING != _pmem_init.sections[s] ) {
+            continue;
+        }
+        d = _pmem_section_domain(s);
+        if ( domain < 0 || d < 0 || d == domain ) {
+            break;
+        }
+    }
+    if ( s >= _pmem_init.nsections ) {
+        spin_unlock(&_pmem_init.lock);
+        return 0;
+    }
+    _pmem_init.sections[s] = PMEM_SECTION_BUSY;
+    c = _pmem_init.progress[s];
+    spin_unlock(&_pmem_init.lock);
+
+    /* Resolve the chunk */
+    a = _pmem_init.boot + (s << PMEM_SECTION_ORDER);
+    b = a + (1ULL << PMEM_SECTION_ORDER);
+    if ( b > pmem->nr ) {
+        b = pmem->nr;
+    }
+    n = DIV_CEIL(b - a, 1ULL << PMEM_INIT_CHUNK_ORDER);
+    a += (c % n) << PMEM_INIT_CHUNK_ORDER;
+    if ( a + (1ULL << PMEM_INIT_CHUNK_ORDER) < b ) {
+        b = a + (1ULL << PMEM_INIT_CHUNK_ORDER);
+    }
+
+    /* Initialize the pages in the chunk, or add them to the buddy systems
+       once all the pages of the section are initialized; the buddy systems do
+       not look into the section until its blocks are added. */
+    if ( c < n ) {
+        _pmem_init_pages(pmem->pages, a, b);
+        kmemset(pmem->rmaps + a, 0, (b - a) * sizeof(struct pmem_rmap));
+    } else {
+        (void)_pmem_buddy_init(pmem, a, b);
+    }
+    c++;
+
+    /* Release the section, or mark it ready, and account the time */
+    spin_lock(&_pmem_init.lock);
+    _pmem_init.progress[s] = c;
+    pmem->init_deferred_cycles += rdtsc() - t0;
+    if ( c < 2 * n ) {
+        _pmem_init.sections[s] = PMEM_SECTION_PENDING;
+    } else {
+        _pmem_init.sections[s] = PMEM_SECTION_READY;
+        pmem->ndeferred--;
+        if ( 0 == pmem->ndeferred ) {
+            pmem->init_elapsed_cycles = rdtsc() - _pmem_init.t0;
+        }
+    }
+    spin_unlock(&_pmem_init.lock);
+
+    return 1;
+}
+
+/*
+ * Prepare the sections deferred at the boot time, and record the time spent at
+ * the boot time
+ */
+static int
+_pmem_init_deferred(struct pmem *pmem)
+{
+    u64 s;
+
+    _pmem_init.nsections = DIV_CEIL(pmem->nr - _pmem_init.boot,
+                                    1ULL << PMEM_SECTION_ORDER);
+    if ( _pmem_init.nsections > 0 ) {
+        _pmem_init.sections = kmalloc(_pmem_init.nsections);
+        if ( NULL == _pmem_init.sections ) {
+            return -1;
+        }
+        _pmem_init.progress = kmalloc(_pmem_init.nsections * sizeof(u32));
+        if ( NULL == _pmem_init.progress ) {
+            kfree(_pmem_init.sections);
+            _pmem_init.sections = NULL;
+            return -1;
+        }
+        for ( s = 0; s < _pmem_init.nsections; s++ ) {
+            _pmem_init.sections[s] = PMEM_SECTION_PENDING;
+            _pmem_init.progress[s] = 0;
+        }
+    }
+
+    pmem->init_boot_cycles = rdtsc() - _pmem_init.t0;
+    if ( 0 == _pmem_init.nsections ) {
+        pmem->init_elapsed_cycles = pmem->init_boot_cycles;
+    }
+    /* Enable arch_memory_init_deferred() */
+    pmem->ndeferred = _pmem_init.nsections;
+
     return 0;
 }
 
+/*
+ * Resolve the proximity domain of a deferred section from the first usable
+ * range in it; -1 if it has no range in a NUMA zone
+ */
+static int
+_pmem_section_domain(u64 s)
+{
+    struct pmem_init_range *r;
+    u64 a;
+    u64 b;
+    int i;
+
+    a = _pmem_init.boot + (s << PMEM_SECTION_ORDER);
+    b = a + (1ULL << PMEM_SECTION_ORDER);
+    for ( i = 0; i < _pmem_init.nranges; i++ ) {
+        r = &_pmem_init.ranges[i];
+        if ( r->b <= a || r->a >= b ) {
+            continue;
+        }
+        return PMEM_ZONE_DOMAIN(r->zone);
+    }
+
+    return -1;
+}
+
 /*
  * Allocate physical memory management data structure
  *
@@ -161,16 +393,8 @@ _pmem_init_stage1(struct bootinfo *bi, struct acpi *acpi,
     u64 npg;
     void *base;
     u64 pmsz;
-    u64 i;
-    u64 a;
-    u64 b;
-    u64 pg;
     struct pmem *pm;
     struct pmem_page *pgs;
-    struct bootinfo_sysaddrmap_entry *bse;
-    u64 pxbase;
-    u64 pxlen;
-    int prox;
 
     /* Check the number of address map entries */
     if ( bi->sysaddrmap.nr <= 0 ) {
@@ -183,8 +407,14 @@ _pmem_init_stage1(struct bootinfo *bi, struct acpi *acpi,
     /* Calculate the number of pages from the upper-bound of the memory space */
     npg = DIV_CEIL(sz, PAGESIZE);
 
-    /* Calculate the size required by the pmem and pmem_page structures */
-    pmsz = sizeof(struct pmem) + npg * sizeof(struct pmem_page);
+    /* Calculate the size required by the pmem and pmem_page structures, and
+       the data structure of the buddy system and the reverse mappings placed
+       after them; the pmem structure is page-aligned to keep its
+       per-processor data structures aligned to cache lines */
+    pmsz = CEIL(npg * sizeof(struct pmem_page), PAGESIZE)
+        + CEIL(sizeof(struct pmem), PAGESIZE)
+        + CEIL(pmem_buddy_size(npg), PAGESIZE)
+        + npg * sizeof(struct pmem_rmap);
 
     /* Fine the available region for the pmem data structure */
     base = _find_pmem_region(bi, pmsz);
@@ -198,7 +428,7 @@ _pmem_init_stage1(struct bootinfo *bi, struct acpi *acpi,
     region->sz = pmsz;
     pmem_pages->base = base;
     pmem_pages->sz = npg * sizeof(struct pmem_page);
-    pmem->base = base + pmem_pages->sz;
+    pmem->base = base + CEIL(pmem_pages->sz, PAGESIZE);
     pmem->sz = sizeof(struct pmem);
 
     /* Initialize the pmem data structure */
@@ -207,74 +437,249 @@ _pmem_init_stage1(struct bootinfo *bi, struct acpi *acpi,
     pm->nr = npg;
     pm->pages = NULL;
 
-    /* Initialize the pages with the current linear addressing page table */
-    pgs = (struct pmem_page *)pmem_pages->base;
-    kmemset(pgs, 0, sizeof(struct pmem_page) * npg);
-    for ( i = 0; i < npg; i++ ) {
-        /* Initialize this as a page in the LOWMEM zone */
-        pgs[i].zone = PMEM_ZONE_LOWMEM;
-        pgs[i].flags = 0;
-        pgs[i].order = PMEM_INVAL_BUDDY_ORDER;
-        pgs[i].next = PMEM_INVAL_INDEX;
+    /* Resolve the zones of the usable memory ranges */
+    _pmem_init.region_a = DIV_FLOOR((u64)region->base, PAGESIZE);
+    _pmem_init.region_b = DIV_CEIL((u64)region->base + region->sz, PAGESIZE);
+    if ( _pmem_init_ranges(bi, acpi) < 0 ) {
+        return -1;
     }
 
-    /* Mark as used for the low memory */
-    for ( i = 0; i < DIV_CEIL(PMEM_LBOUND, PAGESIZE); i++ ) {
-        pgs[i].flags |= PMEM_USED;
+    /* Determine the pages to be initialized at the boot time */
+#ifdef PMEM_DEFERRED_INIT
+    _pmem_init.boot = DIV_CEIL(PMEM_INIT_BOOT_SIZE, PAGESIZE);
+    if ( _pmem_init.boot > npg ) {
+        _pmem_init.boot = npg;
     }
+#else
+    _pmem_init.boot = npg;
+#endif
 
-    /* Mark as used for the pmem pages */
-    for ( i = 0; i < DIV_CEIL(region->sz, PAGESIZE); i++ ) {
-        pg = DIV_FLOOR((u64)region->base, PAGESIZE) + i;
-        pgs[pg].flags |= PMEM_USED;
-    }
+    /* Initialize the pages with the current linear addressing page table */
+    pgs = (struct pmem_page *)pmem_pages->base;
+    _pmem_init_pages(pgs, 0, _pmem_init.boot);
 
-    /* Mark the special use region */
-    for ( i = 0; i < DIV_CEIL(KMEM_REGION_SPEC_SIZE, PAGESIZE); i++ ) {
-        pg = DIV_CEIL(KMEM_REGION_SPEC_BASE, PAGESIZE) + i;
-        pgs[pg].flags |= PMEM_USED;
-    }
+    return 0;
+}
+
+/*
+ * Resolve the usable ranges of the physical memory split at the boundaries of
+ * the zones
+ */
+static int
+_pmem_init_ranges(struct bootinfo *bi, struct acpi *acpi)
+{
+    struct bootinfo_sysaddrmap_entry *bse;
+    struct pmem_init_range *r;
+    u64 i;
+    u64 a;
+    u64 b;
+    u64 e;
+    u64 pxbase;
+    u64 pxlen;
+    int prox;
+    int zone;
 
-    /* Mark the usable region */
+    _pmem_init.nranges = 0;
     for ( i = 0; i < bi->sysaddrmap.nr; i++ ) {
         bse = &bi->sysaddrmap.entries[i];
-        if ( BSE_USABLE == bse->type ) {
-            a = DIV_CEIL(bse->base, PAGESIZE);
-            b = DIV_FLOOR(bse->base + bse->len, PAGESIZE);
-            for ( pg = a; pg < b; pg++ ) {
-                pgs[pg].flags |= PMEM_USABLE;
-            }
+        if ( BSE_USABLE != bse->type ) {
+            continue;
         }
-    }
+        a = DIV_CEIL(bse->base, PAGESIZE);
+        b = DIV_FLOOR(bse->base + bse->len, PAGESIZE);
+        while ( a < b ) {
+            /* Split at the boundaries of the DMA and LOWMEM zones */
+            e = b;
+            if ( PAGE_ADDR(a) < 0x1000000ULL && PAGE_ADDR(e) > 0x1000000ULL ) {
+                e = PAGE_INDEX(0x1000000ULL);
+            }
+            if ( PAGE_ADDR(a) < 0x100000000ULL
+                 && PAGE_ADDR(e) > 0x100000000ULL ) {
+                e = PAGE_INDEX(0x100000000ULL);
+            }
 
-    /* Resolve the zone of each page */
-    if ( acpi_is_numa(acpi) ) {
-        /* NUMA */
-        prox = -1;
-        for ( i = 0; i < npg; i++ ) {
-            if ( prox < 0 || !(PAGE_ADDR(i) >= pxbase
-                               && PAGE_ADDR(i + 1) <= pxbase + pxlen) ) {
-                /* Resolve the proximity domain of the page */
-                prox = acpi_memory_prox_domain(acpi, PAGE_ADDR(i), &pxbase,
+            /* Resolve the zone */
+            if ( acpi_is_numa(acpi) ) {
+                /* NUMA */
+                prox = acpi_memory_prox_domain(acpi, PAGE_ADDR(a), &pxbase,
                                                &pxlen);
-                if ( prox < 0 || !(PAGE_ADDR(i) >= pxbase
-                                   && PAGE_ADDR(i + 1) <= pxbase + pxlen) ) {
-                    /* No proximity domain; meaning unusable page. */
-                    continue;
+                if ( prox < 0 || PAGE_ADDR(a + 1) > pxbase + pxlen ) {
+                    /* No proximity domain for this page */
+                    e = a + 1;
+                    zone = PMEM_ZONE_LOWMEM;
+                } else {
+                    if ( PAGE_ADDR(e) > pxbase + pxlen ) {
+                        e = DIV_FLOOR(pxbase + pxlen, PAGESIZE);
+                    }
+                    zone = _pmem_page_zone((void *)PAGE_ADDR(a), prox);
+                }
+            } else {
+                /* UMA */
+                zone = _pmem_page_zone((void *)PAGE_ADDR(a), -1);
+            }
+
+            /* Extend the last range if contiguous, or append a new range */
+            r = NULL;
+            if ( _pmem_init.nranges > 0 ) {
+                r = &_pmem_init.ranges[_pmem_init.nranges - 1];
+            }
+            if ( NULL != r && r->b == a && r->zone == zone ) {
+                r->b = e;
+            } else {
+                if ( _pmem_init.nranges >= PMEM_INIT_MAX_RANGES ) {
+                    return -1;
                 }
+                r = &_pmem_init.ranges[_pmem_init.nranges];
+                r->a = a;
+                r->b = e;
+                r->zone = zone;
+                _pmem_init.nranges++;
             }
-            pgs[i].zone = _pmem_page_zone((void *)PAGE_ADDR(i), prox);
+
+            a = e;
         }
-    } else {
-        /* UMA */
-        for ( i = 0; i < npg; i++ ) {
-            pgs[i].zone = _pmem_page_zone((void *)PAGE_ADDR(i), -1);
+    }
+
+    /* Reserve the contiguous memory zone */
+    return _pmem_init_cma();
+}
+
+/*
+ * Carve the contiguous memory zone out of a usable range in the LOWMEM zone
+ * avoiding the low memory, the pmem region, and the special use region; the
+ * zone is left empty if no range has room for it.
+ */
+static int
+_pmem_init_cma(void)
+{
+    struct pmem_init_range *r;
+    struct pmem_init_range t[3];
+    u64 n;
+    u64 s;
+    u64 lb;
+    u64 sa;
+    u64 sb;
+    int i;
+    int j;
+    int k;
+
+    n = DIV_CEIL(PMEM_CMA_SIZE, PAGESIZE);
+    lb = DIV_CEIL(PMEM_LBOUND, PAGESIZE);
+    sa = DIV_CEIL(KMEM_REGION_SPEC_BASE, PAGESIZE);
+    sb = sa + DIV_CEIL(KMEM_REGION_SPEC_SIZE, PAGESIZE);
+    for ( i = 0; i < _pmem_init.nranges; i++ ) {
+        r = &_pmem_init.ranges[i];
+        if ( PMEM_ZONE_LOWMEM != r->zone ) {
+            continue;
+        }
+        /* Find a window aligned to its size */
+        for ( s = CEIL(r->a > lb ? r->a : lb, n); s + n <= r->b; s += n ) {
+            if ( (s < _pmem_init.region_b && s + n > _pmem_init.region_a)
+                 || (s < sb && s + n > sa) ) {
+                /* Overlapping */
+                continue;
+            }
+
+            /* Split the range into the window and the rest */
+            k = 0;
+            if ( r->a < s ) {
+                t[k].a = r->a;
+                t[k].b = s;
+                t[k].zone = PMEM_ZONE_LOWMEM;
+                k++;
+            }
+            t[k].a = s;
+            t[k].b = s + n;
+            t[k].zone = PMEM_ZONE_CMA;
+            k++;
+            if ( s + n < r->b ) {
+                t[k].a = s + n;
+                t[k].b = r->b;
+                t[k].zone = PMEM_ZONE_LOWMEM;
+                k++;
+            }
+            if ( _pmem_init.nranges + k - 1 > PMEM_INIT_MAX_RANGES ) {
+                return -1;
+            }
+            for ( j = _pmem_init.nranges - 1; j > i; j-- ) {
+                _pmem_init.ranges[j + k - 1] = _pmem_init.ranges[j];
+            }
+            for ( j = 0; j < k; j++ ) {
+                _pmem_init.ranges[i + j] = t[j];
+            }
+            _pmem_init.nranges += k - 1;
+
+            return 0;
         }
     }
 
     return 0;
 }
 
+/*
+ * Initialize the pages from the page index a to b (exclusive) with the usable
+ * ranges
+ */
+static void
+_pmem_init_pages(struct pmem_page *pgs, u64 a, u64 b)
+{
+    struct pmem_init_range *r;
+    u64 i;
+    u64 s;
+    u64 e;
+    int j;
+
+    kmemset(pgs + a, 0, sizeof(struct pmem_page) * (b - a));
+    for ( i = a; i < b; i++ ) {
+        /* Initialize this as a page in the LOWMEM zone */
+        pgs[i].zone = PMEM_ZONE_LOWMEM;
+        pgs[i].flags = 0;
+        pgs[i].order = PMEM_INVAL_BUDDY_ORDER;
+    }
+
+    /* Mark as used for the low memory */
+    _pmem_init_mark(pgs, a, b, 0, DIV_CEIL(PMEM_LBOUND, PAGESIZE));
+
+    /* Mark as used for the pmem pages */
+    _pmem_init_mark(pgs, a, b, _pmem_init.region_a, _pmem_init.region_b);
+
+    /* Mark the special use region */
+    _pmem_init_mark(pgs, a, b, DIV_CEIL(KMEM_REGION_SPEC_BASE, PAGESIZE),
+                    DIV_CEIL(KMEM_REGION_SPEC_BASE, PAGESIZE)
+                    + DIV_CEIL(KMEM_REGION_SPEC_SIZE, PAGESIZE));
+
+    /* Mark the usable region, and set the zone of each page */
+    for ( j = 0; j < _pmem_init.nranges; j++ ) {
+        r = &_pmem_init.ranges[j];
+        s = r->a > a ? r->a : a;
+        e = r->b < b ? r->b : b;
+        for ( i = s; i < e; i++ ) {
+            pgs[i].flags |= PMEM_USABLE;
+            pgs[i].zone = r->zone;
+        }
+    }
+}
+
+/*
+ * Mark the pages from s to e (exclusive) within the pages from a to b
+ * (exclusive) as used
+ */
+static void
+_pmem_init_mark(struct pmem_page *pgs, u64 a, u64 b, u64 s, u64 e)
+{
+    u64 i;
+
+    if ( s < a ) {
+        s = a;
+    }
+    if ( e > b ) {
+        e = b;
+    }
+    for ( i = s; i < e; i++ ) {
+        pgs[i].flags |= PMEM_USED;
+    }
+}
+
 /*
  * Find the upper bound (highest address) of the memory region
  */
@@ -533,9 +938,13 @@ _kmem_pgt_init(struct arch_vmem_space **avmem, u64 *off)
     /* Set the address */
     (*avmem)->pgt = pgt;
     (*avmem)->nr = KMEM_VMEM_NPD;
-    (*avmem)->array = (u64 **)(*avmem + sizeof(struct arch_vmem_space));
-    (*avmem)->vls = (u64 **)(*avmem + sizeof(struct arch_vmem_space)
+    (*avmem)->array = (u64 **)((void *)*avmem
+                               + sizeof(struct arch_vmem_space));
+    (*avmem)->vls = (u64 **)((void *)*avmem + sizeof(struct arch_vmem_space)
                              + sizeof(u64 *) * VMEM_NENT(KMEM_VMEM_NPD));
+    /* The kernel space is always switched to with PCID 0 */
+    (*avmem)->pcids = NULL;
+    (*avmem)->lock = 0;
 
     /* Convert to virtual address */
     for ( i = 0; i < VMEM_NENT(KMEM_VMEM_NPD); i++ ) {
@@ -734,28 +1143,32 @@ _kmem_vmem_space_pgt_reflect(struct kmem *kmem)
                 /* Not usable/used, then do nothing to this superpage */
                 continue;
             }
-            /* Register a superpage */
+            /* Register a superpage; the physical address is kept in the
+               superpage (or page) data structure */
             if ( VMEM_IS_SUPERPAGE(&reg->superpages[i]) ) {
                 /* Superpage */
-                paddr = (reg_t)reg->start + SUPERPAGE_ADDR(i);
-                vaddr = reg->superpages[i].u.superpage.addr;
+                vaddr = (reg_t)reg->start + SUPERPAGE_ADDR(i);
+                paddr = reg->superpages[i].u.superpage.addr;
                 flags = reg->superpages[i].flags;
-                ret = _kmem_vmem_map(kmem, paddr, vaddr, flags);
+                ret = _vmem_map_range(kmem, kmem->space, (void *)vaddr,
+                                      (void *)paddr, NULL,
+                                      SUPERPAGESIZE / PAGESIZE, flags);
                 if ( ret < 0 ) {
                     return -1;
                 }
             } else {
                 /* Pages */
                 for ( j = 0; j < SUPERPAGESIZE / PAGESIZE; j++ ) {
-                    paddr = (reg_t)reg->start + SUPERPAGE_ADDR(i)
+                    vaddr = (reg_t)reg->start + SUPERPAGE_ADDR(i)
                         + PAGE_ADDR(j);
-                    vaddr = reg->superpages[i].u.page.pages[j].addr;
+                    paddr = reg->superpages[i].u.page.pages[j].addr;
                     flags = reg->superpages[i].u.page.pages[j].flags;
                     if ( !(VMEM_USABLE & flags) || !(VMEM_USED & flags) ) {
                         /* Not usable/used, then skip this page */
                         continue;
                     }
-                    ret = _kmem_vmem_map(kmem, paddr, vaddr, flags);
+                    ret = _vmem_map_range(kmem, kmem->space, (void *)vaddr,
+                                          (void *)paddr, NULL, 1, flags);
                     if ( ret < 0 ) {
                         return -1;
                     }
@@ -824,7 +1237,7 @@ _kmem_create_mm_region(struct kmem *kmem, void *availpg)
     }
 
     /* Allocate physical page */
-    paddr = pmem_alloc_pages(PMEM_ZONE_LOWMEM, bitwidth(SUPERPAGESIZE));
+    paddr = pmem_policy_alloc_pages(NULL, bitwidth(SUPERPAGESIZE), 0);
     if ( NULL == paddr ) {
         return -1;
     }
@@ -837,8 +1250,9 @@ _kmem_create_mm_region(struct kmem *kmem, void *availpg)
     }
 
     /* Update the page table */
-    ret = _kmem_superpage_map(kmem, (u64)vstart, (u64)paddr,
-                              VMEM_SUPERPAGE | VMEM_USED | VMEM_USABLE);
+    ret = _vmem_map_range(kmem, kmem->space, vstart, paddr, NULL,
+                          SUPERPAGESIZE / PAGESIZE,
+                          VMEM_SUPERPAGE | VMEM_USED | VMEM_USABLE);
     if ( ret < 0 ) {
         pmem_free_pages(paddr);
         return -1;
@@ -891,169 +1305,421 @@ _kmem_mm_page_free(struct kmem *kmem, void *vaddr)
 }
 
 /*
- * Map a virtual page to a physical page
+ * Compose a page (or superpage) entry of the kernel or a user space.  The
+ * kernel pages are always global with the PCIDs enabled, so that invlpg
+ * invalidates their TLB entries cached under any PCID.
+ */
+static __inline__ u64
+_vmem_pg_entry(u64 a, int flags, int kernel)
+{
+    if ( kernel ) {
+        return ((VMEM_GLOBAL & flags) || _vmem_pcid)
+            ? KMEM_PG_GRW(a) : KMEM_PG_RW(a);
+    } else {
+        return (VMEM_GLOBAL & flags) ? VMEM_PG_GRW(a) : VMEM_PG_RW(a);
+    }
+}
+
+/*
+ * Get the page table (its virtual address) of the page directory entry idxp of
+ * the page directory idxpd; a new page table is created if the entry is not
+ * present, and a superpage is split into the page table mapping the same
+ * pages.  A split superpage is added to the flush batch.
+ */
+static u64 *
+_vmem_pt(struct kmem *kmem, struct arch_vmem_space *avmem, int idxpd,
+         int idxp, int kernel, struct vmem_flush *fl, void *vaddr)
+{
+    u64 *pd;
+    u64 *pt;
+    u64 *vpt;
+    u64 base;
+    u64 attr;
+    int i;
+
+    pd = VMEM_PD(avmem->array, idxpd);
+    if ( VMEM_IS_PRESENT(pd[idxp]) && !VMEM_IS_PAGE(pd[idxp]) ) {
+        /* Page table */
+        return VMEM_PT(avmem->vls[idxpd][idxp]);
+    }
+
+    /* Create a new page table */
+    vpt = _kmem_mm_page_alloc(kmem);
+    if ( NULL == vpt ) {
+        return NULL;
+    }
+    if ( VMEM_IS_PRESENT(pd[idxp]) ) {
+        /* Split the superpage with the same attributes */
+        base = (u64)VMEM_PDPG(pd[idxp]);
+        attr = pd[idxp] & (PAGESIZE - 1);
+        for ( i = 0; i < PMEM_PTNENT; i++ ) {
+            vpt[i] = (base + PAGE_ADDR(i)) | attr;
+        }
+        _vmem_flush_add(fl, (void *)FLOOR((u64)vaddr, SUPERPAGESIZE));
+    } else {
+        kmemset(vpt, 0, PAGESIZE);
+    }
+    pt = arch_vmem_addr_v2p(kmem->space, vpt);
+
+    /* Update the entry */
+    if ( kernel ) {
+        pd[idxp] = KMEM_DIR_RW((u64)pt);
+        avmem->vls[idxpd][idxp] = KMEM_DIR_RW((u64)vpt);
+    } else {
+        pd[idxp] = VMEM_DIR_RW((u64)pt);
+        avmem->vls[idxpd][idxp] = VMEM_DIR_RW((u64)vpt);
+    }
+
+    return vpt;
+}
+
+/*
+ * Map npg virtual pages starting from vaddr in the virtual memory space to the
+ * physically contiguous pages starting from paddr, or to the pages in the
+ * frames array if frames is not NULL.  Each page directory entry is resolved
+ * once for the pages in it, and the entry is set to a superpage where the
+ * range covers the whole superpage with the aligned contiguous pages.  The
+ * TLB entries of the replaced mappings are invalidated at the end.
  */
 static int
-_kmem_vmem_map(struct kmem *kmem, u64 vaddr, u64 paddr, int flags)
+_vmem_map_range(struct kmem *kmem, struct vmem_space *space, void *vaddr,
+                void *paddr, void **frames, size_t npg, int flags)
 {
     struct arch_vmem_space *avmem;
+    struct vmem_flush fl;
+    u64 *pd;
+    u64 *vpt;
+    u64 va;
+    u64 pa;
+    size_t i;
+    size_t n;
+    size_t j;
     int idxpd;
     int idxp;
     int idx;
-    u64 *pt;
-    u64 *vpt;
+    int kernel;
+    int ret;
 
     /* Check the flags */
     if ( !(VMEM_USABLE & flags) || !(VMEM_USED & flags) ) {
         /* This page is not usable nor used, then do nothing. */
         return -1;
     }
-
-    /* Get the architecture-specific kernel memory manager */
-    avmem = (struct arch_vmem_space *)kmem->space->arch;
-
-    /* Index to page directory */
-    idxpd = (vaddr >> 30);
-    if ( idxpd >= avmem->nr ) {
+    /* Check the alignment */
+    if ( 0 != ((u64)vaddr % PAGESIZE)
+         || (NULL == frames && 0 != ((u64)paddr % PAGESIZE)) ) {
         return -1;
     }
-    /* Index to page table */
-    idxp = (vaddr >> 21) & 0x1ff;
-    /* Index to page entry */
-    idx = (vaddr >> 12) & 0x1ffULL;
 
-    /* Superpage or page? */
-    if ( VMEM_SUPERPAGE & flags ) {
-        /* Superpage */
-        /* Check the physical address argument */
-        if ( 0 != (paddr % SUPERPAGESIZE) || 0 != (vaddr % SUPERPAGESIZE) ) {
-            /* Invalid physical address */
-            return -1;
+    /* Get the architecture-specific data structure */
+    avmem = (struct arch_vmem_space *)space->arch;
+    kernel = (space == kmem->space);
+
+    fl.n = 0;
+    ret = 0;
+    for ( i = 0; i < npg; i += n ) {
+        va = (u64)vaddr + PAGE_ADDR(i);
+        pa = (u64)paddr + PAGE_ADDR(i);
+
+        /* Index to page directory */
+        idxpd = va >> 30;
+        if ( idxpd >= avmem->nr ) {
+            ret = -1;
+            break;
         }
-
-        /* Check whether the page presented */
-        if ( VMEM_IS_PRESENT(VMEM_PD(avmem->array, idxpd)[idxp])
-             && !VMEM_IS_PAGE(VMEM_PD(avmem->array, idxpd)[idxp]) ) {
-            /* Present and 4 KiB paging, then remove the descendant table */
-            pt = VMEM_PT(VMEM_PD(avmem->array, idxpd)[idxp]);
-            vpt = VMEM_PT(avmem->vls[idxpd][idxp]);
-
-            /* Delete descendant table */
-            _kmem_mm_page_free(kmem, vpt);
+        /* Index to page table */
+        idxp = (va >> 21) & 0x1ff;
+        /* Index to page entry */
+        idx = (va >> 12) & 0x1ff;
+
+        pd = VMEM_PD(avmem->array, idxpd);
+        if ( NULL == frames && 0 == idx && 0 == (pa % SUPERPAGESIZE)
+             && npg - i >= PMEM_PTNENT ) {
+            /* Superpage */
+            n = PMEM_PTNENT;
+            if ( VMEM_IS_PRESENT(pd[idxp]) ) {
+                if ( !VMEM_IS_PAGE(pd[idxp]) ) {
+                    /* Delete the descendant table */
+                    _kmem_mm_page_free(kmem,
+                                       VMEM_PT(avmem->vls[idxpd][idxp]));
+                }
+                _vmem_flush_add(&fl, (void *)va);
+            }
+            pd[idxp] = _vmem_pg_entry(pa, flags, kernel);
+            avmem->vls[idxpd][idxp] = _vmem_pg_entry(va, flags, kernel);
+            continue;
         }
 
-        /* Remapping */
-        if ( flags & VMEM_GLOBAL ) {
-            VMEM_PD(avmem->array, idxpd)[idxp] = KMEM_PG_GRW(paddr);
-            avmem->vls[idxpd][idxp] = KMEM_PG_GRW(vaddr);
-        } else {
-            VMEM_PD(avmem->array, idxpd)[idxp] = KMEM_PG_RW(paddr);
-            avmem->vls[idxpd][idxp] = KMEM_PG_RW(vaddr);
+        /* Pages in a page table */
+        vpt = _vmem_pt(kmem, avmem, idxpd, idxp, kernel, &fl, (void *)va);
+        if ( NULL == vpt ) {
+            ret = -1;
+            break;
         }
-
-        /* Invalidate the page */
-        invlpg((void *)vaddr);
-    } else {
-        /* Page */
-        /* Check the physical address argument */
-        if ( 0 != (paddr % PAGESIZE) || 0 != (vaddr % PAGESIZE) ) {
-            /* Invalid physical address */
-            return -1;
+        n = PMEM_PTNENT - idx;
+        if ( n > npg - i ) {
+            n = npg - i;
         }
-
-        /* Check whether the page presented */
-        if ( !VMEM_IS_PRESENT(VMEM_PD(avmem->array, idxpd)[idxp])
-             || VMEM_IS_PAGE(VMEM_PD(avmem->array, idxpd)[idxp]) ) {
-            /* Not present or 2 MiB page, then create a new page table */
-            vpt = _kmem_mm_page_alloc(kmem);
-            if ( NULL == vpt ) {
-                return -1;
+        for ( j = 0; j < n; j++ ) {
+            if ( NULL != frames ) {
+                pa = (u64)frames[i + j];
+                if ( 0 != (pa % PAGESIZE) ) {
+                    ret = -1;
+                    break;
+                }
+            } else {
+                pa = (u64)paddr + PAGE_ADDR(i + j);
             }
-            /* Get the virtual address */
-            pt = arch_vmem_addr_v2p(kmem->space, vpt);
-            /* Update the entry */
-            VMEM_PD(avmem->array, idxpd)[idxp] = KMEM_DIR_RW((u64)pt);
-            avmem->vls[idxpd][idxp] = KMEM_DIR_RW((u64)vpt);
-        } else {
-            /* Directory */
-            pt = VMEM_PT(VMEM_PD(avmem->array, idxpd)[idxp]);
-            vpt = VMEM_PT(avmem->vls[idxpd][idxp]);
+            if ( VMEM_IS_PRESENT(vpt[idx + j]) ) {
+                _vmem_flush_add(&fl, (void *)(va + PAGE_ADDR(j)));
+            }
+            vpt[idx + j] = _vmem_pg_entry(pa, flags, kernel);
         }
-
-        /* Remapping */
-        if ( flags & VMEM_GLOBAL ) {
-            pt[idx] = KMEM_PG_GRW(paddr);
-        } else {
-            pt[idx] = KMEM_PG_RW(paddr);
+        if ( ret < 0 ) {
+            break;
         }
-
-        /* Invalidate the page */
-        invlpg((void *)vaddr);
     }
 
-    return 0;
+    /* Invalidate the TLB entries of the replaced mappings */
+    _vmem_flush(avmem, &fl, kernel);
+
+    return ret;
 }
 
 /*
- * Map a virtual page to a physical super page
+ * Unmap npg virtual pages starting from vaddr in the virtual memory space; a
+ * superpage partially unmapped is split.  The page tables are kept for the
+ * next mapping, and the TLB entries are invalidated at the end.
  */
 static int
-_kmem_superpage_map(struct kmem *kmem, u64 vaddr, u64 paddr, int flags)
+_vmem_unmap_range(struct kmem *kmem, struct vmem_space *space, void *vaddr,
+                  size_t npg)
 {
     struct arch_vmem_space *avmem;
+    struct vmem_flush fl;
+    u64 *pd;
+    u64 *vpt;
+    u64 va;
+    size_t i;
+    size_t n;
+    size_t j;
     int idxpd;
     int idxp;
-    u64 *pt;
-    u64 *vpt;
+    int idx;
+    int kernel;
+    int ret;
 
-    /* Check the flags */
-    if ( !(VMEM_USABLE & flags) || !(VMEM_USED & flags) ) {
-        /* This page is not usable nor used, then do nothing. */
+    if ( 0 != ((u64)vaddr % PAGESIZE) ) {
         return -1;
     }
 
-    /* Get the architecture-specific kernel memory manager */
-    avmem = (struct arch_vmem_space *)kmem->space->arch;
+    /* Get the architecture-specific data structure */
+    avmem = (struct arch_vmem_space *)space->arch;
+    kernel = (space == kmem->space);
+
+    fl.n = 0;
+    ret = 0;
+    for ( i = 0; i < npg; i += n ) {
+        va = (u64)vaddr + PAGE_ADDR(i);
+
+        /* Index to page directory */
+        idxpd = va >> 30;
+        if ( idxpd >= avmem->nr ) {
+            ret = -1;
+            break;
+        }
+        /* Index to page table */
+        idxp = (va >> 21) & 0x1ff;
+        /* Index to page entry */
+        idx = (va >> 12) & 0x1ff;
+
+        n = PMEM_PTNENT - idx;
+        if ( n > npg - i ) {
+            n = npg - i;
+        }
 
-    /* Index to page directory */
-    idxpd = (vaddr >> 30);
-    if ( idxpd >= KMEM_VMEM_NPD ) {
-        return -1;
+        pd = VMEM_PD(avmem->array, idxpd);
+        if ( !VMEM_IS_PRESENT(pd[idxp]) ) {
+            /* Not mapped */
+            ret = -1;
+            continue;
+        }
+        if ( VMEM_IS_PAGE(pd[idxp]) && PMEM_PTNENT == n ) {
+            /* The whole superpage */
+            pd[idxp] = 0;
+            avmem->vls[idxpd][idxp] = 0;
+            _vmem_flush_add(&fl, (void *)va);
+            continue;
+        }
+
+        /* Pages in a page table */
+        vpt = _vmem_pt(kmem, avmem, idxpd, idxp, kernel, &fl, (void *)va);
+        if ( NULL == vpt ) {
+            ret = -1;
+            break;
+        }
+        for ( j = 0; j < n; j++ ) {
+            if ( !VMEM_IS_PRESENT(vpt[idx + j]) ) {
+                ret = -1;
+                continue;
+            }
+            vpt[idx + j] = 0;
+            _vmem_flush_add(&fl, (void *)(va + PAGE_ADDR(j)));
+        }
     }
-    /* Index to page table */
-    idxp = (vaddr >> 21) & 0x1ff;
 
-    /* Check the physical address argument */
-    if ( 0 != (paddr % SUPERPAGESIZE) || 0 != (vaddr % SUPERPAGESIZE) ) {
-        /* Invalid physical address */
-        return -1;
+    /* Invalidate the TLB entries, and the global entries of the kernel
+       memory cached by the other processors too, before the caller releases
+       the physical pages */
+    _vmem_flush(avmem, &fl, kernel);
+    if ( kernel && fl.n > 0 ) {
+        _vmem_shootdown();
     }
 
-    /* Check whether the page presented */
-    if ( VMEM_IS_PRESENT(VMEM_PD(avmem->array, idxpd)[idxp])
-         && !VMEM_IS_PAGE(VMEM_PD(avmem->array, idxpd)[idxp]) ) {
-        /* Present and 4 KiB paging, then remove the descendant table */
-        pt = VMEM_PT(VMEM_PD(avmem->array, idxpd)[idxp]);
-        vpt = VMEM_PT(avmem->vls[idxpd][idxp]);
-        (void)pt;
+    return ret;
+}
 
-        /* Delete descendant table */
-        _kmem_mm_page_free(kmem, vpt);
+/*
+ * Add a virtual address to the batch of the TLB entries to be invalidated
+ */
+static __inline__ void
+_vmem_flush_add(struct vmem_flush *fl, void *vaddr)
+{
+    if ( fl->n < VMEM_FLUSH_MAX ) {
+        fl->addrs[fl->n] = vaddr;
     }
+    fl->n++;
+}
+
+/*
+ * Invalidate the TLB entries in the batch of the space avmem on this
+ * processor; all the entries (including the global entries if global is set)
+ * are flushed at once if the batch overflows.  The entries cached under the
+ * other PCIDs of a user space are dropped by revoking the PCIDs.
+ */
+static void
+_vmem_flush(struct arch_vmem_space *avmem, struct vmem_flush *fl, int global)
+{
+    int i;
 
-    /* Remapping */
-    if ( flags & VMEM_GLOBAL ) {
-        VMEM_PD(avmem->array, idxpd)[idxp] = KMEM_PG_GRW(paddr);
-        avmem->vls[idxpd][idxp] = KMEM_PG_GRW(vaddr);
+    if ( fl->n <= VMEM_FLUSH_MAX ) {
+        for ( i = 0; i < fl->n; i++ ) {
+            invlpg(fl->addrs[i]);
+        }
+    } else if ( global ) {
+        /* Toggling the global page feature flushes the global entries too */
+        _disable_page_global();
+        _enable_page_global();
     } else {
-        VMEM_PD(avmem->array, idxpd)[idxp] = KMEM_PG_RW(paddr);
-        avmem->vls[idxpd][idxp] = KMEM_PG_RW(vaddr);
+        /* Flush the non-global entries of the current PCID */
+        set_cr3(get_cr3());
     }
+    if ( fl->n > 0 ) {
+        _vmem_pcid_invalidate(avmem);
+    }
+}
+
+/*
+ * Revoke the PCIDs assigned to a user space, so that the space takes new PCIDs
+ * with the TLB flushed at the next switches, even on the processors where the
+ * idle task keeps the space loaded.  invlpg and the write to CR3 only
+ * invalidate the entries of the current PCID, hence the PCID of this processor
+ * is kept only if the space is running with it.
+ */
+static void
+_vmem_pcid_invalidate(struct arch_vmem_space *avmem)
+{
+    struct cpu_data *pdata;
+    u64 cr3;
+    u64 cur;
+    int cpu;
+    int i;
 
-    /* Invalidate the page */
-    invlpg((void *)vaddr);
+    if ( NULL == avmem->pcids ) {
+        /* Not using PCIDs */
+        return;
+    }
 
-    return 0;
+    cpu = this_cpu_id();
+    pdata = this_cpu();
+    cr3 = (u64)get_cr3();
+    cur = 0;
+    if ( cpu >= 0 && cpu < MAX_PROCESSORS
+         && (cr3 & ~VMEM_PCID_MAX) == (u64)avmem->pgt
+         && VMEM_PCID_GEN(avmem->pcids[cpu]) == pdata->pcid_gen
+         && VMEM_PCID(avmem->pcids[cpu]) == VMEM_PCID(cr3) ) {
+        cur = avmem->pcids[cpu];
+    }
+    for ( i = 0; i < MAX_PROCESSORS; i++ ) {
+        avmem->pcids[i] = 0;
+    }
+    if ( cur ) {
+        avmem->pcids[cpu] = cur;
+    }
+}
+
+/*
+ * Invalidate all the TLB entries, including the global entries of the kernel
+ * memory, on the other working processors, and wait for them to complete.  A
+ * processor spinning on a lock with the interrupts disabled answers the
+ * request in spin_lock(), hence the caller may hold locks.
+ */
+static void
+_vmem_shootdown(void)
+{
+    struct cpu_data *pdata;
+    int cpu;
+    int i;
+
+    if ( !mp_enabled ) {
+        /* No other processor is working */
+        return;
+    }
+
+    spin_lock(&_vmem_shootdown_lock);
+
+    cpu = this_cpu_id();
+    for ( i = 0; i < MAX_PROCESSORS; i++ ) {
+        pdata = (struct cpu_data *)((u64)CPU_DATA_BASE + i * CPU_DATA_SIZE);
+        if ( i != cpu && (pdata->flags & 1) ) {
+            _vmem_shootdown_req[i] = 1;
+        }
+    }
+    arch_vmem_shootdown_pending = 1;
+    __sync_synchronize();
+    lapic_send_fixed_ipi(IV_TLB);
+
+    /* Wait for the acknowledgements */
+    for ( i = 0; i < MAX_PROCESSORS; i++ ) {
+        while ( _vmem_shootdown_req[i] ) {
+            pause();
+        }
+    }
+    arch_vmem_shootdown_pending = 0;
+
+    spin_unlock(&_vmem_shootdown_lock);
+}
+
+/*
+ * Answer the TLB shootdown request to this processor, if any; called from the
+ * interrupt handler of IV_TLB and from spin_lock()
+ */
+void
+arch_vmem_shootdown_ack(void)
+{
+    int cpu;
+
+    cpu = this_cpu_id();
+    if ( cpu < 0 || cpu >= MAX_PROCESSORS || !_vmem_shootdown_req[cpu] ) {
+        return;
+    }
+
+    /* Toggling the global page feature flushes the entries of all the PCIDs
+       and the global entries */
+    _disable_page_global();
+    _enable_page_global();
+    __sync_synchronize();
+    _vmem_shootdown_req[cpu] = 0;
 }
 
 /*
@@ -1074,8 +1740,18 @@ _pmem_init_stage2(struct kmem *kmem, struct kstring *region,
     /* Set physical memory manager */
     kmem->pmem = pm;
 
-    /* Initialize all usable pages with the buddy system */
-    ret = _pmem_buddy_init(pm);
+    /* Reset the buddy system with its data structure next to the pmem
+       structure */
+    pmem_buddy_init(pm, (void *)pm + CEIL(sizeof(struct pmem), PAGESIZE));
+
+    /* Reset the reverse mappings placed after the buddy system */
+    pm->rmaps = (void *)pm + CEIL(sizeof(struct pmem), PAGESIZE)
+        + CEIL(pmem_buddy_size(pm->nr), PAGESIZE);
+    kmemset(pm->rmaps, 0, _pmem_init.boot * sizeof(struct pmem_rmap));
+
+    /* Initialize the usable pages initialized at the boot time with the buddy
+       system */
+    ret = _pmem_buddy_init(pm, 0, _pmem_init.boot);
     if ( ret < 0 ) {
         return -1;
     }
@@ -1084,41 +1760,26 @@ _pmem_init_stage2(struct kmem *kmem, struct kstring *region,
 }
 
 /*
- * Construct buddy system for physical memory
+ * Construct buddy system for the physical pages from the page index a to b
+ * (exclusive)
  */
 static int
-_pmem_buddy_init(struct pmem *pmem)
+_pmem_buddy_init(struct pmem *pmem, u64 a, u64 b)
 {
     u64 i;
-    u64 j;
     int o;
-    int z;
-
-    /* Reset it */
-    for ( i = 0; i < PMEM_NUM_ZONES; i++ ) {
-        for ( j = 0; j <= PMEM_MAX_BUDDY_ORDER; j++ ) {
-            pmem->zones[i].buddy.heads[j] = PMEM_INVAL_INDEX;
-        }
-    }
 
-    for ( i = 0; i < pmem->nr; i += (1ULL << o) ) {
+    for ( i = a; i < b; i += (1ULL << o) ) {
         /* Find the maximum contiguous usable pages fitting to the alignment of
            the buddy system */
-        o = _pmem_buddy_order(pmem, i);
+        o = _pmem_buddy_order(pmem, i, b);
         if ( o < 0 ) {
             /* This page is not usable, then skip it. */
             o = 0;
         } else {
-            /* This page is usable, then set the order to all the pages. */
-            for ( j = 0; j < (1ULL << o); j++ ) {
-                pmem->pages[i + j].order = o;
-            }
-            /* Get the zone */
-            z = pmem->pages[i].zone;
-
-            /* Add this to the buddy system at the order of o */
-            pmem->pages[i].next = pmem->zones[z].buddy.heads[o];
-            pmem->zones[z].buddy.heads[o] = i;
+            /* This page is usable, then add this to the buddy system at the
+               order of o */
+            pmem_buddy_add(pmem, i, o);
         }
     }
 
@@ -1126,17 +1787,18 @@ _pmem_buddy_init(struct pmem *pmem)
 }
 
 /*
- * Count the physical memory order for buddy system
+ * Count the physical memory order for buddy system within the pages below the
+ * page index end
  */
 static int
-_pmem_buddy_order(struct pmem *pmem, size_t pg)
+_pmem_buddy_order(struct pmem *pmem, size_t pg, size_t end)
 {
     int o;
     size_t i;
     int zone;
 
     /* Check the pg argument within the range of the physical memory space */
-    if ( pg >= pmem->nr ) {
+    if ( pg >= end ) {
         return -1;
     }
 
@@ -1155,7 +1817,7 @@ _pmem_buddy_order(struct pmem *pmem, size_t pg)
         }
         /* Test whether the next order is feasible; feasible if it is properly
            aligned and the pages are within the range of this zone. */
-        if ( 0 != (pg & (1ULL << o)) || pg + (1ULL << (o + 1)) > pmem->nr ) {
+        if ( 0 != (pg & (1ULL << o)) || pg + (1ULL << (o + 1)) > end ) {
             /* Infeasible, then return the current order immediately */
             return o;
         }
@@ -1208,214 +1870,687 @@ _disable_page_global(void)
 }
 
 /*
- * Map a virtual page to a physical page
+ * Map a range of virtual pages to physically contiguous pages
+ *
+ * SYNOPSIS
+ *      int
+ *      arch_vmem_map_range(struct vmem_space *space, void *vaddr, void *paddr,
+ *                          size_t npg, int flags);
+ *
+ * DESCRIPTION
+ *      The arch_vmem_map_range() function maps npg virtual pages starting from
+ *      vaddr in the virtual memory space space to the physically contiguous
+ *      pages starting from paddr.  The page table is walked once for each page
+ *      directory entry, and the whole superpages in the range are mapped with
+ *      2 MiB pages if vaddr and paddr are aligned to each other.  The mappings
+ *      of the kernel memory are made with the kernel's entries, and the others
+ *      are accessible from the user-land.  The TLB entries of the replaced
+ *      mappings are invalidated at once on this processor at the end.
+ *
+ * RETURN VALUES
+ *      If successful, the arch_vmem_map_range() function returns the value of
+ *      0.  It returns the value of -1 on failure, where the pages up to the
+ *      failure remain mapped.
  */
 int
-arch_vmem_map(struct vmem_space *space, void *vaddr, void *paddr, int flags)
+arch_vmem_map_range(struct vmem_space *space, void *vaddr, void *paddr,
+                    size_t npg, int flags)
+{
+    return _vmem_map_range(g_kmem, space, vaddr, paddr, NULL, npg, flags);
+}
+
+/*
+ * Map a range of virtual pages to physical pages
+ *
+ * SYNOPSIS
+ *      int
+ *      arch_vmem_map_frames(struct vmem_space *space, void *vaddr,
+ *                           void **frames, size_t npg, int flags);
+ *
+ * DESCRIPTION
+ *      The arch_vmem_map_frames() function maps npg virtual pages starting from
+ *      vaddr in the virtual memory space space to the physical pages in the
+ *      frames array, e.g., the pages allocated by pmem_alloc_pages_bulk(), in
+ *      the same way as arch_vmem_map_range() except that the superpages are
+ *      not used.
+ *
+ * RETURN VALUES
+ *      If successful, the arch_vmem_map_frames() function returns the value of
+ *      0.  It returns the value of -1 on failure, where the pages up to the
+ *      failure remain mapped.
+ */
+int
+arch_vmem_map_frames(struct vmem_space *space, void *vaddr, void **frames,
+                     size_t npg, int flags)
+{
+    return _vmem_map_range(g_kmem, space, vaddr, NULL, frames, npg, flags);
+}
+
+/*
+ * Unmap a range of virtual pages
+ *
+ * SYNOPSIS
+ *      int
+ *      arch_vmem_unmap_range(struct vmem_space *space, void *vaddr,
+ *                            size_t npg);
+ *
+ * DESCRIPTION
+ *      The arch_vmem_unmap_range() function removes the mappings of npg
+ *      virtual pages starting from vaddr in the virtual memory space space.  A
+ *      superpage that is partially unmapped is split into 4 KiB pages, and the
+ *      page tables are kept for the next mapping.  The TLB entries are
+ *      invalidated at once at the end.  The mappings of the kernel memory are
+ *      also invalidated on the other processors before the return, so that
+ *      the caller can release the physical pages.
+ *
+ * RETURN VALUES
+ *      The arch_vmem_unmap_range() function returns the value of 0 if all the
+ *      pages are unmapped.  It returns the value of -1 if the range contains
+ *      a page not mapped, or on failure.
+ */
+int
+arch_vmem_unmap_range(struct vmem_space *space, void *vaddr, size_t npg)
+{
+    return _vmem_unmap_range(g_kmem, space, vaddr, npg);
+}
+
+/*
+ * Prepare the page tables of a range of virtual pages
+ *
+ * SYNOPSIS
+ *      int
+ *      arch_vmem_prepare_range(struct vmem_space *space, void *vaddr,
+ *                              size_t npg);
+ *
+ * DESCRIPTION
+ *      The arch_vmem_prepare_range() function creates the page tables for npg
+ *      virtual pages starting from vaddr in the virtual memory space space,
+ *      splitting the superpages in the range without changing the mappings.
+ *      Once prepared, arch_vmem_map_range() over the range does not fail, so
+ *      that the caller can replace the existing mappings without a way back.
+ *
+ * RETURN VALUES
+ *      If successful, the arch_vmem_prepare_range() function returns the value
+ *      of 0.  It returns the value of -1 on failure, where the page tables
+ *      prepared up to the failure are kept.
+ */
+int
+arch_vmem_prepare_range(struct vmem_space *space, void *vaddr, size_t npg)
 {
     struct arch_vmem_space *avmem;
-    int idxpd;
-    int idxp;
-    int idx;
-    u64 *pt;
-    u64 *vpt;
+    struct vmem_flush fl;
+    u64 va;
+    u64 end;
+    int kernel;
+    int ret;
 
-    /* Check the flags */
-    if ( !(VMEM_USABLE & flags) || !(VMEM_USED & flags) ) {
-        /* This page is not usable nor used, then do nothing. */
+    /* Check the alignment */
+    if ( 0 != ((u64)vaddr % PAGESIZE) ) {
         return -1;
     }
 
-    /* Get the architecture-specific kernel memory manager */
     avmem = (struct arch_vmem_space *)space->arch;
-
-    /* Index to page directory */
-    idxpd = ((u64)vaddr >> 30);
-    if ( idxpd >= VMEM_NPD ) {
-        return -1;
+    kernel = (space == g_kmem->space);
+
+    fl.n = 0;
+    ret = 0;
+    end = (u64)vaddr + PAGE_ADDR(npg);
+    for ( va = (u64)vaddr; va < end;
+          va = FLOOR(va, SUPERPAGESIZE) + SUPERPAGESIZE ) {
+        if ( (va >> 30) >= (u64)avmem->nr ) {
+            ret = -1;
+            break;
+        }
+        if ( NULL == _vmem_pt(g_kmem, avmem, va >> 30, (va >> 21) & 0x1ff,
+                              kernel, &fl, (void *)va) ) {
+            ret = -1;
+            break;
+        }
     }
-    /* Index to page table */
-    idxp = ((u64)vaddr >> 21) & 0x1ff;
-    /* Index to page entry */
-    idx = ((u64)vaddr >> 12) & 0x1ffULL;
 
-    /* Superpage or page? */
+    /* Invalidate the TLB entries of the split superpages */
+    _vmem_flush(avmem, &fl, kernel);
+
+    return ret;
+}
+
+/*
+ * Map a virtual page (or a superpage if flags has VMEM_SUPERPAGE) to a
+ * physical page
+ */
+int
+arch_vmem_map(struct vmem_space *space, void *vaddr, void *paddr, int flags)
+{
     if ( VMEM_SUPERPAGE & flags ) {
         /* Superpage */
-        /* Check the physical address argument */
         if ( 0 != ((u64)paddr % SUPERPAGESIZE)
              || 0 != ((u64)vaddr % SUPERPAGESIZE) ) {
-            /* Invalid physical address */
+            /* Invalid address */
             return -1;
         }
+        return _vmem_map_range(g_kmem, space, vaddr, paddr, NULL,
+                               SUPERPAGESIZE / PAGESIZE, flags);
+    }
 
-        /* Check whether the page presented */
-        if ( VMEM_IS_PRESENT(VMEM_PD(avmem->array, idxpd)[idxp])
-             && !VMEM_IS_PAGE(VMEM_PD(avmem->array, idxpd)[idxp]) ) {
-            /* Present and 4 KiB paging, then remove the descendant table */
-            pt = VMEM_PT(VMEM_PD(avmem->array, idxpd)[idxp]);
-            vpt = VMEM_PT(avmem->vls[idxpd][idxp]);
+    return _vmem_map_range(g_kmem, space, vaddr, paddr, NULL, 1, flags);
+}
 
-            /* Delete descendant table */
-            _kmem_mm_page_free(g_kmem, vpt);
-        }
+/*
+ * Share a range of virtual pages copy-on-write
+ *
+ * SYNOPSIS
+ *      int
+ *      arch_vmem_share_range(struct vmem_space *dst, struct vmem_space *src,
+ *                            void *vaddr, size_t npg, void **pages);
+ *
+ * DESCRIPTION
+ *      The arch_vmem_share_range() function maps the physical pages mapped to
+ *      npg virtual pages starting from vaddr in the virtual memory space src
+ *      to the same virtual pages in the virtual memory space dst.  The
+ *      writable pages are turned into read-only copy-on-write pages in both
+ *      spaces, and a write to them raises a page fault to be resolved with
+ *      arch_vmem_cow_lookup().  A superpage is shared as it is if the range
+ *      covers the whole of it.  The physical address of each page is stored
+ *      to the array pages, or NULL if the page is not mapped, for the caller
+ *      to add the references to the physical pages.  The TLB entries of src
+ *      are invalidated at once at the end.
+ *
+ * RETURN VALUES
+ *      If successful, the arch_vmem_share_range() function returns the value
+ *      of 0.  It returns the value of -1 on failure.
+ */
+int
+arch_vmem_share_range(struct vmem_space *dst, struct vmem_space *src,
+                      void *vaddr, size_t npg, void **pages)
+{
+    struct arch_vmem_space *sav;
+    struct arch_vmem_space *dav;
+    struct vmem_flush fl;
+    u64 *spd;
+    u64 *dpd;
+    u64 *spt;
+    u64 *dpt;
+    u64 va;
+    size_t i;
+    size_t n;
+    size_t j;
+    int idxpd;
+    int idxp;
+    int idx;
+    int ret;
 
-        /* Remapping */
-        if ( flags & VMEM_GLOBAL ) {
-            VMEM_PD(avmem->array, idxpd)[idxp] = VMEM_PG_GRW((u64)paddr);
-            avmem->vls[idxpd][idxp] = VMEM_PG_GRW((u64)vaddr);
-        } else {
-            VMEM_PD(avmem->array, idxpd)[idxp] = VMEM_PG_RW((u64)paddr);
-            avmem->vls[idxpd][idxp] = VMEM_PG_RW((u64)vaddr);
-        }
+    if ( 0 != ((u64)vaddr % PAGESIZE) ) {
+        return -1;
+    }
 
-        /* Invalidate the page */
-        invlpg((void *)vaddr);
-    } else {
-        /* Page */
-        /* Check the physical address argument */
-        if ( 0 != ((u64)paddr % PAGESIZE) || 0 != ((u64)vaddr % PAGESIZE) ) {
-            /* Invalid physical address */
-            return -1;
-        }
+    /* Get the architecture-specific data structures */
+    sav = (struct arch_vmem_space *)src->arch;
+    dav = (struct arch_vmem_space *)dst->arch;
 
-        /* Check whether the page presented */
-        if ( !VMEM_IS_PRESENT(VMEM_PD(avmem->array, idxpd)[idxp])
-             || VMEM_IS_PAGE(VMEM_PD(avmem->array, idxpd)[idxp]) ) {
-            /* Not present or 2 MiB page, then create a new page table */
-            vpt = _kmem_mm_page_alloc(g_kmem);
-            if ( NULL == vpt ) {
-                return -1;
-            }
-            /* Get the virtual address */
-            pt = arch_vmem_addr_v2p(g_kmem->space, vpt);
+    fl.n = 0;
+    ret = 0;
+    for ( i = 0; i < npg; i += n ) {
+        va = (u64)vaddr + PAGE_ADDR(i);
 
-            /* Update the entry */
-            VMEM_PD(avmem->array, idxpd)[idxp] = VMEM_DIR_RW((u64)pt);
-            avmem->vls[idxpd][idxp] = VMEM_DIR_RW((u64)vpt);
-        } else {
-            /* Directory */
-            pt = VMEM_PT(VMEM_PD(avmem->array, idxpd)[idxp]);
-            vpt = VMEM_PT(avmem->vls[idxpd][idxp]);
+        /* Index to page directory */
+        idxpd = va >> 30;
+        if ( idxpd >= sav->nr || idxpd >= dav->nr ) {
+            ret = -1;
+            break;
+        }
+        /* Index to page table */
+        idxp = (va >> 21) & 0x1ff;
+        /* Index to page entry */
+        idx = (va >> 12) & 0x1ff;
+
+        n = PMEM_PTNENT - idx;
+        if ( n > npg - i ) {
+            n = npg - i;
         }
 
-        /* Remapping */
-        if ( flags & VMEM_GLOBAL ) {
-            pt[idx] = VMEM_PG_GRW((u64)paddr);
-        } else {
-            pt[idx] = VMEM_PG_RW((u64)paddr);
+        spd = VMEM_PD(sav->array, idxpd);
+        dpd = VMEM_PD(dav->array, idxpd);
+        if ( !VMEM_IS_PRESENT(spd[idxp]) ) {
+            /* Not mapped */
+            for ( j = 0; j < n; j++ ) {
+                pages[i + j] = NULL;
+            }
+            continue;
+        }
+        if ( VMEM_IS_PAGE(spd[idxp]) && PMEM_PTNENT == n ) {
+            /* Share the whole superpage */
+            if ( VMEM_IS_WRITABLE(spd[idxp]) ) {
+                spd[idxp] = VMEM_COW(spd[idxp]);
+                _vmem_flush_add(&fl, (void *)va);
+            }
+            if ( VMEM_IS_PRESENT(dpd[idxp]) && !VMEM_IS_PAGE(dpd[idxp]) ) {
+                /* Delete the descendant table */
+                _kmem_mm_page_free(g_kmem, VMEM_PT(dav->vls[idxpd][idxp]));
+            }
+            dpd[idxp] = spd[idxp];
+            dav->vls[idxpd][idxp] = sav->vls[idxpd][idxp];
+            for ( j = 0; j < n; j++ ) {
+                pages[i + j] = VMEM_PDPG(spd[idxp]) + PAGE_ADDR(j);
+            }
+            continue;
         }
 
-        /* Invalidate the page */
-        invlpg((void *)vaddr);
+        /* Pages in a page table; a superpage partially shared is split */
+        spt = _vmem_pt(g_kmem, sav, idxpd, idxp, 0, &fl, (void *)va);
+        if ( NULL == spt ) {
+            ret = -1;
+            break;
+        }
+        dpt = _vmem_pt(g_kmem, dav, idxpd, idxp, 0, &fl, (void *)va);
+        if ( NULL == dpt ) {
+            ret = -1;
+            break;
+        }
+        for ( j = 0; j < n; j++ ) {
+            if ( !VMEM_IS_PRESENT(spt[idx + j]) ) {
+                pages[i + j] = NULL;
+                continue;
+            }
+            if ( VMEM_IS_WRITABLE(spt[idx + j]) ) {
+                spt[idx + j] = VMEM_COW(spt[idx + j]);
+                _vmem_flush_add(&fl, (void *)(va + PAGE_ADDR(j)));
+            }
+            dpt[idx + j] = spt[idx + j];
+            pages[i + j] = VMEM_PT(spt[idx + j]);
+        }
     }
 
-    return 0;
+    /* Invalidate the TLB entries of the write-protected pages */
+    _vmem_flush(sav, &fl, 0);
+
+    return ret;
 }
 
 /*
- * Map a virtual page to a physical page
- * FIXME: This is redundant....  Will merge with arch_vmem_map?
+ * Look up the copy-on-write page mapped to a virtual page
+ *
+ * SYNOPSIS
+ *      void *
+ *      arch_vmem_cow_lookup(struct vmem_space *space, void *vaddr);
+ *
+ * DESCRIPTION
+ *      The arch_vmem_cow_lookup() function resolves the physical page mapped
+ *      to the virtual page vaddr of the virtual memory space space if it is a
+ *      copy-on-write page shared by arch_vmem_share_range().  The fault is
+ *      resolved by mapping the page (or its copy) with arch_vmem_map(), which
+ *      replaces the read-only entry.
+ *
+ * RETURN VALUES
+ *      The arch_vmem_cow_lookup() function returns the physical address of the
+ *      page.  It returns NULL if the virtual page is not mapped copy-on-write.
  */
-int
-arch_kmem_map(struct vmem_space *space, void *vaddr, void *paddr, int flags)
+void *
+arch_vmem_cow_lookup(struct vmem_space *space, void *vaddr)
 {
     struct arch_vmem_space *avmem;
+    u64 *pd;
+    u64 *pt;
     int idxpd;
     int idxp;
     int idx;
-    u64 *pt;
-    u64 *vpt;
 
-    /* Check the flags */
-    if ( !(VMEM_USABLE & flags) || !(VMEM_USED & flags) ) {
-        /* This page is not usable nor used, then do nothing. */
-        return -1;
-    }
-
-    /* Get the architecture-specific kernel memory manager */
+    /* Get the architecture-specific data structure */
     avmem = (struct arch_vmem_space *)space->arch;
 
     /* Index to page directory */
-    idxpd = ((u64)vaddr >> 30);
-    if ( idxpd >= KMEM_VMEM_NPD ) {
-        return -1;
+    idxpd = (reg_t)vaddr >> 30;
+    if ( idxpd >= avmem->nr ) {
+        return NULL;
     }
     /* Index to page table */
-    idxp = ((u64)vaddr >> 21) & 0x1ff;
+    idxp = ((reg_t)vaddr >> 21) & 0x1ff;
     /* Index to page entry */
-    idx = ((u64)vaddr >> 12) & 0x1ffULL;
+    idx = ((reg_t)vaddr >> 12) & 0x1ff;
 
-    /* Superpage or page? */
-    if ( VMEM_SUPERPAGE & flags ) {
+    pd = VMEM_PD(avmem->array, idxpd);
+    if ( !VMEM_IS_PRESENT(pd[idxp]) ) {
+        return NULL;
+    }
+    if ( VMEM_IS_PAGE(pd[idxp]) ) {
         /* Superpage */
-        /* Check the physical address argument */
-        if ( 0 != ((u64)paddr % SUPERPAGESIZE)
-             || 0 != ((u64)vaddr % SUPERPAGESIZE) ) {
-            /* Invalid physical address */
-            return -1;
+        if ( !VMEM_IS_COW(pd[idxp]) ) {
+            return NULL;
         }
+        return VMEM_PDPG(pd[idxp]) + PAGE_ADDR(idx);
+    }
 
-        /* Check whether the page presented */
-        if ( VMEM_IS_PRESENT(VMEM_PD(avmem->array, idxpd)[idxp])
-             && !VMEM_IS_PAGE(VMEM_PD(avmem->array, idxpd)[idxp]) ) {
-            /* Present and 4 KiB paging, then remove the descendant table */
-            pt = VMEM_PT(VMEM_PD(avmem->array, idxpd)[idxp]);
-            vpt = VMEM_PT(avmem->vls[idxpd][idxp]);
+    /* Page */
+    pt = VMEM_PT(avmem->vls[idxpd][idxp]);
+    if ( !VMEM_IS_PRESENT(pt[idx]) || !VMEM_IS_COW(pt[idx]) ) {
+        return NULL;
+    }
 
-            /* Delete descendant table */
-            _kmem_mm_page_free(g_kmem, vpt);
-        }
+    return VMEM_PT(pt[idx]);
+}
 
-        /* Remapping */
-        if ( flags & VMEM_GLOBAL ) {
-            VMEM_PD(avmem->array, idxpd)[idxp] = KMEM_PG_GRW((u64)paddr);
-            avmem->vls[idxpd][idxp] = KMEM_PG_GRW((u64)vaddr);
-        } else {
-            VMEM_PD(avmem->array, idxpd)[idxp] = KMEM_PG_RW((u64)paddr);
-            avmem->vls[idxpd][idxp] = KMEM_PG_RW((u64)vaddr);
-        }
+/*
+ * Enable the process-context identifiers on this processor
+ *
+ * SYNOPSIS
+ *      int
+ *      arch_vmem_pcid_init(void);
+ *
+ * DESCRIPTION
+ *      The arch_vmem_pcid_init() function enables the process-context
+ *      identifiers (PCIDs) on this processor if supported, so that the TLB
+ *      entries of the user spaces are kept across the task switches (see
+ *      arch_vmem_cr3()).  This must be called while CR3 holds PCID 0, and on
+ *      the bootstrap processor before the kernel pages are mapped.
+ *
+ * RETURN VALUES
+ *      The arch_vmem_pcid_init() function returns the value of 1 if the PCIDs
+ *      are enabled, or 0 if the processor does not support them.
+ */
+int
+arch_vmem_pcid_init(void)
+{
+    u64 rcx;
+    u64 rdx;
 
-        /* Invalidate the page */
-        invlpg((void *)vaddr);
-    } else {
-        /* Page */
-        /* Check the physical address argument */
-        if ( 0 != ((u64)paddr % PAGESIZE) || 0 != ((u64)vaddr % PAGESIZE) ) {
-            /* Invalid physical address */
+    /* CPUID.01H:ECX.PCID[bit 17] */
+    cpuid(1, &rcx, &rdx);
+    if ( !(rcx & (1ULL << 17)) ) {
+        return 0;
+    }
+
+    set_cr4(get_cr4() | (1ULL << CR4_PCIDE));
+    _vmem_pcid = 1;
+
+    return 1;
+}
+
+/*
+ * Resolve the value of CR3 to switch to a virtual memory space
+ *
+ * SYNOPSIS
+ *      u64
+ *      arch_vmem_cr3(struct vmem_space *space);
+ *
+ * DESCRIPTION
+ *      The arch_vmem_cr3() function resolves the value to be written to CR3 to
+ *      switch to the virtual memory space space on this processor, and records
+ *      the space as the one loaded.  The reload is skipped if the space is
+ *      already loaded (e.g., borrowed by the idle task) and its TLB entries on
+ *      this processor have not been revoked since.
+ *
+ *      With the PCIDs enabled, the space is tagged with a PCID from the pool
+ *      of this processor.  A PCID of the current generation of the pool is
+ *      reused with the no-flush bit, so the TLB entries of the space survive
+ *      the switches.  Once the pool runs out, the generation is advanced and
+ *      the whole TLB of the processor is flushed, which invalidates the PCIDs
+ *      of all the spaces.  PCID 0 is reserved for the kernel space and the
+ *      writes to CR3 outside this function, and it is flushed on every load.
+ *      This must be called with the interrupts disabled.
+ *
+ * RETURN VALUES
+ *      The arch_vmem_cr3() function returns the value for CR3.  It returns the
+ *      value of 0 if CR3 need not be reloaded.
+ */
+u64
+arch_vmem_cr3(struct vmem_space *space)
+{
+    struct arch_vmem_space *avmem;
+    struct cpu_data *pdata;
+    u64 pcid;
+    int cpu;
+
+    avmem = (struct arch_vmem_space *)space->arch;
+
+    cpu = this_cpu_id();
+    pdata = this_cpu();
+    if ( NULL == avmem->pcids || cpu < 0 || cpu >= MAX_PROCESSORS ) {
+        /* PCID 0 */
+        pdata->cur_pgt = NULL;
+        return (u64)avmem->pgt;
+    }
+
+    if ( 0 == pdata->pcid_gen ) {
+        /* Generation 0 is reserved for the invalid PCIDs */
+        pdata->pcid_gen = 1;
+        pdata->pcid_next = 1;
+    }
+    if ( VMEM_PCID_GEN(avmem->pcids[cpu]) == pdata->pcid_gen
+         && pdata->cur_pgt == avmem->pgt ) {
+        /* Already loaded with the valid TLB entries */
+        return 0;
+    }
+    if ( pdata->cur_pgt != avmem->pgt ) {
+        /* Mark the space loaded on this processor; this waits for a page of
+           the space being migrated by another processor (see
+           arch_migrate_page()) */
+        spin_lock(&avmem->lock);
+        pdata->cur_pgt = avmem->pgt;
+        spin_unlock(&avmem->lock);
+    }
+
+    if ( _vmem_pcid
+         && VMEM_PCID_GEN(avmem->pcids[cpu]) == pdata->pcid_gen ) {
+        /* Keep the TLB entries */
+        return (u64)avmem->pgt | VMEM_PCID(avmem->pcids[cpu])
+            | CR3_PCID_NOFLUSH;
+    }
+    if ( !_vmem_pcid ) {
+        /* Without the PCIDs, the generation only tells that the TLB entries
+           are valid while the space stays loaded */
+        avmem->pcids[cpu] = pdata->pcid_gen << 12;
+        return (u64)avmem->pgt;
+    }
+
+    /* Assign a new PCID */
+    if ( pdata->pcid_next > VMEM_PCID_MAX ) {
+        /* Recycle the PCIDs with the whole TLB flushed */
+        pdata->pcid_gen++;
+        pdata->pcid_next = 1;
+        _disable_page_global();
+        _enable_page_global();
+    }
+    pcid = pdata->pcid_next++;
+    avmem->pcids[cpu] = (pdata->pcid_gen << 12) | pcid;
+
+    /* Load the new PCID with the flush */
+    return (u64)avmem->pgt | pcid;
+}
+
+/*
+ * Get the upper bound of the virtual address space of the kernel memory.  The
+ * kernel memory is used under the page tables of the user spaces too (e.g.,
+ * in the system calls and the idle task), hence every page directory below
+ * this bound except for the user-land ones (1 and 2) must be shared by
+ * arch_vmem_init().
+ */
+void *
+arch_kmem_vaddr_max(void)
+{
+    return (void *)((u64)KMEM_VMEM_NPD << 30);
+}
+
+/*
+ * Zero a physical page
+ *
+ * SYNOPSIS
+ *      int
+ *      arch_clear_page(void *paddr);
+ *
+ * DESCRIPTION
+ *      The arch_clear_page() function fills the physical page specified by the
+ *      paddr argument with zeros.  The page is mapped to the window of this
+ *      processor, and is written with non-temporal stores not to pollute the
+ *      cache with the zeros.  The caller must disable interrupts because the
+ *      window is shared by the tasks running on this processor.
+ *
+ * RETURN VALUES
+ *      If successful, the arch_clear_page() function returns the value of 0.
+ *      It returns the value of -1 on failure.
+ */
+int
+arch_clear_page(void *paddr)
+{
+    void *window;
+    int cpu;
+    int ret;
+
+    cpu = this_cpu_id();
+    if ( NULL == _page_windows || cpu < 0 || cpu >= MAX_PROCESSORS ) {
+        return -1;
+    }
+    window = _page_windows + PAGE_ADDR(cpu * PAGE_WINDOWS_PER_CPU);
+
+    /* Map the page to the window of this processor (the previous mapping is
+       invalidated by arch_vmem_map()), then zero it */
+    ret = arch_vmem_map(g_kmem->space, window, paddr, VMEM_USABLE | VMEM_USED);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    kmemzero_nt(window, PAGESIZE);
+
+    return 0;
+}
+
+/*
+ * Copy a physical page
+ *
+ * SYNOPSIS
+ *      int
+ *      arch_copy_page(void *dst, void *src);
+ *
+ * DESCRIPTION
+ *      The arch_copy_page() function copies the physical page src to the
+ *      physical page dst through the two windows of this processor mapped at
+ *      once.  The caller must disable interrupts because the windows are shared
+ *      by the tasks running on this processor.
+ *
+ * RETURN VALUES
+ *      If successful, the arch_copy_page() function returns the value of 0.
+ *      It returns the value of -1 on failure.
+ */
+int
+arch_copy_page(void *dst, void *src)
+{
+    void *frames[PAGE_WINDOWS_PER_CPU];
+    void *window;
+    int cpu;
+    int ret;
+
+    cpu = this_cpu_id();
+    if ( NULL == _page_windows || cpu < 0 || cpu >= MAX_PROCESSORS ) {
+        return -1;
+    }
+    window = _page_windows + PAGE_ADDR(cpu * PAGE_WINDOWS_PER_CPU);
+
+    frames[0] = src;
+    frames[1] = dst;
+    ret = arch_vmem_map_frames(g_kmem->space, window, frames, 2,
+                               VMEM_USABLE | VMEM_USED);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    kmemcpy(window + PAGESIZE, window, PAGESIZE);
+
+    return 0;
+}
+
+/*
+ * Copy a movable physical page, and remap the virtual page to the copy
+ *
+ * SYNOPSIS
+ *      int
+ *      arch_migrate_page(struct vmem_space *space, void *vaddr, void *src,
+ *                        void *dst);
+ *
+ * DESCRIPTION
+ *      The arch_migrate_page() function copies the physical page src to the
+ *      physical page dst through the windows of this processor, and remaps the
+ *      virtual page vaddr of the virtual memory space space from src to dst.
+ *      Since the kernel does not shoot down the TLBs of the other processors,
+ *      the page is not migrated if the space is loaded on another processor.
+ *      The space is locked during the migration so that no processor loads it
+ *      until the remap revokes the TLB entries cached on the others.  The
+ *      caller must disable interrupts.
+ *
+ * RETURN VALUES
+ *      If successful, the arch_migrate_page() function returns the value of 0.
+ *      It returns the value of -1 on failure.
+ */
+int
+arch_migrate_page(struct vmem_space *space, void *vaddr, void *src, void *dst)
+{
+    struct arch_vmem_space *avmem;
+    struct cpu_data *pdata;
+    int cpu;
+    int ret;
+    int i;
+
+    cpu = this_cpu_id();
+
+    /* Keep the other processors from loading the space */
+    avmem = (struct arch_vmem_space *)space->arch;
+    spin_lock(&avmem->lock);
+
+    /* Check if the space is loaded on another processor */
+    for ( i = 0; i < MAX_PROCESSORS; i++ ) {
+        pdata = (struct cpu_data *)((u64)CPU_DATA_BASE + i * CPU_DATA_SIZE);
+        if ( i == cpu || !(pdata->flags & 1) ) {
+            continue;
+        }
+        /* Including the space borrowed by the idle task */
+        if ( pdata->cur_pgt == avmem->pgt ) {
+            spin_unlock(&avmem->lock);
             return -1;
         }
+    }
 
-        /* Check whether the page presented */
-        if ( !VMEM_IS_PRESENT(VMEM_PD(avmem->array, idxpd)[idxp])
-             || VMEM_IS_PAGE(VMEM_PD(avmem->array, idxpd)[idxp]) ) {
-            /* Not present or 2 MiB page, then create a new page table */
-            vpt = _kmem_mm_page_alloc(g_kmem);
-            if ( NULL == vpt ) {
-                return -1;
-            }
-            /* Get the virtual address */
-            pt = arch_vmem_addr_v2p(g_kmem->space, vpt);
+    /* Ensure the virtual page is still mapped to the source */
+    if ( arch_vmem_addr_v2p(space, vaddr) != src ) {
+        spin_unlock(&avmem->lock);
+        return -1;
+    }
 
-            /* Update the entry */
-            VMEM_PD(avmem->array, idxpd)[idxp] = KMEM_DIR_RW((u64)pt);
-            avmem->vls[idxpd][idxp] = KMEM_DIR_RW((u64)vpt);
-        } else {
-            /* Directory */
-            pt = VMEM_PT(VMEM_PD(avmem->array, idxpd)[idxp]);
-            vpt = VMEM_PT(avmem->vls[idxpd][idxp]);
-        }
+    /* Copy the page */
+    if ( arch_copy_page(dst, src) < 0 ) {
+        spin_unlock(&avmem->lock);
+        return -1;
+    }
 
-        /* Remapping */
-        if ( flags & VMEM_GLOBAL ) {
-            pt[idx] = KMEM_PG_GRW((u64)paddr);
-        } else {
-            pt[idx] = KMEM_PG_RW((u64)paddr);
-        }
+    /* Remap the virtual page; the TLB entry of this processor is invalidated
+       by arch_vmem_map() if the space is the current one, and the entries
+       cached on the others are revoked with the PCIDs of the space before the
+       source page is freed by the caller */
+    ret = arch_vmem_map(space, vaddr, dst, VMEM_USABLE | VMEM_USED);
+    spin_unlock(&avmem->lock);
 
-        /* Invalidate the page */
-        invlpg((void *)vaddr);
+    return ret;
+}
+
+/*
+ * Reserve the windows to zero and copy physical pages
+ */
+static int
+_page_windows_init(struct kmem *kmem)
+{
+    struct vmem_superpage *spg;
+    void *window;
+    int ret;
+
+    /* Allocate a virtual superpage for the windows without physical pages */
+    spg = vmem_grab_superpages(kmem->space, 0);
+    if ( NULL == spg ) {
+        return -1;
     }
+    window = spg->region->start + SUPERPAGE_ADDR(spg - spg->region->superpages);
+
+    /* Build the page table of the windows beforehand so that processors do not
+       race to create it; the first window temporarily maps the page at 0. */
+    ret = arch_vmem_map(kmem->space, window, NULL, VMEM_USABLE | VMEM_USED);
+    if ( ret < 0 ) {
+        vmem_return_superpages(spg);
+        return -1;
+    }
+    _page_windows = window;
 
     return 0;
 }
@@ -1464,6 +2599,10 @@ arch_vmem_addr_v2p(struct vmem_space *space, void *vaddr)
     /* Index to page entry */
     idx = ((reg_t)vaddr >> 12) & 0x1ffULL;
 
+    if ( !VMEM_IS_PRESENT(avmem->vls[idxpd][idxp]) ) {
+        /* Not mapped */
+        return NULL;
+    }
     if ( VMEM_IS_PAGE(avmem->vls[idxpd][idxp]) ) {
         /* 2-MiB paging */
         /* Get the offset */
@@ -1472,6 +2611,10 @@ arch_vmem_addr_v2p(struct vmem_space *space, void *vaddr)
     } else {
         /* 4-KiB paging */
         pt = VMEM_PT(avmem->vls[idxpd][idxp]);
+        if ( !VMEM_IS_PRESENT(pt[idx]) ) {
+            /* Not mapped */
+            return NULL;
+        }
         /* Get the offset */
         off = ((reg_t)vaddr) & 0xfffULL;
         return (void *)(VMEM_PT(pt[idx]) + off);
@@ -1495,12 +2638,12 @@ arch_vmem_init(struct vmem_space *space)
     if ( NULL == avmem ) {
         return -1;
     }
-    avmem->array = kmalloc(sizeof(u64 *) * (VMEM_NENT(VMEM_NPD) + VMEM_NPD));
+    avmem->array = kcalloc(VMEM_NENT(VMEM_NPD) + VMEM_NPD, sizeof(u64 *));
     if ( NULL == avmem->array ) {
         kfree(avmem);
         return -1;
     }
-    avmem->vls = kmalloc(sizeof(u64 *) * VMEM_NPD);
+    avmem->vls = kcalloc(VMEM_NPD, sizeof(u64 *));
     if ( NULL == avmem->vls ) {
         kfree(avmem->array);
         kfree(avmem);
@@ -1508,26 +2651,35 @@ arch_vmem_init(struct vmem_space *space)
     }
     avmem->nr = VMEM_NPD;
 
-    kmemset(avmem->array, 0, sizeof(u64 *) * (VMEM_NENT(VMEM_NPD) + VMEM_NPD));
-    kmemset(avmem->vls, 0, sizeof(u64 *) * VMEM_NPD);
+    avmem->lock = 0;
+
+    /* PCIDs on the processors; all invalid (generation 0) at first */
+    avmem->pcids = kcalloc(MAX_PROCESSORS, sizeof(u64));
+    if ( NULL == avmem->pcids ) {
+        kfree(avmem->vls);
+        kfree(avmem->array);
+        kfree(avmem);
+        return -1;
+    }
 
-    vpg = kmalloc(PAGESIZE * (VMEM_NENT(VMEM_NPD) + VMEM_NPD));
+    /* Page tables are taken from the pre-zeroed pages */
+    vpg = kcalloc(VMEM_NENT(VMEM_NPD) + VMEM_NPD, PAGESIZE);
     if ( NULL == vpg ) {
+        kfree(avmem->pcids);
         kfree(avmem->vls);
         kfree(avmem->array);
         kfree(avmem);
         return -1;
     }
-    vls = kmalloc(PAGESIZE * VMEM_NPD);
+    vls = kcalloc(VMEM_NPD, PAGESIZE);
     if ( NULL == vls ) {
         kfree(vpg);
+        kfree(avmem->pcids);
         kfree(avmem->vls);
         kfree(avmem->array);
         kfree(avmem);
         return -1;
     }
-    kmemset(vpg, 0, PAGESIZE * (VMEM_NENT(VMEM_NPD) + VMEM_NPD));
-    kmemset(vls, 0, PAGESIZE * VMEM_NPD);
 
     /* Set physical addresses to page directories */
     avmem->pgt = arch_vmem_addr_v2p(g_kmem->space, vpg);
@@ -1550,7 +2702,10 @@ arch_vmem_init(struct vmem_space *space)
         vpg[512 + i] = VMEM_DIR_RW((u64)paddr);
     }
 
-    /* Set the kernel region */
+    /* Set the kernel region; the page directories of the low memory, the
+       kernel, the pmem region and the rest of the kernel memory up to
+       arch_kmem_vaddr_max() are shared with the kernel so that the regions
+       added later are mapped in this space too. */
     tmp = g_kmem->space->arch;
     paddr = arch_vmem_addr_v2p(g_kmem->space, VMEM_PD(tmp->array, 0));
     vpg[512] = KMEM_DIR_RW((u64)paddr);
@@ -1558,9 +2713,12 @@ arch_vmem_init(struct vmem_space *space)
     vpg[512 + 3] = KMEM_DIR_RW((u64)paddr);
     paddr = arch_vmem_addr_v2p(g_kmem->space, VMEM_PD(tmp->array, 4));
     vpg[512 + 4] = KMEM_DIR_RW((u64)paddr);
+    paddr = arch_vmem_addr_v2p(g_kmem->space, VMEM_PD(tmp->array, 5));
+    vpg[512 + 5] = KMEM_DIR_RW((u64)paddr);
     avmem->vls[0] = tmp->vls[0];
     avmem->vls[3] = tmp->vls[3];
     avmem->vls[4] = tmp->vls[4];
+    avmem->vls[5] = tmp->vls[5];
 
     /* Set the architecture-specific data structure to its parent */
     space->arch = avmem;
@@ -37,8 +37,87 @@
 #define PMEM_PD         21
 #define PMEM_PT         12
 
+/* The maximum number of TLB entries invalidated one by one after the page
+   table is updated; all the entries are flushed at once beyond this */
+#define VMEM_FLUSH_MAX          32
+
+/* Initialization of the physical page array: with PMEM_DEFERRED_INIT, only
+   the pages below PMEM_INIT_BOOT_SIZE are initialized at the boot time, and
+   the others are initialized section by section later.  A section is aligned
+   to the largest block of the buddy system so that no block crosses it, and
+   it is initialized in chunks of 2^PMEM_INIT_CHUNK_ORDER pages so that the
+   idle processors disable the interrupts only briefly. */
+#define PMEM_INIT_BOOT_SIZE     0x100000000ULL
+#define PMEM_INIT_MAX_RANGES    256
+#define PMEM_SECTION_ORDER      PMEM_MAX_BUDDY_ORDER
+#define PMEM_INIT_CHUNK_ORDER   12
+#define PMEM_SECTION_PENDING    0
+#define PMEM_SECTION_BUSY       1
+#define PMEM_SECTION_READY      2
+
+/* Size of the contiguous memory zone (PMEM_ZONE_CMA) reserved below 4 GiB for
+   DMA; this must be a power of two */
+#define PMEM_CMA_SIZE           0x4000000ULL
+
+/*
+ * Batch of the virtual addresses whose TLB entries are to be invalidated
+ */
+struct vmem_flush {
+    int n;
+    void *addrs[VMEM_FLUSH_MAX];
+};
+
+/*
+ * Range of usable physical pages in a zone
+ */
+struct pmem_init_range {
+    /* Page indices of the first page and the page next to the last */
+    u64 a;
+    u64 b;
+    /* Zone */
+    int zone;
+};
+
+/*
+ * Information to initialize the physical page array, resolved from the boot
+ * information and ACPI at the boot time
+ */
+struct pmem_init {
+    /* Lock for the states of the sections */
+    spinlock_t lock;
+
+    /* Usable ranges */
+    int nranges;
+    struct pmem_init_range ranges[PMEM_INIT_MAX_RANGES];
+
+    /* Pages of the region for the physical memory manager */
+    u64 region_a;
+    u64 region_b;
+
+    /* The number of the pages initialized at the boot time */
+    u64 boot;
+
+    /* States of the sections following the pages initialized at the boot
+       time */
+    u64 nsections;
+    u8 *sections;
+    /* The number of the chunks done in each section; the pages of all the
+       chunks are initialized first, and then added to the buddy systems */
+    u32 *progress;
+
+    /* Timestamp counter at the start of the initialization */
+    u64 t0;
+};
+
 /* in memory.c */
 int arch_memory_init(struct bootinfo *, struct acpi *);
+int
+arch_vmem_share_range(struct vmem_space *, struct vmem_space *, void *, size_t,
+                      void **);
+void * arch_vmem_cow_lookup(struct vmem_space *, void *);
+int arch_vmem_pcid_init(void);
+u64 arch_vmem_cr3(struct vmem_space *);
+void arch_vmem_shootdown_ack(void);
 
 #endif /* _KERNEL_MEMORY_H */
 
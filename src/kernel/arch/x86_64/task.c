@@ -26,9 +26,38 @@
 #include "arch.h"
 #include "memory.h"
 
+/* The number of the pages shared at once by proc_fork(); the array of their
+   physical addresses fits in a page */
+#define PROC_SHARE_BATCH        (PAGESIZE / sizeof(void *))
+
 /* Kernel memory */
 extern struct kmem *g_kmem;
 
+/* Object cache of the architecture-specific task structure */
+struct kmem_cache *arch_task_cache;
+
+/* Prototype declarations of static functions */
+static int _proc_share(struct proc *, struct proc *, void *, size_t);
+static int _proc_copy(struct proc *, struct proc *, void *, size_t);
+static void * _proc_page_block(struct proc *, void *);
+
+/*
+ * Create the object cache of the architecture-specific task structure
+ */
+int
+task_cache_init(void)
+{
+    /* The register contexts are saved on different processors, so that they
+       are aligned at the cache line to avoid false sharing */
+    arch_task_cache = kmem_cache_create("arch_task", sizeof(struct arch_task),
+                                        KMEM_CACHE_LINE, NULL);
+    if ( NULL == arch_task_cache ) {
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Create a new task
  */
@@ -38,29 +67,29 @@ task_new(void)
     struct arch_task *t;
 
     /* Allocate the architecture-specific task structure of a new task */
-    t = kmalloc(sizeof(struct arch_task));
+    t = kmem_cache_alloc(arch_task_cache);
     if ( NULL == t ) {
         return NULL;
     }
     /* Allocate the kernel task structure of a new task */
     t->kstack = kmalloc(KSTACK_SIZE);
     if ( NULL == t->kstack ) {
-        kfree(t);
+        kmem_cache_free(arch_task_cache, t);
         return NULL;
     }
     /* Allocate the user stack of a new task */
     t->ustack = kmalloc(USTACK_SIZE);
     if ( NULL == t->ustack ) {
         kfree(t->kstack);
-        kfree(t);
+        kmem_cache_free(arch_task_cache, t);
         return NULL;
     }
     /* Allocate the kernel stack of a new task */
-    t->ktask = kmalloc(sizeof(struct ktask));
+    t->ktask = kmem_cache_alloc(ktask_cache);
     if ( NULL == t->ktask ) {
         kfree(t->ustack);
         kfree(t->kstack);
-        kfree(t);
+        kmem_cache_free(arch_task_cache, t);
         return NULL;
     }
     t->ktask->arch = t;
@@ -78,16 +107,19 @@ proc_fork(struct proc *op, struct ktask *ot, struct ktask **ntp)
 {
     struct arch_task *t;
     struct proc *np;
-    void *paddr1;
-    void *paddr2;
-    void *exec;
-    void *saved_cr3;
-    ssize_t i;
+    void *sp;
+    void *lb;
+    void *ub;
     int ret;
-    size_t size;
+
+    /* Check the program */
+    if ( op->code_size <= 0 ) {
+        /* Invald code */
+        return NULL;
+    }
 
     /* Create a new process */
-    np = kmalloc(sizeof(struct proc));
+    np = kmem_cache_alloc(proc_cache);
     if ( NULL == np ) {
         return NULL;
     }
@@ -96,24 +128,24 @@ proc_fork(struct proc *op, struct ktask *ot, struct ktask **ntp)
     np->code_size = op->code_size;
 
     /* Allocate the architecture-specific task structure of a new task */
-    t = kmalloc(sizeof(struct arch_task));
+    t = kmem_cache_alloc(arch_task_cache);
     if ( NULL == t ) {
-        kfree(np);
+        kmem_cache_free(proc_cache, np);
         return NULL;
     }
     /* Allocate the kernel task structure of a new task */
     t->kstack = kmalloc(KSTACK_SIZE);
     if ( NULL == t->kstack ) {
-        kfree(t);
-        kfree(np);
+        kmem_cache_free(arch_task_cache, t);
+        kmem_cache_free(proc_cache, np);
         return NULL;
     }
     /* Allocate the kernel stack of a new task */
-    t->ktask = kmalloc(sizeof(struct ktask));
+    t->ktask = kmem_cache_alloc(ktask_cache);
     if ( NULL == t->ktask ) {
         kfree(t->kstack);
-        kfree(t);
-        kfree(np);
+        kmem_cache_free(arch_task_cache, t);
+        kmem_cache_free(proc_cache, np);
         return NULL;
     }
     kmemset(t->ktask, 0, sizeof(struct ktask));
@@ -121,53 +153,8 @@ proc_fork(struct proc *op, struct ktask *ot, struct ktask **ntp)
     t->ktask->proc = np;
     t->ktask->state = KTASK_STATE_READY;
     t->ktask->next = NULL;
-    /* Allocate the user stack of a new task */
-    paddr1 = pmem_alloc_pages(PMEM_ZONE_LOWMEM,
-                              bitwidth(USTACK_SIZE / PAGESIZE));
-    if ( NULL == paddr1 ) {
-        kfree(t->ktask);
-        kfree(t->kstack);
-        kfree(t);
-        kfree(np);
-        return NULL;
-    }
-    /* For exec */
-    size = t->ktask->proc->code_size;
-    if ( size <= 0 ) {
-        /* Invald code */
-        pmem_free_pages(paddr1);
-        kfree(t->ktask);
-        kfree(t->kstack);
-        kfree(t);
-        kfree(np);
-        return NULL;
-    }
-    paddr2 = pmem_alloc_pages(PMEM_ZONE_LOWMEM,
-                              bitwidth(DIV_CEIL(size, PAGESIZE)));
-    if ( NULL == paddr2 ) {
-        pmem_free_pages(paddr1);
-        kfree(t->ktask);
-        kfree(t->kstack);
-        kfree(t);
-        kfree(np);
-        return NULL;
-    }
-    np->code_paddr = paddr2;
 
     t->ustack = ((struct arch_task *)ot->arch)->ustack;
-    exec = kmalloc(CEIL(size, PAGESIZE));
-    if ( NULL == exec ) {
-        pmem_free_pages(paddr2);
-        pmem_free_pages(paddr1);
-        kfree(t->ktask);
-        kfree(t->kstack);
-        kfree(t);
-        kfree(np);
-        return NULL;
-    }
-
-    /* Copy the user stack to the temporary buffer */
-    kmemcpy(exec, (void *)CODE_INIT, size);
 
     /* Copy the kernel stack */
     kmemcpy(t->kstack, ((struct arch_task *)ot->arch)->kstack, KSTACK_SIZE);
@@ -175,70 +162,59 @@ proc_fork(struct proc *op, struct ktask *ot, struct ktask **ntp)
     /* Create a virtual memory space */
     np->vmem = vmem_space_create();
     if ( NULL == np->vmem ) {
-        kfree(exec);
-        pmem_free_pages(paddr2);
-        pmem_free_pages(paddr1);
-        kfree(t->ktask);
+        kmem_cache_free(ktask_cache, t->ktask);
         kfree(t->kstack);
-        kfree(t);
-        kfree(np);
+        kmem_cache_free(arch_task_cache, t);
+        kmem_cache_free(proc_cache, np);
         return NULL;
     }
 
-    /* FIXME: Tempoary... */
-    for ( i = 0; i < (ssize_t)(USTACK_SIZE / PAGESIZE); i++ ) {
-        ret = arch_vmem_map(np->vmem, t->ustack + PAGE_ADDR(i),
-                            paddr1 + PAGE_ADDR(i), VMEM_USABLE | VMEM_USED);
-        if ( ret < 0 ) {
-            /* FIXME: Handle this error */
-            panic("FIXME a");
+    /* Share the program and the user stack with the parent copy-on-write
+       instead of copying them; a page is copied by proc_cow_fault() on the
+       first write to it by either process.  The user stack is shared as it is
+       because the child restarts on it, except for the pages used by this
+       system call (see task_syscall_prefault()).  They are copied now to stay
+       writable for the parent, which keeps running on them in the kernel. */
+    if ( pmem_ref_pages(op->code_paddr) < 0 ) {
+        /* FIXME: Handle this error */
+        panic("FIXME a");
+    }
+    np->code_paddr = op->code_paddr;
+    np->mem_virtual = op->mem_virtual;
+    ret = _proc_share(np, op, (void *)CODE_INIT,
+                      DIV_CEIL(op->code_size, PAGESIZE));
+    if ( ret < 0 ) {
+        /* FIXME: Handle this error */
+        panic("FIXME b");
+    }
+    sp = ((struct arch_task *)ot->arch)->syscall_sp;
+    lb = t->ustack + USTACK_SIZE;
+    ub = lb;
+    if ( sp > t->ustack && sp <= t->ustack + USTACK_SIZE ) {
+        ub = (void *)CEIL((u64)sp, PAGESIZE);
+        lb = t->ustack;
+        if ( (u64)(sp - t->ustack) > USTACK_SYSCALL_SIZE ) {
+            lb = (void *)FLOOR((u64)sp - USTACK_SYSCALL_SIZE, PAGESIZE);
         }
     }
-    for ( i = 0; i < (ssize_t)DIV_CEIL(size, PAGESIZE); i++ ) {
-        ret = arch_vmem_map(np->vmem, (void *)(CODE_INIT + PAGESIZE * i),
-                            paddr2 + PAGESIZE * i, VMEM_USABLE | VMEM_USED);
-        if ( ret < 0 ) {
-            /* FIXME: Handle this error */
-            panic("FIXME b");
-        }
+    ret = _proc_share(np, op, t->ustack, (lb - t->ustack) / PAGESIZE);
+    if ( ret >= 0 ) {
+        ret = _proc_copy(np, op, lb, (ub - lb) / PAGESIZE);
     }
-
-    /* Save the current cr3: This must be done before copying the user stack to
-       copy this variable to the new stack. */
-    saved_cr3 = get_cr3();
-
-    /* This function uses "user"-stack, not kernel stack because syscall does
-       not switch the stack pointer.  Therefore, the user stack must be copied
-       before swapping the page table.  The following function maps the physical
-       pages of the user stack of new process to a certain virtual memory space,
-       and copies the stack there. */
-    void *ustack2copy = (void *)0x90000000ULL;
-    for ( i = 0; i < (ssize_t)(USTACK_SIZE / PAGESIZE); i++ ) {
-        ret = arch_vmem_map(op->vmem, ustack2copy + PAGE_ADDR(i),
-                            paddr1 + PAGE_ADDR(i), VMEM_USABLE | VMEM_USED);
-        if ( ret < 0 ) {
-            /* FIXME: Handle this error */
-            panic("FIXME c");
-        }
+    if ( ret >= 0 ) {
+        ret = _proc_share(np, op, ub,
+                          (t->ustack + USTACK_SIZE - ub) / PAGESIZE);
+    }
+    if ( ret < 0 ) {
+        /* FIXME: Handle this error */
+        panic("FIXME c");
     }
-    kmemcpy(ustack2copy, ((struct arch_task *)ot->arch)->ustack, USTACK_SIZE);
-
-    set_cr3(((struct arch_vmem_space *)np->vmem->arch)->pgt);
-
-    /* Copy the program memory */
-    kmemcpy((void *)CODE_INIT, exec, size);
-
-    /* Restore cr3 */
-    set_cr3(saved_cr3);
 
     /* Setup the restart point */
     t->rp = (struct stackframe64 *)
         ((u64)((struct arch_task *)ot->arch)->rp + (u64)t->kstack
          - (u64)((struct arch_task *)ot->arch)->kstack);
 
-    /* Free the temporary buffers */
-    kfree(exec);
-
     t->cr3 = ((struct arch_vmem_space *)np->vmem->arch)->pgt;
     t->sp0 = (u64)t->kstack + KSTACK_SIZE - 16;
 
@@ -247,6 +223,256 @@ proc_fork(struct proc *op, struct ktask *ot, struct ktask **ntp)
     return np;
 }
 
+/*
+ * Resolve a write fault on a copy-on-write page
+ *
+ * SYNOPSIS
+ *      int
+ *      proc_cow_fault(struct proc *proc, void *vaddr);
+ *
+ * DESCRIPTION
+ *      The proc_cow_fault() function resolves the write fault at the virtual
+ *      address vaddr of the process proc if the page is shared copy-on-write
+ *      by proc_fork().  The page is copied to a new page unless no other
+ *      process shares it, in which case the page is made writable as it is.
+ *      This is called from the page fault handler with interrupts disabled.
+ *
+ * RETURN VALUES
+ *      If the fault is resolved, the proc_cow_fault() function returns the
+ *      value of 0.  It returns the value of -1 if the page is not shared
+ *      copy-on-write, or on failure.
+ */
+int
+proc_cow_fault(struct proc *proc, void *vaddr)
+{
+    void *paddr;
+    void *block;
+    void *npage;
+    int ret;
+
+    vaddr = (void *)FLOOR((u64)vaddr, PAGESIZE);
+    paddr = arch_vmem_cow_lookup(proc->vmem, vaddr);
+    if ( NULL == paddr ) {
+        return -1;
+    }
+
+    /* Check the references to the block including the page */
+    block = _proc_page_block(proc, paddr);
+    if ( pmem_page_refs(block) <= 1 ) {
+        /* Not shared any longer, then make it writable */
+        return arch_vmem_map(proc->vmem, vaddr, paddr, VMEM_USABLE | VMEM_USED);
+    }
+
+    /* Copy the page to a new page */
+    npage = pmem_policy_alloc_pages(NULL, 0, PMEM_MOVABLE);
+    if ( NULL == npage ) {
+        return -1;
+    }
+    ret = arch_copy_page(npage, paddr);
+    if ( ret < 0 ) {
+        pmem_free_pages(npage);
+        return -1;
+    }
+    ret = arch_vmem_map(proc->vmem, vaddr, npage, VMEM_USABLE | VMEM_USED);
+    if ( ret < 0 ) {
+        pmem_free_pages(npage);
+        return -1;
+    }
+    pmem_set_owner(npage, proc->vmem, vaddr);
+
+    /* Drop the reference to the shared page; the one to the program is kept
+       for its other pages */
+    if ( block != proc->code_paddr ) {
+        pmem_free_pages(block);
+    }
+
+    return 0;
+}
+
+/*
+ * Resolve a fault on a page of the user stack not touched yet
+ *
+ * SYNOPSIS
+ *      int
+ *      task_zero_fault(struct ktask *t, void *vaddr);
+ *
+ * DESCRIPTION
+ *      The task_zero_fault() function maps a zeroed page to the virtual
+ *      address vaddr if it is in the user stack of the task t, whose pages are
+ *      reserved but allocated on demand.  The guard page below the user stack
+ *      (USTACK_GUARD_SIZE) is never mapped, so that a stack overflow is caught
+ *      as a page fault.  This is called from the page fault handler with
+ *      interrupts disabled.
+ *
+ * RETURN VALUES
+ *      If the fault is resolved, the task_zero_fault() function returns the
+ *      value of 0.  It returns the value of -1 if the address is out of the
+ *      user stack, or on failure.
+ */
+int
+task_zero_fault(struct ktask *t, void *vaddr)
+{
+    struct arch_task *at;
+    void *paddr;
+    int ret;
+
+    at = (struct arch_task *)t->arch;
+    if ( NULL == at->ustack || vaddr < at->ustack
+         || vaddr >= at->ustack + USTACK_SIZE ) {
+        /* Out of the user stack */
+        return -1;
+    }
+    vaddr = (void *)FLOOR((u64)vaddr, PAGESIZE);
+
+    /* Allocate a zeroed page, which is movable by compaction */
+    paddr = pmem_policy_alloc_pages(NULL, 0, PMEM_ZERO | PMEM_MOVABLE);
+    if ( NULL == paddr ) {
+        return -1;
+    }
+    ret = arch_vmem_map(t->proc->vmem, vaddr, paddr, VMEM_USABLE | VMEM_USED);
+    if ( ret < 0 ) {
+        pmem_free_pages(paddr);
+        return -1;
+    }
+    pmem_set_owner(paddr, t->proc->vmem, vaddr);
+    t->proc->mem_resident++;
+
+    return 0;
+}
+
+/*
+ * Resolve the page faults on user pages in advance
+ *
+ * SYNOPSIS
+ *      int
+ *      task_prefault(struct ktask *t, void *vaddr, size_t len);
+ *
+ * DESCRIPTION
+ *      The task_prefault() function resolves the page faults that a write to
+ *      the len bytes from the virtual address vaddr of the task t would raise;
+ *      the pages of the user stack not touched yet are allocated by
+ *      task_zero_fault(), and the pages shared copy-on-write are copied by
+ *      proc_cow_fault().  The system calls write to the user memory in the
+ *      kernel, and a page fault raised while a lock is held or in the middle of
+ *      the physical memory allocator would re-enter the allocator from the
+ *      fault handler.  Therefore, the user memory written in such a section
+ *      must be prepared by this function beforehand.  This must be called with
+ *      interrupts disabled.
+ *
+ * RETURN VALUES
+ *      If successful, the task_prefault() function returns the value of 0.  It
+ *      returns the value of -1 if a page cannot be made present and writable.
+ */
+int
+task_prefault(struct ktask *t, void *vaddr, size_t len)
+{
+    void *va;
+    void *end;
+
+    if ( NULL == t || NULL == t->proc ) {
+        return -1;
+    }
+    end = vaddr + len;
+    if ( end < vaddr ) {
+        return -1;
+    }
+
+    for ( va = (void *)FLOOR((u64)vaddr, PAGESIZE); va < end;
+          va += PAGESIZE ) {
+        if ( NULL == arch_vmem_addr_v2p(t->proc->vmem, va) ) {
+            /* Not present */
+            if ( task_zero_fault(t, va) < 0 ) {
+                return -1;
+            }
+        } else if ( NULL != arch_vmem_cow_lookup(t->proc->vmem, va) ) {
+            /* Copy-on-write */
+            if ( proc_cow_fault(t->proc, va) < 0 ) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Prepare USTACK_SYSCALL_SIZE bytes of the user stack below the stack pointer
+ * sp of the user at the entry of a system call, so that the system call does
+ * not raise page faults on its own stack; a failure is left to the page fault
+ * handler.  The stack pointer is recorded for proc_fork().
+ */
+void
+task_syscall_prefault(void *sp)
+{
+    struct ktask *t;
+    struct arch_task *at;
+    void *lb;
+
+    t = this_ktask();
+    if ( NULL == t || NULL == t->proc ) {
+        return;
+    }
+    at = (struct arch_task *)t->arch;
+    at->syscall_sp = sp;
+    if ( NULL == at->ustack || sp <= at->ustack
+         || sp > at->ustack + USTACK_SIZE ) {
+        /* Not on the user stack */
+        return;
+    }
+    lb = at->ustack;
+    if ( (u64)(sp - at->ustack) > USTACK_SYSCALL_SIZE ) {
+        lb = sp - USTACK_SYSCALL_SIZE;
+    }
+
+    (void)task_prefault(t, lb, sp - lb);
+}
+
+/*
+ * Release the program of a process
+ *
+ * SYNOPSIS
+ *      void
+ *      proc_release_code(struct proc *proc);
+ *
+ * DESCRIPTION
+ *      The proc_release_code() function unmaps the program of the process proc
+ *      and drops the references to its pages; the pages copied on write are
+ *      released one by one, and the block of the program once.
+ *
+ * RETURN VALUES
+ *      The proc_release_code() function does not return a value.
+ */
+void
+proc_release_code(struct proc *proc)
+{
+    void *paddr;
+    size_t npg;
+    size_t i;
+
+    if ( NULL == proc->code_paddr ) {
+        return;
+    }
+
+    npg = DIV_CEIL(proc->code_size, PAGESIZE);
+    for ( i = 0; i < npg; i++ ) {
+        paddr = arch_vmem_addr_v2p(proc->vmem,
+                                   (void *)CODE_INIT + PAGE_ADDR(i));
+        if ( NULL == paddr ) {
+            continue;
+        }
+        if ( _proc_page_block(proc, paddr) != proc->code_paddr ) {
+            /* Copied on write */
+            pmem_free_pages(paddr);
+        }
+        proc->mem_resident--;
+    }
+    (void)arch_vmem_unmap_range(proc->vmem, (void *)CODE_INIT, npg);
+    proc->mem_virtual -= npg;
+
+    pmem_free_pages(proc->code_paddr);
+    proc->code_paddr = NULL;
+}
+
 /*
  * Create an idle task
  */
@@ -256,7 +482,7 @@ task_create_idle(void)
     struct arch_task *t;
 
     /* Allocate and initialize the architecture-specific kernel task */
-    t = kmalloc(sizeof(struct arch_task));
+    t = kmem_cache_alloc(arch_task_cache);
     if ( NULL == t ) {
         return NULL;
     }
@@ -266,28 +492,26 @@ task_create_idle(void)
     t->cr3 = ((struct arch_vmem_space *)g_kmem->space->arch)->pgt;
 
     /* Kernel stack */
-    t->kstack = kmalloc(KSTACK_SIZE);
+    t->kstack = kcalloc(1, KSTACK_SIZE);
     if ( NULL == t->kstack ) {
-        kfree(t);
+        kmem_cache_free(arch_task_cache, t);
         return NULL;
     }
-    kmemset(t->kstack, 0, KSTACK_SIZE);
 
     /* User stack (in the kernel space) */
-    t->ustack = kmalloc(USTACK_SIZE);
+    t->ustack = kcalloc(1, USTACK_SIZE);
     if ( NULL == t->ustack ) {
         kfree(t->kstack);
-        kfree(t);
+        kmem_cache_free(arch_task_cache, t);
         return NULL;
     }
-    kmemset(t->ustack, 0, USTACK_SIZE);
 
     /* Kernel task */
-    t->ktask = kmalloc(sizeof(struct ktask));
+    t->ktask = kmem_cache_alloc(ktask_cache);
     if ( NULL == t->ktask ) {
         kfree(t->ustack);
         kfree(t->kstack);
-        kfree(t);
+        kmem_cache_free(arch_task_cache, t);
         return NULL;
     }
     kmemset(t->ktask, 0, sizeof(struct ktask));
@@ -329,7 +553,6 @@ proc_create(const char *path, const char *name, pid_t pid)
     struct arch_task *t;
     struct ktask_list *l;
     struct proc *proc;
-    void *ppage1;
     void *ppage2;
     u64 cs;
     u64 ss;
@@ -338,7 +561,6 @@ proc_create(const char *path, const char *name, pid_t pid)
     void *exec;
     void *saved_cr3;
     int ret;
-    ssize_t i;
 
     /* Check the process table first */
     if ( NULL != proc_table->procs[pid] ) {
@@ -361,7 +583,7 @@ proc_create(const char *path, const char *name, pid_t pid)
     }
 
     /* New process */
-    proc = kmalloc(sizeof(struct proc));
+    proc = kmem_cache_alloc(proc_cache);
     if ( NULL == proc ) {
         goto error_proc;
     }
@@ -385,14 +607,14 @@ proc_create(const char *path, const char *name, pid_t pid)
     proc_table->lastpid = pid;
 
     /* Create an architecture-specific task data structure */
-    t = kmalloc(sizeof(struct arch_task));
+    t = kmem_cache_alloc(arch_task_cache);
     if ( NULL == t ) {
         goto error_arch_task;
     }
     kmemset(t, 0, sizeof(struct arch_task));
 
     /* Create a task */
-    t->ktask = kmalloc(sizeof(struct ktask));
+    t->ktask = kmem_cache_alloc(ktask_cache);
     if ( NULL == t->ktask ) {
         goto error_task;
     }
@@ -408,41 +630,27 @@ proc_create(const char *path, const char *name, pid_t pid)
         goto error_kstack;
     }
 
-    /* Prepare the user stack */
-    ppage1 = pmem_alloc_pages(PMEM_ZONE_LOWMEM,
-                              bitwidth(USTACK_SIZE / PAGESIZE));
-    if ( NULL == ppage1 ) {
-        goto error_ustack;
-    }
-
     /* Prepare exec */
-    ppage2 = pmem_alloc_pages(PMEM_ZONE_LOWMEM,
-                              bitwidth(DIV_CEIL(size, PAGESIZE)));
+    ppage2 = pmem_policy_alloc_pages(NULL,
+                                     bitwidth(DIV_CEIL(size, PAGESIZE)), 0);
     if ( NULL == ppage2 ) {
         goto error_exec;
         return -1;
     }
     proc->code_paddr = ppage2;
 
-    /* Set user stack */
+    /* Set user stack; the pages are allocated on demand by task_zero_fault()
+       on the first touch */
     t->ustack = (void *)USTACK_INIT;
-    for ( i = 0; i < (ssize_t)(USTACK_SIZE / PAGESIZE); i++ ) {
-        ret = arch_vmem_map(proc->vmem, t->ustack + PAGE_ADDR(i),
-                            ppage1 + PAGE_ADDR(i), VMEM_USABLE | VMEM_USED);
-        if ( ret < 0 ) {
-            /* FIXME: Handle this error */
-            panic("FIXME 1");
-        }
-    }
     exec = (void *)CODE_INIT;
-    for ( i = 0; i < (ssize_t)DIV_CEIL(size, PAGESIZE); i++ ) {
-        ret = arch_vmem_map(proc->vmem, exec + PAGESIZE * i,
-                            ppage2 + PAGESIZE * i, VMEM_USABLE | VMEM_USED);
-        if ( ret < 0 ) {
-            /* FIXME: Handle this error */
-            panic("FIXME 2");
-        }
+    ret = arch_vmem_map_range(proc->vmem, exec, ppage2,
+                              DIV_CEIL(size, PAGESIZE), VMEM_USABLE | VMEM_USED);
+    if ( ret < 0 ) {
+        /* FIXME: Handle this error */
+        panic("FIXME 2");
     }
+    proc->mem_resident = DIV_CEIL(size, PAGESIZE);
+    proc->mem_virtual = DIV_CEIL(size, PAGESIZE) + USTACK_SIZE / PAGESIZE;
 
     /* Temporary set the page table to the user's one to copy the exec file from
        kernel to the user space */
@@ -461,7 +669,7 @@ proc_create(const char *path, const char *name, pid_t pid)
     t->ktask->state = KTASK_STATE_READY;
 
     /* Kernel task */
-    l = kmalloc(sizeof(struct ktask_list));
+    l = kmem_cache_alloc(ktask_list_cache);
     if ( NULL == l ) {
         goto error_tl;
     }
@@ -508,21 +716,122 @@ proc_create(const char *path, const char *name, pid_t pid)
 error_tl:
     pmem_free_pages(ppage2);
 error_exec:
-    pmem_free_pages(ppage1);
-error_ustack:
     kfree(t->kstack);
 error_kstack:
-    kfree(t->ktask);
+    kmem_cache_free(ktask_cache, t->ktask);
 error_task:
-    kfree(t);
+    kmem_cache_free(arch_task_cache, t);
 error_arch_task:
     vmem_space_delete(proc->vmem);
 error_vmem:
-    kfree(proc);
+    kmem_cache_free(proc_cache, proc);
 error_proc:
     return -1;
 }
 
+/*
+ * Share npg virtual pages starting from vaddr of the process op with the
+ * process np copy-on-write, and add the references to the shared pages except
+ * for those of the program block referenced by the caller; the pages not
+ * touched by op are left to be allocated on demand
+ */
+static int
+_proc_share(struct proc *np, struct proc *op, void *vaddr, size_t npg)
+{
+    void **pages;
+    size_t n;
+    size_t i;
+    size_t j;
+    int ret;
+
+    pages = kmalloc(sizeof(void *) * PROC_SHARE_BATCH);
+    if ( NULL == pages ) {
+        return -1;
+    }
+    for ( i = 0; i < npg; i += n ) {
+        n = npg - i < PROC_SHARE_BATCH ? npg - i : PROC_SHARE_BATCH;
+        ret = arch_vmem_share_range(np->vmem, op->vmem, vaddr + PAGE_ADDR(i),
+                                    n, pages);
+        if ( ret < 0 ) {
+            kfree(pages);
+            return -1;
+        }
+        for ( j = 0; j < n; j++ ) {
+            if ( NULL == pages[j] ) {
+                continue;
+            }
+            np->mem_resident++;
+            if ( _proc_page_block(op, pages[j]) == op->code_paddr ) {
+                continue;
+            }
+            if ( pmem_ref_pages(pages[j]) < 0 ) {
+                kfree(pages);
+                return -1;
+            }
+        }
+    }
+    kfree(pages);
+
+    return 0;
+}
+
+/*
+ * Copy npg virtual pages starting from vaddr of the process op to new pages of
+ * the process np; the pages not touched by op are left to be allocated on
+ * demand
+ */
+static int
+_proc_copy(struct proc *np, struct proc *op, void *vaddr, size_t npg)
+{
+    void *va;
+    void *src;
+    void *dst;
+    size_t i;
+
+    for ( i = 0; i < npg; i++ ) {
+        va = vaddr + PAGE_ADDR(i);
+        src = arch_vmem_addr_v2p(op->vmem, va);
+        if ( NULL == src ) {
+            continue;
+        }
+        dst = pmem_policy_alloc_pages(NULL, 0, PMEM_MOVABLE);
+        if ( NULL == dst ) {
+            return -1;
+        }
+        if ( arch_copy_page(dst, src) < 0 ) {
+            pmem_free_pages(dst);
+            return -1;
+        }
+        if ( arch_vmem_map(np->vmem, va, dst, VMEM_USABLE | VMEM_USED) < 0 ) {
+            pmem_free_pages(dst);
+            return -1;
+        }
+        pmem_set_owner(dst, np->vmem, va);
+        np->mem_resident++;
+    }
+
+    return 0;
+}
+
+/*
+ * Resolve the allocation including the physical page mapped to a process; the
+ * block of the program, or the page itself for the pages of the user stack and
+ * those copied on write
+ */
+static void *
+_proc_page_block(struct proc *proc, void *paddr)
+{
+    size_t npg;
+
+    npg = 1ULL << bitwidth(DIV_CEIL(proc->code_size, PAGESIZE));
+    if ( NULL != proc->code_paddr && paddr >= proc->code_paddr
+         && paddr < proc->code_paddr + PAGE_ADDR(npg) ) {
+        return proc->code_paddr;
+    }
+
+    return paddr;
+}
+
 /*
  * Local variables:
  * tab-width: 4
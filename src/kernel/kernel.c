@@ -23,10 +23,18 @@
 
 #include <aos/const.h>
 #include "kernel.h"
+#include "rbtree.h"
 
 struct proc_table *proc_table;
 struct ktask_root *ktask_root;
 
+/* Object caches of the kernel data structures */
+struct kmem_cache *proc_cache;
+struct kmem_cache *ktask_cache;
+struct kmem_cache *ktask_list_cache;
+struct kmem_cache *fildes_cache;
+struct kmem_cache *rbtree_node_cache;
+
 /*
  * Entry point to the kernel in C for all processors, called from asm.s.
  */
@@ -38,6 +46,43 @@ kmain(void)
     }
 }
 
+/*
+ * Create the object caches of the kernel data structures
+ */
+int
+kernel_cache_init(void)
+{
+    proc_cache = kmem_cache_create("proc", sizeof(struct proc), 0, NULL);
+    if ( NULL == proc_cache ) {
+        return -1;
+    }
+    /* The tasks are updated by the schedulers of different processors, so
+       that they are aligned at the cache line to avoid false sharing */
+    ktask_cache = kmem_cache_create("ktask", sizeof(struct ktask),
+                                    KMEM_CACHE_LINE, NULL);
+    if ( NULL == ktask_cache ) {
+        return -1;
+    }
+    ktask_list_cache = kmem_cache_create("ktask_list",
+                                         sizeof(struct ktask_list), 0, NULL);
+    if ( NULL == ktask_list_cache ) {
+        return -1;
+    }
+    fildes_cache = kmem_cache_create("fildes", sizeof(struct fildes), 0,
+                                     NULL);
+    if ( NULL == fildes_cache ) {
+        return -1;
+    }
+    rbtree_node_cache = kmem_cache_create("rbtree_node",
+                                          sizeof(struct rbtree_node), 0,
+                                          rbtree_node_ctor);
+    if ( NULL == rbtree_node_cache ) {
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Local APIC timer
  * Low-level scheduler (just loading run queue)
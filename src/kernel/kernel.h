@@ -27,12 +27,17 @@
 #include <aos/const.h>
 #include <aos/types.h>
 #include <sys/resource.h>
+#include <sys/sysctl.h>
 
 #define FLOOR(val, base)        (((val) / (base)) * (base))
 #define CEIL(val, base)         ((((val) - 1) / (base) + 1) * (base))
 #define DIV_FLOOR(val, base)    ((val) / (base))
 #define DIV_CEIL(val, base)     (((val) - 1) / (base) + 1)
 
+/* Maximum number of processors; MAX_PROCESSORS of the architecture refers to
+   this */
+#define MAX_CPUS                256
+
 /* Page size: Must be consistent with the architecture's page size */
 #define PAGESIZE                4096ULL         /* 4 KiB */
 #define SUPERPAGESIZE           (1ULL << 21)    /* 2 MiB */
@@ -45,6 +50,7 @@
 
 #define PMEM_USABLE             (1)             /* Usable */
 #define PMEM_USED               (1<<1)          /* Used */
+#define PMEM_MIGRATABLE         (1<<2)          /* Movable by compaction */
 #define PMEM_IS_FREE(x)         (PMEM_USABLE == (x)->flags ? 1 : 0)
 
 #define PMEM_MAX_BUDDY_ORDER    18
@@ -55,9 +61,45 @@
 #define PMEM_ZONE_LOWMEM        1
 #define PMEM_ZONE_UMA           2
 #define PMEM_ZONE_NUMA(d)       (3 + (d))
-#define PMEM_NUM_ZONES          (3 + PMEM_NUMA_MAX_DOMAINS)
+#define PMEM_ZONE_CMA           (3 + PMEM_NUMA_MAX_DOMAINS)
+#define PMEM_NUM_ZONES          (4 + PMEM_NUMA_MAX_DOMAINS)
+#define PMEM_ZONE_DOMAIN(z)                                     \
+    ((z) >= PMEM_ZONE_NUMA(0) && (z) < PMEM_ZONE_CMA            \
+     ? (z) - PMEM_ZONE_NUMA(0) : -1)
 #define PMEM_INVAL_INDEX        0xffffffffUL
 
+/* Physical memory allocation policies */
+#define PMEM_POLICY_LOCAL       0       /* Domain of this processor first */
+#define PMEM_POLICY_PREFERRED   1       /* The specified domain first */
+#define PMEM_POLICY_INTERLEAVE  2       /* Round-robin over the domains */
+
+/* Physical memory allocation flags */
+#define PMEM_ZERO               (1)             /* Zero-filled pages */
+#define PMEM_MOVABLE            (1<<1)          /* Movable (user) pages */
+#define PMEM_NOCOMPACT          (1<<2)          /* No synchronous compaction */
+
+/* The number of the blocks searched by a compaction step */
+#define PMEM_COMPACT_SCAN       16
+
+/* The number of pre-zeroed pages kept in each zone; the pages are zeroed by the
+   idle processors */
+#define PMEM_ZERO_POOL_SIZE     512
+
+/* Per-processor page frame cache: orders up to PMEM_PCP_MAX_ORDER are served
+   from the cache of each processor, and PMEM_PCP_BATCH frames are moved
+   from/to the buddy system at once. */
+#define PMEM_PCP_MAX_ORDER      3
+#define PMEM_PCP_SIZE           15
+#define PMEM_PCP_BATCH          8
+
+/* The free pages of a zone run low below 1/2^PMEM_LOW_SHIFT of the zone, and
+   then the idle processors call the shrinkers to give memory back. */
+#define PMEM_LOW_SHIFT          6
+#define PMEM_MAX_SHRINKERS      8
+
+/* The number of buckets of the latency histograms (log2 of the TSC cycles) */
+#define PMEM_LAT_NBUCKETS       PMEM_STAT_NBUCKETS
+
 
 /* 32 (2^5) -byte is the minimum object size of a slab object */
 #define KMEM_SLAB_BASE_ORDER    5
@@ -65,6 +107,36 @@
 #define KMEM_SLAB_ORDER         6
 /* 2^16 objects in a cache */
 #define KMEM_SLAB_NR_OBJ_ORDER  4
+/* The number of objects in a magazine of the per-processor slab cache; the
+   size of a magazine is 128 bytes, and the magazines are allocated from the
+   slab of the size class KMEM_MAG_ORDER */
+#define KMEM_MAG_SIZE           14
+#define KMEM_MAG_ORDER          (7 - KMEM_SLAB_BASE_ORDER)
+/* Objects larger than this size are not cached in the per-processor
+   magazines, which keep up to 2 * KMEM_MAG_SIZE objects per processor */
+#define KMEM_MAG_MAX_OBJ_SIZE   (PAGESIZE * 4)
+/* Empty slabs are kept for reuse until a list has more than
+   KMEM_SLAB_FREE_HIGH of them, and then the list is trimmed down to
+   KMEM_SLAB_FREE_LOW; the shrinker releases all of them. */
+#define KMEM_SLAB_FREE_HIGH     4
+#define KMEM_SLAB_FREE_LOW      1
+/* Cache line size; the slabs are colored in the steps of the cache line (or
+   the alignment of the objects if larger) within the first page */
+#define KMEM_CACHE_LINE         64
+/* The maximum length of the name of an object cache */
+#define KMEM_CACHE_NAME_LEN     32
+/* The maximum number of pages of a slab of an object cache */
+#define KMEM_CACHE_MAX_PAGES    1024
+/* Segregated fit for the medium-sized objects larger than 1 KiB (2^10) and up
+   to 1 MiB (2^20); each power of two is split into 2^2 size classes, so that
+   the internal fragmentation is bounded by 1/5 of the size class. */
+#define KMEM_SFIT_MIN_ORDER     10
+#define KMEM_SFIT_MAX_ORDER     20
+#define KMEM_SFIT_NR_SUB_ORDER  2
+#define KMEM_SFIT_NCLASSES      \
+    ((KMEM_SFIT_MAX_ORDER - KMEM_SFIT_MIN_ORDER) << KMEM_SFIT_NR_SUB_ORDER)
+/* The number of the size classes of kmalloc() counted in the statistics */
+#define KMEM_NCLASSES           (KMEM_SLAB_ORDER + KMEM_SFIT_NCLASSES)
 
 #define KMEM_MAX_BUDDY_ORDER    21
 //#define KMEM_REGION_SIZE        512
@@ -76,6 +148,7 @@
 #define VMEM_USED               (1<<1)
 #define VMEM_GLOBAL             (1<<2)
 #define VMEM_SUPERPAGE          (1<<3)
+#define VMEM_FRAGMENTED         (1<<4)  /* Superpage mapped with 4 KiB pages */
 #define VMEM_IS_FREE(x)         (VMEM_USABLE == ((x)->flags & 0x3))
 #define VMEM_IS_SUPERPAGE(x)    (VMEM_SUPERPAGE & (x)->flags)
 
@@ -84,6 +157,10 @@
 #define CODE_INIT               0x40000000ULL
 #define KSTACK_SIZE             4096
 #define USTACK_SIZE             (4096 * 512)
+#define USTACK_GUARD_SIZE       4096    /* Never mapped below the user stack */
+/* Bytes of the user stack below the stack pointer prepared at the entry of a
+   system call, which runs on the user stack (see task_syscall_prefault()) */
+#define USTACK_SYSCALL_SIZE     (4096 * 4)
 
 /* Process table size */
 #define PROC_NR                 65536
@@ -103,6 +180,7 @@
 /* Tick */
 #define HZ                      100
 #define IV_LOC_TMR              0x50
+#define IV_TLB                  0xfd
 #define IV_CRASH                0xfe
 #define NR_IV                   0x100
 #define IV_IRQ(n)               (0x20 + (n))
@@ -172,6 +250,9 @@ struct vmem_page {
     /* Buddy system */
     struct vmem_page *next;
     struct vmem_page *prev;
+    /* Owner of the page in the kernel memory; the slab header if the page
+       belongs to a slab, otherwise NULL */
+    void *owner;
 };
 
 /*
@@ -196,6 +277,9 @@ struct vmem_superpage {
     int flags;
     /* Back-link to the corresponding region */
     struct vmem_region *region;
+    /* Owner of the superpage in the kernel memory; the slab header if the
+       superpage belongs to a slab, otherwise NULL */
+    void *owner;
     /* Buddy system */
     struct vmem_superpage *next;
     struct vmem_superpage *prev;
@@ -239,32 +323,141 @@ struct vmem_space {
 };
 
 /*
- * Physical page
+ * Physical page (14 bytes per 4 KiB page, or 6 bytes with the bitmap backend).
+ * The buddy system maintains the order and the used flag only at the first page
+ * of each block, and the other pages of the block have PMEM_INVAL_BUDDY_ORDER
+ * so that a split or a merge touches only the heads.  The free lists are doubly
+ * linked with page indices.  The reference counter of the pages shared by
+ * copy-on-write takes 2 bytes of them.
  */
 struct pmem_page {
     u16 zone;
     u8 flags;
     /* Buddy system */
     u8 order;
+#ifndef PMEM_BUDDY_BITMAP
+    u32 prev;
     u32 next;
+#endif
+    /* References to the block in addition to the one of its allocator; this
+       is held by the first page of the block */
+    u16 refcnt;
 } __attribute__((packed));
 
+/*
+ * Reverse mapping of a movable page to the virtual page that maps it, used to
+ * remap the page when it is migrated by compaction
+ */
+struct pmem_rmap {
+    struct vmem_space *space;
+    void *vaddr;
+};
+
+#ifdef PMEM_BUDDY_BITMAP
+/*
+ * Hierarchical bitmap of the free blocks at an order; a bit of levels[0] is set
+ * if the block is free, and a bit of levels[l + 1] is set if the corresponding
+ * word of levels[l] is non-zero.  The top level consists of a single word.
+ */
+#define PMEM_BITMAP_MAX_LEVELS  6
+struct pmem_bitmap {
+    int nlevels;
+    u64 nwords[PMEM_BITMAP_MAX_LEVELS];
+    u64 *levels[PMEM_BITMAP_MAX_LEVELS];
+};
+
+/*
+ * Buddy system (bitmap backend); the bitmaps are shared by all the zones, and
+ * each zone searches the range of its pages.
+ */
+struct pmem_buddy {
+    /* Range of the page indices of this zone */
+    u32 start;
+    u32 end;
+};
+#else
 /*
  * Buddy system
  */
 struct pmem_buddy {
     u32 heads[PMEM_MAX_BUDDY_ORDER + 1];
+    /* Range of the page indices of this zone */
+    u32 start;
+    u32 end;
 };
+#endif
 
 /*
  * Memory zone
  */
 struct pmem_zone {
+    /* Lock for the buddy system of this zone */
+    spinlock_t lock;
     /* Buddy system */
     struct pmem_buddy buddy;
-    /* Statistics */
+    /* Pool of pre-zeroed pages (page indices) */
+    u32 nzeroed;
+    u32 zeroed[PMEM_ZERO_POOL_SIZE];
+    /* The number of the compaction steps left to the idle processors, set
+       when a superpage allocation fails, and the block where the next step
+       resumes the search */
+    int compact;
+    u32 cursor;
+    /* Statistics (the number of usable pages, the pages out of the buddy
+       system, and the free blocks at each order) */
     size_t total;
     size_t used;
+    u32 nfree[PMEM_MAX_BUDDY_ORDER + 1];
+};
+
+/*
+ * Per-processor cache of page frames (one cache line for each order)
+ */
+struct pmem_pcp_cache {
+    /* The number of cached frames */
+    u32 nr;
+    /* Page indexes of the cached frames */
+    u32 frames[PMEM_PCP_SIZE];
+} __attribute__ ((aligned(64)));
+
+/*
+ * Per-processor data of the physical memory manager
+ */
+struct pmem_pcpu {
+    struct pmem_pcp_cache caches[PMEM_NUM_ZONES][PMEM_PCP_MAX_ORDER + 1];
+    /* The number of policy-based allocations served by the buddy system or
+       the page frame cache of the first zone of the fallback chain (hit) or
+       of the other zones (miss), counted at the first zone; the pages taken
+       from the pre-zeroed pools or lent from the contiguous memory zone, and
+       the blocks rebuilt by compaction are not counted */
+    u64 hit[PMEM_NUM_ZONES];
+    u64 miss[PMEM_NUM_ZONES];
+    /* Superpage allocations served directly, served after compaction, and
+       failed (the caller falls back to 4 KiB pages) */
+    u64 sp_direct;
+    u64 sp_compacted;
+    u64 sp_fallback;
+    /* The number of pages migrated by compaction */
+    u64 migrated;
+    /* The number of allocations, failed allocations, and deallocations */
+    u64 nalloc[PMEM_NUM_ZONES];
+    u64 nfail[PMEM_NUM_ZONES];
+    u64 nrelease[PMEM_NUM_ZONES];
+    /* Latency histograms of pmem_alloc_pages() and pmem_free_pages() */
+    u64 alloc_cycles[PMEM_LAT_NBUCKETS];
+    u64 free_cycles[PMEM_LAT_NBUCKETS];
+};
+
+/*
+ * Physical memory allocation policy
+ */
+struct pmem_policy {
+    /* PMEM_POLICY_* */
+    int mode;
+    /* Preferred domain for PMEM_POLICY_PREFERRED */
+    int domain;
+    /* Next domain for PMEM_POLICY_INTERLEAVE */
+    int next;
 };
 
 /*
@@ -292,8 +485,35 @@ struct pmem {
     /* Physical pages */
     struct pmem_page *pages;
 
+    /* Reverse mappings of the physical pages */
+    struct pmem_rmap *rmaps;
+
+    /* The number of sections of the pages whose initialization is deferred
+       (see arch_memory_init_deferred()) */
+    volatile u64 ndeferred;
+
+    /* TSC cycles spent to initialize the pages at the boot time and in the
+       deferred sections, and elapsed until all the pages are initialized */
+    u64 init_boot_cycles;
+    u64 init_deferred_cycles;
+    u64 init_elapsed_cycles;
+
     /* Zones (NUMA domains) */
     struct pmem_zone zones[PMEM_NUM_ZONES];
+
+    /* Per-processor page frame caches */
+    struct pmem_pcpu pcpu[MAX_CPUS];
+
+    /* Shrinkers, which release the memory cached by the other subsystems, and
+       the flag set when the free pages run low */
+    int (*shrinkers[PMEM_MAX_SHRINKERS])(void);
+    int nshrinkers;
+    volatile int shrink;
+
+#ifdef PMEM_BUDDY_BITMAP
+    /* Bitmaps of the free blocks for each order */
+    struct pmem_bitmap bitmaps[PMEM_MAX_BUDDY_ORDER + 1];
+#endif
 };
 
 /*
@@ -302,16 +522,26 @@ struct pmem {
  *    object 0
  *    object 1
  *    ...
+ * The slab_hdr of the large objects is allocated apart from the objects.
  */
 struct kmem_slab {
     /* slab_hdr */
     struct kmem_slab *next;
+    struct kmem_slab *prev;
+    /* Object cache of this slab; NULL for the generic slabs */
+    struct kmem_cache *cache;
+    /* Size class (the order of the object size minus KMEM_SLAB_BASE_ORDER) of
+       a generic slab; -1 for the slab of an object cache */
+    short order;
+    /* The number of pages of this slab */
+    u16 npages;
+    /* Object size */
+    u32 size;
     int nr;
     int nused;
-    int free;
     void *obj_head;
-    /* Free marks follows (nr byte) */
-    u8 marks[0];
+    /* Bitmap of the free objects follows (a bit set for each free object) */
+    u64 bitmap[0];
     /* Objects follows */
 } __attribute__ ((packed));
 
@@ -322,7 +552,101 @@ struct kmem_slab_free_list {
     struct kmem_slab *partial;
     struct kmem_slab *full;
     struct kmem_slab *free;
-} __attribute__ ((packed));
+    /* The number of the slabs in the free list */
+    int nfree;
+};
+
+/*
+ * Magazine of slab objects
+ */
+struct kmem_magazine {
+    struct kmem_magazine *next;
+    /* The number of objects in this magazine */
+    int nr;
+    void *objs[KMEM_MAG_SIZE];
+};
+
+/*
+ * Per-processor magazines of a size class: the loaded magazine and the
+ * previously loaded one
+ */
+struct kmem_mag_cache {
+    struct kmem_magazine *loaded;
+    struct kmem_magazine *prev;
+};
+
+/*
+ * Per-processor slab cache (touched only by its own processor)
+ */
+struct kmem_slab_pcpu {
+    struct kmem_mag_cache caches[KMEM_SLAB_ORDER];
+} __attribute__ ((aligned(64)));
+
+/*
+ * Per-processor counters of a size class (see struct kmem_class_stat)
+ */
+struct kmem_class_counter {
+    u64 nalloc_fast;
+    u64 nalloc_slow;
+    u64 nfree_fast;
+    u64 nfree_slow;
+    u64 nslab_created;
+    u64 nslab_released;
+    u64 lock_cycles;
+};
+
+/*
+ * Per-processor counters of the kernel memory allocator (touched only by its
+ * own processor)
+ */
+struct kmem_stat_pcpu {
+    struct kmem_class_counter classes[KMEM_NCLASSES];
+} __attribute__ ((aligned(64)));
+
+/*
+ * Depot of the magazines shared by all the processors
+ */
+struct kmem_depot {
+    spinlock_t lock;
+    /* Full and empty magazines */
+    struct kmem_magazine *full;
+    struct kmem_magazine *empty;
+} __attribute__ ((aligned(64)));
+
+/*
+ * Object cache
+ */
+struct kmem_cache {
+    /* Name */
+    char name[KMEM_CACHE_NAME_LEN];
+    /* Object size (rounded up to the alignment) and alignment */
+    size_t size;
+    size_t align;
+    /* Constructor */
+    void (*ctor)(void *);
+    /* The number of pages of a slab, and the number of objects in a slab */
+    int npages;
+    int nr;
+    /* Set if the slab header is allocated apart from the objects, so that the
+       large objects are packed in the pages */
+    int offslab;
+    /* Color of the next slab */
+    unsigned int color;
+    /* Size class in the statistics; -1 if not counted */
+    int stat;
+
+    /* Slabs of this cache */
+    spinlock_t lock;
+    struct kmem_slab_free_list slabs;
+
+    /* Magazine depot and per-processor magazines (MAX_CPUS entries; NULL if
+       the objects are not cached in the magazines) */
+    struct kmem_depot depot;
+    struct kmem_mag_cache *pcpu;
+
+    /* Next cache */
+    struct kmem_cache *next;
+};
 
 /*
  * Root data structure of slab objects
@@ -330,6 +654,18 @@ struct kmem_slab_free_list {
 struct kmem_slab_root {
     /* Generic slabs */
     struct kmem_slab_free_list gslabs[KMEM_SLAB_ORDER];
+    /* Magazine depots */
+    struct kmem_depot depots[KMEM_SLAB_ORDER];
+    /* Colors of the next generic slabs */
+    unsigned int colors[KMEM_SLAB_ORDER];
+    /* Per-processor magazines */
+    struct kmem_slab_pcpu pcpu[MAX_CPUS];
+    /* Object caches */
+    struct kmem_cache *caches;
+    /* Object caches of the size classes of the segregated fit */
+    struct kmem_cache *sfit[KMEM_SFIT_NCLASSES];
+    /* Per-processor counters (MAX_CPUS entries; NULL until kmem_init()) */
+    struct kmem_stat_pcpu *stats;
 };
 
 /*
@@ -387,6 +723,19 @@ struct kmem {
     struct pmem *pmem;
 };
 
+/*
+ * Physically contiguous buffer for DMA
+ */
+struct kmem_dma {
+    /* Kernel-virtual and physical addresses */
+    void *vaddr;
+    void *paddr;
+    /* Size in bytes */
+    size_t size;
+    /* Virtual superpages mapping the buffer */
+    struct vmem_superpage *spg;
+};
+
 /*
  * Pager
  */
@@ -430,6 +779,11 @@ struct proc {
     void *code_paddr;
     size_t code_size;
 
+    /* The number of the pages mapped to physical pages (resident), and that
+       of the pages reserved in the virtual memory space */
+    size_t mem_resident;
+    size_t mem_virtual;
+
     /* Exit status */
     int exit_status;
 };
@@ -511,6 +865,11 @@ struct kernel_variables {
 extern struct pmem *pmem;
 extern struct proc_table *proc_table;
 extern struct ktask_root *ktask_root;
+extern struct kmem_cache *proc_cache;
+extern struct kmem_cache *ktask_cache;
+extern struct kmem_cache *ktask_list_cache;
+extern struct kmem_cache *fildes_cache;
+extern struct kmem_cache *rbtree_node_cache;
 
 /* for variable-length arguments */
 typedef __builtin_va_list va_list;
@@ -523,6 +882,7 @@ typedef __builtin_va_list va_list;
 
 /* in kernel.c */
 void kernel(void);
+int kernel_cache_init(void);
 int kstrcmp(const char *, const char *);
 size_t kstrlen(const char *);
 char * kstrcpy(char *, const char *);
@@ -548,7 +908,14 @@ void sched_high(void);
 int pmem_init(struct pmem *);
 int kmem_init(void);
 void * kmalloc(size_t);
+void * kcalloc(size_t, size_t);
 void kfree(void *);
+struct kmem_cache *
+kmem_cache_create(const char *, size_t, size_t, void (*)(void *));
+void * kmem_cache_alloc(struct kmem_cache *);
+void kmem_cache_free(struct kmem_cache *, void *);
+int kmem_shrink(void);
+void kmem_stat(struct kmem_stat *);
 struct vmem_region * vmem_region_create(void);
 struct vmem_space * vmem_space_create(void);
 void vmem_space_delete(struct vmem_space *);
@@ -566,16 +933,38 @@ struct vmem_superpage * vmem_grab_superpages(struct vmem_space *, int);
 void vmem_return_superpages(struct vmem_superpage *);
 struct vmem_page * vmem_grab_pages(struct vmem_space *, int);
 void vmem_return_pages(struct vmem_page *);
+struct vmem_page * vmem_lookup_page(struct vmem_space *, void *);
+struct vmem_superpage * vmem_lookup_superpage(struct vmem_space *, void *);
 
 /* in kmem.c */
-void * kmem_alloc_pages(struct kmem *, size_t);
+void * kmem_alloc_pages(struct kmem *, size_t, int);
 void kmem_free_pages(struct kmem *, void *);
+int kmem_dma_alloc(struct kmem *, size_t, struct kmem_dma *);
+void kmem_dma_free(struct kmem *, struct kmem_dma *);
 
 /* in pmem.c */
 void * pmem_alloc_pages(int, int);
 void * pmem_alloc_page(int);
 void * pmem_alloc_superpage(int);
+void * pmem_policy_alloc_pages(struct pmem_policy *, int, int);
 void pmem_free_pages(void *);
+size_t pmem_alloc_pages_bulk(int, int, size_t, void **);
+size_t
+pmem_policy_alloc_pages_bulk(struct pmem_policy *, int, int, size_t, void **);
+void pmem_free_pages_bulk(size_t, void **);
+int pmem_zero_pool_fill(void);
+void pmem_set_owner(void *, struct vmem_space *, void *);
+int pmem_ref_pages(void *);
+int pmem_page_refs(void *);
+void * pmem_compact(int, int);
+void * pmem_alloc_contig_pages(int);
+int pmem_compact_background(void);
+int pmem_register_shrinker(int (*)(void));
+int pmem_shrink_background(void);
+void pmem_stat(struct pmem_stat *);
+size_t pmem_buddy_size(size_t);
+void pmem_buddy_init(struct pmem *, void *);
+void pmem_buddy_add(struct pmem *, size_t, int);
 
 /* in ramfs.c */
 int ramfs_init(u64 *);
@@ -597,10 +986,15 @@ void * sys_mmap(void *, size_t, int, int, int, off_t);
 int sys_munmap(void *, size_t);
 off_t sys_lseek(int, off_t, int);
 int sys_sysarch(int, void *);
+int sys___sysctl(const int *, unsigned int, void *, size_t *, const void *,
+                 size_t);
 
 /* The followings are mandatory functions for the kernel and should be
    implemented somewhere in arch/<arch_name>/ */
 reg_t bitwidth(reg_t);
+int this_cpu_id(void);
+int this_cpu_domain(void);
+u64 rdtsc(void);
 struct ktask * this_ktask(void);
 void set_next_ktask(struct ktask *);
 void set_next_idle(void);
@@ -608,14 +1002,23 @@ void panic(const char *);
 void halt(void);
 struct proc * proc_fork(struct proc *, struct ktask *, struct ktask **);
 void task_set_return(struct ktask *, unsigned long long);
+int task_prefault(struct ktask *, void *, size_t);
 pid_t sys_fork(void);
 void spin_lock(u32 *);
 void spin_unlock(u32 *);
 int arch_vmem_map(struct vmem_space *, void *, void *, int);
-int arch_kmem_map(struct vmem_space *, void *, void *, int);
+int arch_vmem_map_range(struct vmem_space *, void *, void *, size_t, int);
+int arch_vmem_map_frames(struct vmem_space *, void *, void **, size_t, int);
+int arch_vmem_unmap_range(struct vmem_space *, void *, size_t);
+int arch_vmem_prepare_range(struct vmem_space *, void *, size_t);
+void * arch_kmem_vaddr_max(void);
 int arch_address_width(void);
 void * arch_vmem_addr_v2p(struct vmem_space *, void *);
 int arch_vmem_init(struct vmem_space *);
+int arch_clear_page(void *);
+int arch_copy_page(void *, void *);
+int arch_migrate_page(struct vmem_space *, void *, void *, void *);
+int arch_memory_init_deferred(int);
 
 
 int run_experiment(int);
@@ -24,21 +24,27 @@
 #include <aos/const.h>
 #include "kernel.h"
 
-/* ToDo: Implement segregated fit */
+/* The number of physical pages allocated at once to back virtual pages */
+#define KMEM_BULK_BATCH         16
 
+/* The minimum number of superpages of a region added to the kernel memory;
+   the first superpage holds the data structures of the region. */
+#define KMEM_REGION_MIN_SPGS    64
 
 /* Prototype declarations */
-static void * _kmem_alloc_superpages(struct kmem *, int);
-static void * _kmem_alloc_pages(struct kmem *, int);
-static void * _kmem_alloc_superpages_from_new_region(struct kmem *, int);
-static void * _kmem_alloc_pages_from_new_region(struct kmem *, int);
-static void * _kmem_alloc_pages_from_new_superpage(struct kmem *, int);
+static void * _kmem_alloc_superpages(struct kmem *, int, int);
+static void * _kmem_alloc_pages(struct kmem *, int, int);
+static int _kmem_add_region(struct kmem *, int);
+static struct vmem_superpage * _kmem_grab_superpages(struct kmem *, int);
+static void * _kmem_alloc_pages_from_new_superpage(struct kmem *, int, int);
+static int _kmem_map_new_pages(struct kmem *, void *, size_t, int, int);
+static void _kmem_release_pages(struct kmem *, void *, size_t);
 
 /*
- * Allocate pages
+ * Allocate pages; flags are passed to the physical memory allocator
  */
 void *
-kmem_alloc_pages(struct kmem *kmem, size_t npg)
+kmem_alloc_pages(struct kmem *kmem, size_t npg, int flags)
 {
     int order;
     void *vaddr;
@@ -49,19 +55,192 @@ kmem_alloc_pages(struct kmem *kmem, size_t npg)
     /* Check the order */
     if ( order >= SP_SHIFT ) {
         /* Allocate virtual superpages */
-        vaddr = _kmem_alloc_superpages(kmem, order - SP_SHIFT);
+        vaddr = _kmem_alloc_superpages(kmem, order - SP_SHIFT, flags);
     } else {
         /* Allocate virtual pages */
-        vaddr = _kmem_alloc_pages(kmem, order);
+        vaddr = _kmem_alloc_pages(kmem, order, flags);
     }
 
     return vaddr;
 }
 
+/*
+ * Free pages
+ *
+ * SYNOPSIS
+ *      void
+ *      kmem_free_pages(struct kmem *kmem, void *ptr);
+ *
+ * DESCRIPTION
+ *      The kmem_free_pages() function releases the pages (or superpages)
+ *      allocated by kmem_alloc_pages() and pointed by ptr.  The mappings are
+ *      removed first with the TLB entries invalidated on all the processors,
+ *      and then the physical pages are returned to the physical memory
+ *      allocator and the virtual pages to the buddy system of the region.  The
+ *      caller must hold the slab lock of kmem.
+ *
+ * RETURN VALUES
+ *      The kmem_free_pages() function does not return a value.
+ */
 void
 kmem_free_pages(struct kmem *kmem, void *ptr)
 {
-    panic("FIXME: kmem_free_pages()");
+    struct vmem_superpage *spg;
+    struct vmem_page *pg;
+    void *paddr;
+    size_t n;
+    size_t i;
+
+    spg = vmem_lookup_superpage(kmem->space, ptr);
+    if ( NULL == spg || VMEM_IS_FREE(spg) || !(VMEM_USABLE & spg->flags) ) {
+        /* Not allocated */
+        return;
+    }
+
+    if ( !VMEM_IS_SUPERPAGE(spg) ) {
+        /* Pages */
+        pg = vmem_lookup_page(kmem->space, ptr);
+        if ( NULL == pg || VMEM_IS_FREE(pg) || NULL != pg->owner
+             || 0 != (PAGE_INDEX(ptr) & ((1ULL << pg->order) - 1))
+             || 0 != ((reg_t)ptr & (PAGESIZE - 1)) ) {
+            /* Not the head of allocated pages, or a slab */
+            return;
+        }
+        n = 1ULL << pg->order;
+        _kmem_release_pages(kmem, ptr, n);
+        vmem_return_pages(pg);
+        return;
+    }
+
+    /* Superpages */
+    if ( VMEM_INVAL_BUDDY_ORDER == spg->order
+         || 0 != ((spg - spg->region->superpages) & ((1ULL << spg->order) - 1))
+         || 0 != ((reg_t)ptr & (SUPERPAGESIZE - 1)) ) {
+        /* Reserved, or not the head of allocated superpages */
+        return;
+    }
+    n = 1ULL << spg->order;
+    if ( VMEM_FRAGMENTED & spg->flags ) {
+        /* Mapped with 4 KiB pages */
+        _kmem_release_pages(kmem, ptr, n << SP_SHIFT);
+        for ( i = 0; i < n; i++ ) {
+            spg[i].flags &= ~VMEM_FRAGMENTED;
+        }
+    } else {
+        /* Physically contiguous superpages */
+        paddr = arch_vmem_addr_v2p(kmem->space, ptr);
+        arch_vmem_unmap_range(kmem->space, ptr, n << SP_SHIFT);
+        pmem_free_pages(paddr);
+    }
+    vmem_return_superpages(spg);
+}
+
+/*
+ * Allocate a physically contiguous buffer for DMA
+ *
+ * SYNOPSIS
+ *      int
+ *      kmem_dma_alloc(struct kmem *kmem, size_t size, struct kmem_dma *dma);
+ *
+ * DESCRIPTION
+ *      The kmem_dma_alloc() function allocates physically contiguous pages of
+ *      at least size bytes below 4 GiB with pmem_alloc_contig_pages(), and
+ *      maps them to virtual superpages of the kernel memory, which is extended
+ *      with a new region if it has no free superpage.  The kernel-virtual and
+ *      physical addresses of the buffer are stored to the structure pointed by
+ *      dma.  A buffer smaller than a superpage still occupies a whole virtual
+ *      superpage.
+ *
+ * RETURN VALUES
+ *      If successful, the kmem_dma_alloc() function returns the value of 0.
+ *      It returns the value of -1 on failure.
+ */
+int
+kmem_dma_alloc(struct kmem *kmem, size_t size, struct kmem_dma *dma)
+{
+    struct vmem_superpage *spg;
+    void *vaddr;
+    void *paddr;
+    int order;
+    int ret;
+
+    /* Calculate the order in the buddy system from the size */
+    if ( 0 == size ) {
+        return -1;
+    }
+    order = bitwidth(DIV_CEIL(size, PAGESIZE));
+
+    /* Allocate virtual superpages */
+    spin_lock(&kmem->slab_lock);
+    spg = _kmem_grab_superpages(kmem, order > SP_SHIFT ? order - SP_SHIFT : 0);
+    spin_unlock(&kmem->slab_lock);
+    if ( NULL == spg ) {
+        return -1;
+    }
+    vaddr = spg->region->start + SUPERPAGE_ADDR(spg - spg->region->superpages);
+
+    /* Allocate physical memory */
+    paddr = pmem_alloc_contig_pages(order);
+    if ( NULL == paddr ) {
+        goto error_pmem;
+    }
+
+    /* Map the physical and virtual memory; mapped with superpages if the
+       buffer is not smaller than a superpage */
+    ret = arch_vmem_map_range(kmem->space, vaddr, paddr, 1ULL << order,
+                              spg->flags);
+    if ( ret < 0 ) {
+        goto error_map;
+    }
+
+    dma->vaddr = vaddr;
+    dma->paddr = paddr;
+    dma->size = PAGE_ADDR(1ULL << order);
+    dma->spg = spg;
+
+    return 0;
+
+error_map:
+    /* Remove the mappings made up to the failure before the release */
+    arch_vmem_unmap_range(kmem->space, vaddr, 1ULL << order);
+    pmem_free_pages(paddr);
+error_pmem:
+    spin_lock(&kmem->slab_lock);
+    vmem_return_superpages(spg);
+    spin_unlock(&kmem->slab_lock);
+    return -1;
+}
+
+/*
+ * Release a physically contiguous buffer for DMA
+ *
+ * SYNOPSIS
+ *      void
+ *      kmem_dma_free(struct kmem *kmem, struct kmem_dma *dma);
+ *
+ * DESCRIPTION
+ *      The kmem_dma_free() function releases the buffer allocated by
+ *      kmem_dma_alloc().  The mappings are removed with the TLB entries
+ *      invalidated on all the processors, and then the physical pages are
+ *      returned to the contiguous memory zone, where they are lent to movable
+ *      pages again.
+ *
+ * RETURN VALUES
+ *      The kmem_dma_free() function does not return a value.
+ */
+void
+kmem_dma_free(struct kmem *kmem, struct kmem_dma *dma)
+{
+    spin_lock(&kmem->slab_lock);
+    /* Remove the mappings before the release */
+    arch_vmem_unmap_range(kmem->space, dma->vaddr, dma->size / PAGESIZE);
+    pmem_free_pages(dma->paddr);
+    vmem_return_superpages(dma->spg);
+    spin_unlock(&kmem->slab_lock);
+    dma->vaddr = NULL;
+    dma->paddr = NULL;
+    dma->size = 0;
+    dma->spg = NULL;
 }
 
 
@@ -69,7 +248,7 @@ kmem_free_pages(struct kmem *kmem, void *ptr)
  * Allocate superpages
  */
 static void *
-_kmem_alloc_superpages(struct kmem *kmem, int order)
+_kmem_alloc_superpages(struct kmem *kmem, int order, int pflags)
 {
     struct vmem_superpage *spg;
     void *vaddr;
@@ -78,33 +257,43 @@ _kmem_alloc_superpages(struct kmem *kmem, int order)
     int ret;
 
     /* Allocate virtual superpages */
-    spg = vmem_grab_superpages(kmem->space, order);
+    spg = _kmem_grab_superpages(kmem, order);
     if ( NULL == spg ) {
-        /* No matching superpage found, then try to create a new region */
-        return _kmem_alloc_superpages_from_new_region(kmem, order);
+        return NULL;
     }
     /* Superpage(s) are properly allocated, then try to allocate physical pages
        and set page table */
     vaddr = spg->region->start + SUPERPAGE_ADDR(spg - spg->region->superpages);
 
-    /* Allocate physical memory */
-    paddr = pmem_alloc_pages(PMEM_ZONE_LOWMEM, order + SP_SHIFT);
+    /* Allocate physical memory; this may be called with the slab lock held,
+       so the zones are not compacted here but by the idle processors */
+    paddr = pmem_policy_alloc_pages(NULL, order + SP_SHIFT,
+                                    pflags | PMEM_NOCOMPACT);
     if ( NULL == paddr ) {
-        /* Release the virtual memory */
-        vmem_return_superpages(spg);
-        return NULL;
-    }
-
-    /* Map the physical and virtual memory */
-    for ( i = 0; i < (1LL << order); i++ ) {
-        ret = arch_kmem_map(kmem->space, vaddr + SUPERPAGE_ADDR(i),
-                            paddr + SUPERPAGE_ADDR(i), spg->flags);
+        /* No contiguous physical memory, then fall back to 4 KiB pages */
+        ret = _kmem_map_new_pages(kmem, vaddr,
+                                  SUPERPAGE_ADDR(1ULL << order) / PAGESIZE,
+                                  spg->flags & ~VMEM_SUPERPAGE, pflags);
         if ( ret < 0 ) {
-            /* Release the virtual and physical memory */
+            /* Release the virtual memory */
             vmem_return_superpages(spg);
-            pmem_free_pages(paddr);
             return NULL;
         }
+        for ( i = 0; i < (1LL << order); i++ ) {
+            spg[i].flags |= VMEM_FRAGMENTED;
+        }
+        return vaddr;
+    }
+
+    /* Map the physical and virtual memory */
+    ret = arch_vmem_map_range(kmem->space, vaddr, paddr,
+                              SUPERPAGE_ADDR(1ULL << order) / PAGESIZE,
+                              spg->flags);
+    if ( ret < 0 ) {
+        /* Release the virtual and physical memory */
+        vmem_return_superpages(spg);
+        pmem_free_pages(paddr);
+        return NULL;
     }
 
     return vaddr;
@@ -114,19 +303,17 @@ _kmem_alloc_superpages(struct kmem *kmem, int order)
  * Allocate pages
  */
 static void *
-_kmem_alloc_pages(struct kmem *kmem, int order)
+_kmem_alloc_pages(struct kmem *kmem, int order, int pflags)
 {
     struct vmem_page *pg;
     void *vaddr;
-    void *paddr;
-    ssize_t i;
     int ret;
 
     /* Try to grab pages from the kernel memory space */
     pg = vmem_grab_pages(kmem->space, order);
     if ( NULL == pg ) {
         /* No available pages, then try to grab from superpage  */
-        return _kmem_alloc_pages_from_new_superpage(kmem, order);
+        return _kmem_alloc_pages_from_new_superpage(kmem, order, pflags);
     }
 
     /* Found */
@@ -134,77 +321,127 @@ _kmem_alloc_pages(struct kmem *kmem, int order)
         + SUPERPAGE_ADDR(pg->superpage - pg->superpage->region->superpages)
         + PAGE_ADDR(pg - pg->superpage->u.page.pages);
 
-    /* Allocate physical memory */
-    paddr = pmem_alloc_pages(PMEM_ZONE_LOWMEM, order);
-    if ( NULL == paddr ) {
+    /* Allocate physical memory and map it */
+    ret = _kmem_map_new_pages(kmem, vaddr, 1ULL << order, pg->flags, pflags);
+    if ( ret < 0 ) {
         /* Release the virtual memory */
         vmem_return_pages(pg);
         return NULL;
     }
 
-    /* Map the physical and virtual memory */
-    for ( i = 0; i < (1LL << order); i++ ) {
-        ret = arch_kmem_map(kmem->space, vaddr + PAGE_ADDR(i),
-                            paddr + PAGE_ADDR(i), pg->flags);
-        if ( ret < 0 ) {
-            /* Release the virtual and physical memory */
-            vmem_return_pages(pg);
-            pmem_free_pages(paddr);
+    return vaddr;
+}
+
+/*
+ * Grab 2^order virtual superpages from the kernel memory, and add a new region
+ * if no matching superpage is found; the caller must hold the slab lock
+ */
+static struct vmem_superpage *
+_kmem_grab_superpages(struct kmem *kmem, int order)
+{
+    struct vmem_superpage *spg;
+
+    spg = vmem_grab_superpages(kmem->space, order);
+    if ( NULL == spg ) {
+        /* No matching superpage found, then try to create a new region */
+        if ( _kmem_add_region(kmem, order) < 0 ) {
             return NULL;
         }
+        spg = vmem_grab_superpages(kmem->space, order);
     }
 
-    return vaddr;
+    return spg;
 }
 
 /*
- * Allocate superpages from new region
+ * Add a new region to the kernel memory so that the region has free
+ * superpages at the order of order.  The data structures of the region are
+ * placed at the first superpage of the region itself not to allocate them from
+ * the kernel memory being extended.
  */
-static void *
-_kmem_alloc_superpages_from_new_region(struct kmem *kmem, int order)
+static int
+_kmem_add_region(struct kmem *kmem, int order)
 {
+    struct vmem_region *reg;
+    struct vmem_region *last;
+    struct vmem_superpage *spgs;
     void *vaddr;
+    size_t nspg;
     size_t sz;
+    size_t i;
+    int ret;
+
+    /* The number of superpages; the aligned block of 2^order superpages
+       follows the first superpage for the data structures. */
+    nspg = 2ULL << order;
+    if ( nspg < KMEM_REGION_MIN_SPGS ) {
+        nspg = KMEM_REGION_MIN_SPGS;
+    }
+    sz = sizeof(struct vmem_region) + sizeof(struct vmem_superpage) * nspg;
+    if ( sz > SUPERPAGESIZE ) {
+        return -1;
+    }
 
-    /* Check the size */
-    sz = SUPERPAGESIZE * (1ULL << order) + sizeof(struct vmem_region);
-    sz += sizeof(struct vmem_superpage) * DIV_CEIL(sz, SUPERPAGESIZE);
-    while ( sz < SUPERPAGESIZE * (1ULL << order) + sizeof(struct vmem_region)
-            + sizeof(struct vmem_superpage) * DIV_CEIL(sz, SUPERPAGESIZE) ) {
-        sz++;
+    /* Search the virtual address for the new region */
+    vaddr = vmem_search_available_region(kmem->space, SUPERPAGE_ADDR(nspg));
+    if ( NULL == vaddr
+         || (reg_t)vaddr + SUPERPAGE_ADDR(nspg)
+         > (reg_t)arch_kmem_vaddr_max() ) {
+        /* No virtual address space left for the kernel memory */
+        return -1;
     }
 
-    vaddr = vmem_search_available_region(kmem->space,
-                                         SUPERPAGESIZE * (1ULL << order));
-    (void)vaddr;
+    /* Map the pages for the data structures */
+    ret = _kmem_map_new_pages(kmem, vaddr, DIV_CEIL(sz, PAGESIZE),
+                              VMEM_USABLE | VMEM_USED | VMEM_GLOBAL, 0);
+    if ( ret < 0 ) {
+        return -1;
+    }
 
-    panic("FIXME: alloc_superpages_from_new_region");
-    return NULL;
-}
+    /* Initialize the region and its superpages */
+    reg = vaddr;
+    kmemset(reg, 0, sizeof(struct vmem_region));
+    reg->start = vaddr;
+    reg->len = SUPERPAGE_ADDR(nspg);
+    spgs = (struct vmem_superpage *)(reg + 1);
+    for ( i = 0; i < nspg; i++ ) {
+        spgs[i].u.superpage.addr = 0;
+        spgs[i].order = 0;
+        spgs[i].flags = VMEM_USABLE | VMEM_GLOBAL | VMEM_SUPERPAGE;
+        spgs[i].region = reg;
+        spgs[i].owner = NULL;
+        spgs[i].next = NULL;
+        spgs[i].prev = NULL;
+    }
+    /* Reserve the first superpage for the data structures */
+    spgs[0].order = VMEM_INVAL_BUDDY_ORDER;
+    spgs[0].flags |= VMEM_USED;
+    reg->superpages = spgs;
+    vmem_buddy_init(reg);
+
+    /* Append the region to the kernel memory; the region is linked after it
+       is initialized because kfree() looks up the regions without the lock. */
+    __sync_synchronize();
+    last = kmem->space->first_region;
+    while ( NULL != last->next ) {
+        last = last->next;
+    }
+    last->next = reg;
 
-/*
- * Allocate pages from new region
- */
-static void *
-_kmem_alloc_pages_from_new_region(struct kmem *kmem, int order)
-{
-    panic("FIXME: alloc_pages_from_new_region");
-    return NULL;
+    return 0;
 }
 
 /*
  * Allocate pages from a superpage
  */
 static void *
-_kmem_alloc_pages_from_new_superpage(struct kmem *kmem, int order)
+_kmem_alloc_pages_from_new_superpage(struct kmem *kmem, int order, int pflags)
 {
     struct vmem_superpage *spg0;
     struct vmem_superpage *spg1;
     struct vmem_page *pg;
     void *vaddr0;
     void *vaddr1;
-    void *paddr0;
-    void *paddr1;
     ssize_t i;
     ssize_t j;
     int ret;
@@ -226,23 +463,14 @@ _kmem_alloc_pages_from_new_superpage(struct kmem *kmem, int order)
     so = 1;
 
     /* Allocate a virtual superpage to be split */
-    spg0 = vmem_grab_superpages(kmem->space, so);
+    spg0 = _kmem_grab_superpages(kmem, so);
     if ( NULL == spg0 ) {
-        /* No matching superpage found, then try to create a new region */
-        return _kmem_alloc_pages_from_new_region(kmem, so);
+        return NULL;
     }
 
     /* Second superpage for pages */
     spg1 = spg0 + 1;
 
-    /* Allocate physical pages for (struct vmem_page *) */
-    paddr1 = pmem_alloc_pages(PMEM_ZONE_LOWMEM, po);
-    if ( NULL == paddr1 ) {
-        /* Release the virtual memory */
-        vmem_return_superpages(spg0);
-        return NULL;
-    }
-
     /* Superpage(s) are properly allocated, then try to convert superpage to
        pages; vaddr0 and vaddr1 point to the allocated pages and
        (struct vmem_page *), respectively. */
@@ -253,15 +481,13 @@ _kmem_alloc_pages_from_new_superpage(struct kmem *kmem, int order)
     /* Remove the superpage flag */
     flags = spg1->flags & ~VMEM_SUPERPAGE;
 
-    /* Superpage to pages; map pages first */
-    for ( i = 0; i < (1LL << po); i++ ) {
-        ret = arch_kmem_map(kmem->space, vaddr1 + PAGE_ADDR(i),
-                            paddr1 + PAGE_ADDR(i), flags);
-        if ( ret < 0 ) {
-            vmem_return_superpages(spg0);
-            pmem_free_pages(paddr1);
-            return NULL;
-        }
+    /* Superpage to pages; allocate physical pages for (struct vmem_page *)
+       and map them first */
+    ret = _kmem_map_new_pages(kmem, vaddr1, 1ULL << po, flags, 0);
+    if ( ret < 0 ) {
+        /* Release the virtual memory */
+        vmem_return_superpages(spg0);
+        return NULL;
     }
 
     /* Change the superpage to a collection of pages */
@@ -272,12 +498,14 @@ _kmem_alloc_pages_from_new_superpage(struct kmem *kmem, int order)
     spg0->order = 0;
     for ( i = 0; i < (1LL << po); i++ ) {
         /* Setup pages */
-        pg[i].addr = (reg_t)paddr1 + PAGE_ADDR(i);
+        pg[i].addr = (reg_t)arch_vmem_addr_v2p(kmem->space,
+                                               vaddr1 + PAGE_ADDR(i));
         pg[i].order = po;
         pg[i].flags = flags;
         pg[i].superpage = spg1;
         pg[i].next = NULL;
         pg[i].prev = NULL;
+        pg[i].owner = NULL;
     }
     /* Add the rest to the buddy system of usable pages */
     for ( tmpo = po; tmpo < SP_SHIFT; tmpo++ ) {
@@ -292,34 +520,22 @@ _kmem_alloc_pages_from_new_superpage(struct kmem *kmem, int order)
             pg[i].order = tmpo;
             pg[i].flags = flags & ~VMEM_USED;
             pg[i].superpage = spg1;
+            pg[i].owner = NULL;
             i++;
         }
     }
 
-    /* Allocate physical pages */
-    paddr0 = pmem_alloc_pages(PMEM_ZONE_LOWMEM, order);
-    if ( NULL == paddr0 ) {
-        /* Release the virtual memory */
-        vmem_return_superpages(spg0);
-        vmem_return_superpages(spg1);
-        pmem_free_pages(paddr1);
-        return NULL;
-    }
-
     /* Remove the superpage flag */
     flags = spg1->flags & ~VMEM_SUPERPAGE;
 
-    /* Superpage to pages; map pages first */
-    for ( i = 0; i < (1LL << order); i++ ) {
-        ret = arch_kmem_map(kmem->space, vaddr0 + PAGE_ADDR(i),
-                            paddr0 + PAGE_ADDR(i), flags);
-        if ( ret < 0 ) {
-            vmem_return_superpages(spg0);
-            vmem_return_superpages(spg1);
-            pmem_free_pages(paddr0);
-            pmem_free_pages(paddr1);
-            return NULL;
-        }
+    /* Superpage to pages; allocate physical pages and map them first */
+    ret = _kmem_map_new_pages(kmem, vaddr0, 1ULL << order, flags, pflags);
+    if ( ret < 0 ) {
+        /* Release the pages of (struct vmem_page *) and the virtual memory */
+        _kmem_release_pages(kmem, vaddr1, 1ULL << po);
+        vmem_return_superpages(spg0);
+        vmem_return_superpages(spg1);
+        return NULL;
     }
 
     /* Change the superpage to a collection of pages */
@@ -328,12 +544,14 @@ _kmem_alloc_pages_from_new_superpage(struct kmem *kmem, int order)
     spg0->flags = flags;
     for ( i = 0; i < (1LL << order); i++ ) {
         /* Setup pages */
-        pg[i].addr = (reg_t)paddr0 + PAGE_ADDR(i);
+        pg[i].addr = (reg_t)arch_vmem_addr_v2p(kmem->space,
+                                               vaddr0 + PAGE_ADDR(i));
         pg[i].order = order;
         pg[i].flags = flags;
         pg[i].superpage = spg0;
         pg[i].next = NULL;
         pg[i].prev = NULL;
+        pg[i].owner = NULL;
     }
     /* Add the rest to the buddy system of usable pages */
     for ( tmpo = order; tmpo < SP_SHIFT; tmpo++ ) {
@@ -348,6 +566,7 @@ _kmem_alloc_pages_from_new_superpage(struct kmem *kmem, int order)
             pg[i].order = tmpo;
             pg[i].flags = flags & ~VMEM_USED;
             pg[i].superpage = spg0;
+            pg[i].owner = NULL;
             i++;
         }
     }
@@ -355,6 +574,70 @@ _kmem_alloc_pages_from_new_superpage(struct kmem *kmem, int order)
     return vaddr0;
 }
 
+/*
+ * Allocate n physical pages in batches of non-contiguous pages with the pmem
+ * flags of pflags, and map them to the virtual pages starting from vaddr
+ */
+static int
+_kmem_map_new_pages(struct kmem *kmem, void *vaddr, size_t n, int flags,
+                    int pflags)
+{
+    void *frames[KMEM_BULK_BATCH];
+    size_t i;
+    size_t m;
+    int ret;
+
+    for ( i = 0; i < n; i += m ) {
+        /* Allocate a batch of physical pages */
+        m = n - i < KMEM_BULK_BATCH ? n - i : KMEM_BULK_BATCH;
+        m = pmem_policy_alloc_pages_bulk(NULL, 0, pflags, m, frames);
+        if ( 0 == m ) {
+            goto error;
+        }
+
+        /* Map the physical and virtual memory */
+        ret = arch_vmem_map_frames(kmem->space, vaddr + PAGE_ADDR(i), frames,
+                                   m, flags);
+        if ( ret < 0 ) {
+            /* The mapped pages are not known, then release the batch here */
+            arch_vmem_unmap_range(kmem->space, vaddr + PAGE_ADDR(i), m);
+            pmem_free_pages_bulk(m, frames);
+            goto error;
+        }
+    }
+
+    return 0;
+
+error:
+    /* Release the physical pages mapped so far */
+    _kmem_release_pages(kmem, vaddr, i);
+    return -1;
+}
+
+/*
+ * Unmap the n virtual pages starting from vaddr and release the physical pages
+ * mapped to them in batches; each batch is released after its mappings are
+ * invalidated on all the processors.
+ */
+static void
+_kmem_release_pages(struct kmem *kmem, void *vaddr, size_t n)
+{
+    void *frames[KMEM_BULK_BATCH];
+    size_t i;
+    size_t j;
+    size_t m;
+
+    for ( i = 0; i < n; i += m ) {
+        m = n - i < KMEM_BULK_BATCH ? n - i : KMEM_BULK_BATCH;
+        for ( j = 0; j < m; j++ ) {
+            frames[j] = arch_vmem_addr_v2p(kmem->space,
+                                           vaddr + PAGE_ADDR(i + j));
+        }
+        arch_vmem_unmap_range(kmem->space, vaddr + PAGE_ADDR(i), m);
+        pmem_free_pages_bulk(m, frames);
+    }
+}
+
 /*
  * Local variables:
  * tab-width: 4
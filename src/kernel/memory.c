@@ -26,12 +26,109 @@
 
 struct kmem *g_kmem;
 
+/* Tag written to the first word of an object cached in the magazines, and
+   whether the objects of a cache are tagged; the first word of a constructed
+   object must be kept */
+#define KMEM_MAG_TAG(p)         ((u64)(p) ^ 0x6b6d656d5f6d6167ULL)
+#define KMEM_MAG_TAGGED(c)      (NULL == (c) \
+                                 || ((c)->size >= sizeof(u64) \
+                                     && NULL == (c)->ctor))
+
 /* Prototype declarations of static functions */
+static struct kmem_class_counter * _kmem_counter(struct kmem *, int, int);
+static int _kmem_slab_class(struct kmem_slab *);
+static void _kmem_slab_lock(struct kmem *, spinlock_t *, int);
+static void *
+_kmem_mag_get(struct kmem_mag_cache *, struct kmem_depot *, int);
+static int
+_kmem_mag_put(struct kmem_mag_cache *, struct kmem_depot *, void *, int);
+static int
+_kmem_mag_check(struct kmem_mag_cache *, struct kmem_slab *, void *, int);
 static void * _kmalloc_slab(struct kmem *, size_t);
-static void * _kmalloc_slab_partial(struct kmem *, size_t);
-static void * _kmalloc_slab_free(struct kmem *, size_t);
-static void * _kmalloc_slab_new(struct kmem *, size_t);
-static void * _kmalloc_pages(struct kmem *, size_t);
+static void * _kmalloc_pages(struct kmem *, size_t, int);
+static int _kmem_sfit_class(size_t);
+static int _kmem_slab_nr(size_t, size_t, int);
+static struct kmem_slab *
+_kmem_slab_new(struct kmem *, size_t, size_t, size_t, struct kmem_slab *,
+               unsigned int);
+static void * _kmem_slab_base(struct kmem_slab *);
+static struct kmem_slab * _kmem_slab_lookup(struct kmem *, void *);
+static void _kmem_slab_owner(struct kmem *, void *, size_t, void *);
+static int _kmem_slab_free(struct kmem *, struct kmem_slab *, void *);
+static struct kmem_slab *
+_kmem_slab_detach(struct kmem_slab_free_list *, int, int);
+static int _kmem_slab_release(struct kmem *, struct kmem_slab *);
+static int
+_kmem_slab_trim(struct kmem *, spinlock_t *, struct kmem_slab_free_list *);
+static int _kmem_depot_flush(struct kmem *, struct kmem_depot *);
+static void * _kmem_slab_get(struct kmem_slab_free_list *);
+static void
+_kmem_slab_put(struct kmem_slab_free_list *, struct kmem_slab *, void *);
+static void _kmem_slab_insert(struct kmem_slab **, struct kmem_slab *);
+static void _kmem_slab_remove(struct kmem_slab **, struct kmem_slab *);
+static int _kmem_cache_npages(size_t, int);
+
+/*
+ * Initialize the kernel memory allocator
+ *
+ * SYNOPSIS
+ *      int
+ *      kmem_init(void);
+ *
+ * DESCRIPTION
+ *      The kmem_init() function creates the object caches of the size classes
+ *      of the segregated fit, which serve the medium-sized objects of
+ *      kmalloc() and kcalloc().  Before this function is called, such objects
+ *      are allocated from the page allocator.  It also allocates the
+ *      per-processor counters of the size classes (see kmem_stat()), and
+ *      registers kmem_shrink() as a shrinker of the physical memory.
+ *
+ * RETURN VALUES
+ *      If successful, the kmem_init() function returns the value of 0.
+ *      Otherwise, it returns the value of -1.
+ */
+int
+kmem_init(void)
+{
+    char name[KMEM_CACHE_NAME_LEN];
+    struct kmem_cache *cache;
+    size_t size;
+    int o;
+    int i;
+    int j;
+
+    /* Per-processor counters; allocated before the segregated fit so that
+       they are served by the pages */
+    g_kmem->slab.stats = kcalloc(MAX_CPUS, sizeof(struct kmem_stat_pcpu));
+    if ( NULL == g_kmem->slab.stats ) {
+        return -1;
+    }
+
+    for ( i = 0; i < KMEM_SFIT_NCLASSES; i++ ) {
+        /* The i-th size class is the j-th step of 2^(o - sub) bytes above 2^o
+           bytes */
+        o = KMEM_SFIT_MIN_ORDER + (i >> KMEM_SFIT_NR_SUB_ORDER);
+        j = (i & ((1 << KMEM_SFIT_NR_SUB_ORDER) - 1)) + 1;
+        size = (1ULL << o) + ((size_t)j << (o - KMEM_SFIT_NR_SUB_ORDER));
+        ksnprintf(name, sizeof(name), "kmalloc-%d", (int)size);
+        /* Objects of a multiple of the page size are page-aligned (i.e., not
+           colored) */
+        cache = kmem_cache_create(name, size,
+                                  0 == size % PAGESIZE ? PAGESIZE : 0, NULL);
+        if ( NULL == cache ) {
+            return -1;
+        }
+        cache->stat = KMEM_SLAB_ORDER + i;
+        g_kmem->slab.sfit[i] = cache;
+    }
+
+    /* Give the cached memory back when the free pages run low */
+    if ( pmem_register_shrinker(kmem_shrink) < 0 ) {
+        return -1;
+    }
+
+    return 0;
+}
 
 /*
  * Allocate memory space.
@@ -44,6 +141,14 @@ static void * _kmalloc_pages(struct kmem *, size_t);
  *
  * DESCRIPTION
  *      The kmalloc() function allocates size bytes of contiguous memory.
+ *      Small objects are served from the per-processor magazines, which are
+ *      refilled from the shared depot in batches of KMEM_MAG_SIZE objects.
+ *      Medium-sized objects up to 1 MiB are served from the object caches of
+ *      the segregated fit, whose size classes are spaced at a quarter of the
+ *      power of two, instead of the power-of-two pages.  An object smaller
+ *      than KMEM_CACHE_LINE does not straddle cache lines, a larger object is
+ *      aligned at the cache line, and an object of a multiple of the page size
+ *      is aligned at the page boundary.
  *
  * RETURN VALUES
  *      The kmalloc() function returns a pointer to allocated memory.  If there
@@ -53,6 +158,11 @@ void *
 kmalloc(size_t size)
 {
     size_t o;
+    struct kmem_class_counter *cnt;
+    struct kmem_cache *cache;
+    void *ptr;
+    int cpu;
+    int c;
 
     /* Get the bit-width of the size argument */
     o = bitwidth(size);
@@ -64,11 +174,276 @@ kmalloc(size_t size)
         } else {
             o = o - KMEM_SLAB_BASE_ORDER;
         }
+        /* Try the magazines of this processor first */
+        cpu = this_cpu_id();
+        cnt = _kmem_counter(g_kmem, cpu, o);
+        if ( cpu >= 0 && cpu < MAX_CPUS ) {
+            ptr = _kmem_mag_get(&g_kmem->slab.pcpu[cpu].caches[o],
+                                &g_kmem->slab.depots[o], 1);
+            if ( NULL != ptr ) {
+                if ( NULL != cnt ) {
+                    cnt->nalloc_fast++;
+                }
+                return ptr;
+            }
+        }
+        if ( NULL != cnt ) {
+            cnt->nalloc_slow++;
+        }
         return _kmalloc_slab(g_kmem, o);
+    }
+
+    c = _kmem_sfit_class(size);
+    if ( c >= 0 ) {
+        /* Segregated fit */
+        cache = g_kmem->slab.sfit[c];
+        if ( NULL != cache ) {
+            return kmem_cache_alloc(cache);
+        }
+    }
+
+    /* Pages */
+    return _kmalloc_pages(g_kmem, size, 0);
+}
+
+/*
+ * Allocate zero-filled memory space.
+ *
+ * SYNOPSIS
+ *      void *
+ *      kcalloc(size_t count, size_t size);
+ *
+ * DESCRIPTION
+ *      The kcalloc() function allocates count objects of size bytes of
+ *      contiguous memory, and fills it with zeros.  Allocations larger than
+ *      the segregated fit are served by the pre-zeroed physical pages, so
+ *      that the memory is not zeroed twice.
+ *
+ * RETURN VALUES
+ *      The kcalloc() function returns a pointer to allocated memory.  If there
+ *      is an error, it returns NULL.
+ */
+void *
+kcalloc(size_t count, size_t size)
+{
+    void *ptr;
+
+    /* Check the overflow */
+    if ( 0 != size && count > (size_t)-1 / size ) {
+        return NULL;
+    }
+    size *= count;
+
+    if ( size <= (1ULL << KMEM_SFIT_MAX_ORDER) ) {
+        /* Slab or segregated fit */
+        ptr = kmalloc(size);
+        if ( NULL != ptr ) {
+            kmemset(ptr, 0, size);
+        }
+        return ptr;
     } else {
         /* Pages */
-        return _kmalloc_pages(g_kmem, size);
+        return _kmalloc_pages(g_kmem, size, PMEM_ZERO);
+    }
+}
+
+/*
+ * Get the counters of the size class cls of the processor cpu; NULL if the
+ * size class or the processor is not counted
+ */
+static struct kmem_class_counter *
+_kmem_counter(struct kmem *kmem, int cpu, int cls)
+{
+    if ( NULL == kmem->slab.stats || cls < 0 || cpu < 0 || cpu >= MAX_CPUS ) {
+        return NULL;
+    }
+
+    return &kmem->slab.stats[cpu].classes[cls];
+}
+
+/*
+ * Get the size class of a slab in the statistics; -1 if not counted
+ */
+static int
+_kmem_slab_class(struct kmem_slab *hdr)
+{
+    if ( NULL != hdr->cache ) {
+        return hdr->cache->stat;
+    }
+
+    return hdr->order;
+}
+
+/*
+ * Acquire the lock of the slabs of the size class cls, and count the cycles
+ * spent waiting for it
+ */
+static void
+_kmem_slab_lock(struct kmem *kmem, spinlock_t *lock, int cls)
+{
+    struct kmem_class_counter *cnt;
+    u64 t0;
+
+    t0 = rdtsc();
+    spin_lock(lock);
+    cnt = _kmem_counter(kmem, this_cpu_id(), cls);
+    if ( NULL != cnt ) {
+        cnt->lock_cycles += rdtsc() - t0;
+    }
+}
+
+/*
+ * Take an object from the magazines of this processor.  An empty magazine is
+ * exchanged with a full one in the depot, and NULL is returned when the depot
+ * has no full magazine.  The tag of the object is cleared if tag is set.  Like
+ * the page frame cache of the physical memory, the magazines are not touched
+ * in interrupt handlers, so they do not need any lock.
+ */
+static void *
+_kmem_mag_get(struct kmem_mag_cache *mc, struct kmem_depot *depot, int tag)
+{
+    struct kmem_magazine *mag;
+    void *ptr;
+
+    if ( NULL == mc->loaded || 0 == mc->loaded->nr ) {
+        if ( NULL != mc->prev && mc->prev->nr > 0 ) {
+            /* Swap the loaded magazine with the previous one */
+            mag = mc->loaded;
+            mc->loaded = mc->prev;
+            mc->prev = mag;
+        } else {
+            /* Exchange the previous magazine with a full one in the depot */
+            spin_lock(&depot->lock);
+            mag = depot->full;
+            if ( NULL == mag ) {
+                spin_unlock(&depot->lock);
+                return NULL;
+            }
+            depot->full = mag->next;
+            if ( NULL != mc->prev ) {
+                mc->prev->next = depot->empty;
+                depot->empty = mc->prev;
+            }
+            spin_unlock(&depot->lock);
+            mc->prev = mc->loaded;
+            mc->loaded = mag;
+        }
+    }
+
+    /* Take the most recently freed one (likely cache-hot) */
+    ptr = mc->loaded->objs[--mc->loaded->nr];
+    if ( tag ) {
+        *(u64 *)ptr = 0;
+    }
+
+    return ptr;
+}
+
+/*
+ * Put an object to the magazines of this processor, and tag the object if tag
+ * is set.  A full magazine is exchanged with an empty one in the depot, or
+ * with a new magazine if the depot has no empty magazine.  Returns -1 if the
+ * object cannot be cached.
+ */
+static int
+_kmem_mag_put(struct kmem_mag_cache *mc, struct kmem_depot *depot, void *ptr,
+              int tag)
+{
+    struct kmem_magazine *mag;
+
+    if ( NULL == mc->loaded || KMEM_MAG_SIZE == mc->loaded->nr ) {
+        if ( NULL != mc->prev && 0 == mc->prev->nr ) {
+            /* Swap the loaded magazine with the previous one */
+            mag = mc->loaded;
+            mc->loaded = mc->prev;
+            mc->prev = mag;
+        } else {
+            /* Get an empty magazine from the depot */
+            spin_lock(&depot->lock);
+            mag = depot->empty;
+            if ( NULL != mag ) {
+                depot->empty = mag->next;
+            }
+            spin_unlock(&depot->lock);
+            if ( NULL == mag ) {
+                /* Allocate a new magazine */
+                mag = _kmalloc_slab(g_kmem, KMEM_MAG_ORDER);
+                if ( NULL == mag ) {
+                    return -1;
+                }
+                mag->nr = 0;
+            }
+            /* Return the previous (full) magazine to the depot */
+            if ( NULL != mc->prev ) {
+                spin_lock(&depot->lock);
+                mc->prev->next = depot->full;
+                depot->full = mc->prev;
+                spin_unlock(&depot->lock);
+            }
+            mc->prev = mc->loaded;
+            mc->loaded = mag;
+        }
+    }
+
+    mc->loaded->objs[mc->loaded->nr++] = ptr;
+    if ( tag ) {
+        *(u64 *)ptr = KMEM_MAG_TAG(ptr);
+    }
+
+    return 0;
+}
+
+/*
+ * Check that the object pointed by ptr is an allocated object of the slab hdr
+ * before it is cached in the magazines mc, so that a double free is ignored
+ * as _kmem_slab_put() does.  The free bitmap is read without the lock; since
+ * the bit of an allocated object is never set by others, a set bit tells that
+ * the object is already free.  An object in the magazines of any processor is
+ * found by its tag if tag is set, otherwise only the magazines of this
+ * processor, which hold at most 2 * KMEM_MAG_SIZE objects, are scanned.
+ * Returns -1 if the object must not be freed.
+ */
+static int
+_kmem_mag_check(struct kmem_mag_cache *mc, struct kmem_slab *hdr, void *ptr,
+                int tag)
+{
+    u64 off;
+    u64 i;
+    int j;
+
+    /* Resolve the index of the object */
+    off = (u64)ptr - (u64)hdr->obj_head;
+    if ( (u64)ptr < (u64)hdr->obj_head || 0 != off % hdr->size ) {
+        /* Invalid pointer */
+        return -1;
+    }
+    i = off / hdr->size;
+    if ( i >= (u64)hdr->nr
+         || (*(volatile u64 *)&hdr->bitmap[i >> 6] & (1ULL << (i & 63))) ) {
+        /* Invalid pointer or not allocated */
+        return -1;
+    }
+
+    /* Already cached */
+    if ( tag ) {
+        return KMEM_MAG_TAG(ptr) == *(u64 *)ptr ? -1 : 0;
     }
+    if ( NULL != mc->loaded ) {
+        for ( j = 0; j < mc->loaded->nr; j++ ) {
+            if ( ptr == mc->loaded->objs[j] ) {
+                return -1;
+            }
+        }
+    }
+    if ( NULL != mc->prev ) {
+        for ( j = 0; j < mc->prev->nr; j++ ) {
+            if ( ptr == mc->prev->objs[j] ) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
 }
 
 /*
@@ -77,27 +452,45 @@ kmalloc(size_t size)
 static void *
 _kmalloc_slab(struct kmem *kmem, size_t o)
 {
+    struct kmem_slab_free_list *list;
+    struct kmem_class_counter *cnt;
+    struct kmem_slab *hdr;
+    size_t osz;
+    size_t s;
     void *ptr;
 
     /* Ensure that the order is less than the maximum configured order */
     if ( o >= KMEM_SLAB_ORDER ) {
         return NULL;
     }
+    list = &kmem->slab.gslabs[o];
 
     /* Lock */
-    spin_lock(&kmem->slab_lock);
+    _kmem_slab_lock(kmem, &kmem->slab_lock, o);
+
+    if ( NULL == list->partial && NULL == list->free ) {
+        /* No free space, then allocate new pages for slab objects; the pages
+           are aligned to fit to the buddy system. */
+        osz = 1ULL << (o + KMEM_SLAB_BASE_ORDER);
+        s = (osz << KMEM_SLAB_NR_OBJ_ORDER) + sizeof(struct kmem_slab);
+        hdr = _kmem_slab_new(kmem, DIV_CEIL(s, PAGESIZE), osz, KMEM_CACHE_LINE,
+                             NULL, kmem->slab.colors[o]);
+        if ( NULL == hdr ) {
+            spin_unlock(&kmem->slab_lock);
+            return NULL;
+        }
+        kmem->slab.colors[o]++;
+        hdr->order = o;
+        _kmem_slab_insert(&list->free, hdr);
+        list->nfree++;
+        cnt = _kmem_counter(kmem, this_cpu_id(), o);
+        if ( NULL != cnt ) {
+            cnt->nslab_created++;
+        }
+    }
 
     /* Small object: Slab allocator */
-    if ( NULL != kmem->slab.gslabs[o].partial ) {
-        /* Partial list is available. */
-        ptr = _kmalloc_slab_partial(kmem, o);
-    } else if ( NULL != kmem->slab.gslabs[o].free ) {
-        /* Partial list is empty, but free list is available. */
-        ptr = _kmalloc_slab_free(kmem, o);
-    } else {
-        /* No free space, then allocate new page for slab objects */
-        ptr = _kmalloc_slab_new(kmem, o);
-     }
+    ptr = _kmem_slab_get(list);
 
     /* Unlock */
     spin_unlock(&kmem->slab_lock);
@@ -106,164 +499,309 @@ _kmalloc_slab(struct kmem *kmem, size_t o)
 }
 
 /*
- * Allocate memory from partial slab
+ * Allocate memory from the page allocator with the pmem flags
  */
 static void *
-_kmalloc_slab_partial(struct kmem *kmem, size_t o)
+_kmalloc_pages(struct kmem *kmem, size_t size, int flags)
 {
-    struct kmem_slab *hdr;
     void *ptr;
-    ssize_t i;
 
-    /* Partial list is available. */
-    hdr = kmem->slab.gslabs[o].partial;
-    ptr = (void *)((reg_t)hdr->obj_head + hdr->free
-                   * (1ULL << (o + KMEM_SLAB_BASE_ORDER)));
-    hdr->marks[hdr->free] = 1;
-    hdr->nused++;
-    if ( hdr->nr <= hdr->nused ) {
-        /* Becomes full */
-        hdr->free = -1;
-        kmem->slab.gslabs[o].partial = hdr->next;
-        /* Prepend to the full list */
-        hdr->next = kmem->slab.gslabs[o].full;
-        kmem->slab.gslabs[o].full = hdr;
+    /* Lock */
+    spin_lock(&kmem->slab_lock);
+
+    /* Large object: Page allocator */
+    ptr = kmem_alloc_pages(kmem, DIV_CEIL(size, PAGESIZE), flags);
+
+    /* Unlock */
+    spin_unlock(&kmem->slab_lock);
+
+    return ptr;
+}
+
+/*
+ * Get the size class of the segregated fit for size bytes; -1 if the size is
+ * out of the range of the segregated fit
+ */
+static int
+_kmem_sfit_class(size_t size)
+{
+    int o;
+    int j;
+
+    if ( size <= (1ULL << KMEM_SFIT_MIN_ORDER)
+         || size > (1ULL << KMEM_SFIT_MAX_ORDER) ) {
+        return -1;
+    }
+
+    /* 2^o < size <= 2^(o + 1), and the j-th step of 2^(o - sub) bytes */
+    o = bitwidth(size) - 1;
+    j = DIV_CEIL(size - (1ULL << o), 1ULL << (o - KMEM_SFIT_NR_SUB_ORDER));
+
+    return ((o - KMEM_SFIT_MIN_ORDER) << KMEM_SFIT_NR_SUB_ORDER) + j - 1;
+}
+
+/*
+ * Calculate the number of objects of size bytes in a slab of npages pages;
+ * N.B., a bit of the bitmap is taken for each object, and the bitmap is
+ * rounded up to words.  The header takes no space in the pages if offslab is
+ * set.
+ */
+static int
+_kmem_slab_nr(size_t npages, size_t size, int offslab)
+{
+    size_t nr;
+
+    if ( offslab ) {
+        return npages * PAGESIZE / size;
+    }
+    if ( npages * PAGESIZE < sizeof(struct kmem_slab) ) {
+        return 0;
+    }
+    nr = (npages * PAGESIZE - sizeof(struct kmem_slab)) * 8 / (size * 8 + 1);
+    while ( nr > 0 && sizeof(struct kmem_slab) + DIV_CEIL(nr, 64) * sizeof(u64)
+            + nr * size > npages * PAGESIZE ) {
+        nr--;
+    }
+
+    return nr;
+}
+
+/*
+ * Create a new slab of npages pages for objects of size bytes aligned at
+ * align bytes; the caller must hold the slab lock.  If hdr is not NULL, it is
+ * used as the header of the slab, and the objects are placed from the head of
+ * the pages.  The objects are shifted by the color-th step of the alignment
+ * (or the cache line if larger) in the slack of the slab, so that the objects
+ * at the same index of different slabs do not map to the same cache sets.
+ */
+static struct kmem_slab *
+_kmem_slab_new(struct kmem *kmem, size_t npages, size_t size, size_t align,
+               struct kmem_slab *hdr, unsigned int color)
+{
+    void *base;
+    size_t slack;
+    size_t i;
+
+    /* Allocate pages */
+    base = kmem_alloc_pages(kmem, npages, 0);
+    if ( NULL == base ) {
+        return NULL;
+    }
+    if ( NULL == hdr ) {
+        /* The header at the head of the pages, and the objects at the tail */
+        hdr = base;
+        hdr->nr = _kmem_slab_nr(npages, size, 0);
+        slack = npages * PAGESIZE - sizeof(struct kmem_slab)
+            - DIV_CEIL(hdr->nr, 64) * sizeof(u64) - size * hdr->nr;
     } else {
-        /* Search free space for the next allocation */
-        for ( i = 0; i < hdr->nr; i++ ) {
-            if ( 0 == hdr->marks[i] ) {
-                hdr->free = i;
-                break;
-            }
-        }
+        hdr->nr = _kmem_slab_nr(npages, size, 1);
+        slack = npages * PAGESIZE - size * hdr->nr;
     }
 
-    return ptr;
+    /* Color within the first page, since the offset in a page determines the
+       cache sets */
+    if ( align < KMEM_CACHE_LINE ) {
+        align = KMEM_CACHE_LINE;
+    }
+    if ( slack > PAGESIZE - 1 ) {
+        slack = PAGESIZE - 1;
+    }
+    color = (color % (slack / align + 1)) * align;
+    if ( (void *)hdr == base ) {
+        hdr->obj_head = base + (npages * PAGESIZE) - size * hdr->nr - color;
+    } else {
+        hdr->obj_head = base + color;
+    }
+    hdr->size = size;
+    hdr->order = -1;
+    hdr->npages = npages;
+    hdr->cache = NULL;
+    /* Reset counters */
+    hdr->nused = 0;
+    /* Mark all the objects free */
+    for ( i = 0; i < (size_t)hdr->nr / 64; i++ ) {
+        hdr->bitmap[i] = ~0ULL;
+    }
+    if ( hdr->nr % 64 ) {
+        hdr->bitmap[i] = (1ULL << (hdr->nr % 64)) - 1;
+    }
+
+    /* Record the slab as the owner of the pages so that kfree() resolves the
+       slab from an object address */
+    _kmem_slab_owner(kmem, base, npages, hdr);
+
+    return hdr;
+}
+
+/*
+ * Resolve the slab containing the object pointed by ptr; NULL if ptr is not
+ * in any slab.  The page of an allocated object is not released, so the
+ * lookup does not need the slab lock.
+ */
+static struct kmem_slab *
+_kmem_slab_lookup(struct kmem *kmem, void *ptr)
+{
+    struct vmem_superpage *spg;
+    struct vmem_page *pg;
+
+    pg = vmem_lookup_page(kmem->space, ptr);
+    if ( NULL != pg ) {
+        return pg->owner;
+    }
+    spg = vmem_lookup_superpage(kmem->space, ptr);
+    if ( NULL == spg || !VMEM_IS_SUPERPAGE(spg) || VMEM_IS_FREE(spg) ) {
+        return NULL;
+    }
+
+    return spg->owner;
 }
 
 /*
- * Allocate memory from free slab list
+ * Get the head of the pages of a slab
  */
 static void *
-_kmalloc_slab_free(struct kmem *kmem, size_t o)
+_kmem_slab_base(struct kmem_slab *hdr)
 {
-    struct kmem_slab *hdr;
-    void *ptr;
-    ssize_t i;
+    if ( NULL != hdr->cache && hdr->cache->offslab ) {
+        /* The objects are shifted by the color less than the page size */
+        return (void *)FLOOR((reg_t)hdr->obj_head, PAGESIZE);
+    }
 
-    /* Partial list is empty, but free list is available. */
-    hdr = kmem->slab.gslabs[o].free;
-    ptr = (void *)((reg_t)hdr->obj_head + hdr->free
-                   * (1ULL << (o + KMEM_SLAB_BASE_ORDER)));
-    hdr->marks[hdr->free] = 1;
-    hdr->nused++;
-    if ( hdr->nr <= hdr->nused ) {
-        /* Becomes full */
-        hdr->free = -1;
-        kmem->slab.gslabs[o].partial = hdr->next;
-        /* Prepend to the full list */
-        hdr->next = kmem->slab.gslabs[o].full;
-        kmem->slab.gslabs[o].full = hdr;
-    } else {
-        /* Prepend to the partial list */
-        hdr->next = kmem->slab.gslabs[o].partial;
-        kmem->slab.gslabs[o].partial = hdr;
-        /* Search free space for the next allocation */
-        for ( i = 0; i < hdr->nr; i++ ) {
-            if ( 0 == hdr->marks[i] ) {
-                hdr->free = i;
-                break;
+    return hdr;
+}
+
+/*
+ * Set the owner of the npages pages from base (or the superpages if the pages
+ * are backed by superpages); the caller must hold the slab lock
+ */
+static void
+_kmem_slab_owner(struct kmem *kmem, void *base, size_t npages, void *owner)
+{
+    struct vmem_superpage *spg;
+    struct vmem_page *pg;
+    size_t i;
+
+    for ( i = 0; i < npages; i++ ) {
+        pg = vmem_lookup_page(kmem->space, base + PAGE_ADDR(i));
+        if ( NULL != pg ) {
+            pg->owner = owner;
+        } else if ( 0 == (i & ((1ULL << SP_SHIFT) - 1)) ) {
+            spg = vmem_lookup_superpage(kmem->space, base + PAGE_ADDR(i));
+            if ( NULL != spg ) {
+                spg->owner = owner;
             }
         }
     }
-
-    return ptr;
 }
 
 /*
- * Allocate memory from a new slab objects
+ * Take an object from a partial slab of the list, or from a free slab if no
+ * partial slab is available; the list must have at least one of them
  */
 static void *
-_kmalloc_slab_new(struct kmem *kmem, size_t o)
+_kmem_slab_get(struct kmem_slab_free_list *list)
 {
     struct kmem_slab *hdr;
     void *ptr;
-    ssize_t i;
-    size_t s;
-    size_t nr;
+    int w;
+    int i;
 
-    /* No free space, then allocate new page for slab objects */
-    s = (1ULL << (o + KMEM_SLAB_BASE_ORDER + KMEM_SLAB_NR_OBJ_ORDER))
-        + sizeof(struct kmem_slab);
-    /* Align the page to fit to the buddy system, and get the order */
-    nr = DIV_CEIL(s, PAGESIZE);
-    /* Allocate pages */
-    hdr = kmem_alloc_pages(kmem, nr);
+    hdr = list->partial;
     if ( NULL == hdr ) {
-        return NULL;
+        /* Partial list is empty, but free list is available; move a free slab
+           to the partial list. */
+        hdr = list->free;
+        _kmem_slab_remove(&list->free, hdr);
+        list->nfree--;
+        _kmem_slab_insert(&list->partial, hdr);
     }
-    /* Calculate the number of slab objects in this block; N.B., + 1 in the
-       denominator is the `marks' for each objects. */
-    hdr->nr = (nr * PAGESIZE - sizeof(struct kmem_slab))
-        / ((1ULL << (o + KMEM_SLAB_BASE_ORDER)) + 1);
-    /* Reset counters */
-    hdr->nused = 0;
-    hdr->free = 0;
-    /* Set the address of the first slab object */
-    hdr->obj_head = (void *)((u64)hdr + (nr * PAGESIZE)
-                             - ((1ULL << (o + KMEM_SLAB_BASE_ORDER))
-                                * hdr->nr));
-    /* Reset marks and next cache */
-    kmemset(hdr->marks, 0, hdr->nr);
-    hdr->next = NULL;
 
-    /* Retrieve a slab */
-    ptr = (void *)((u64)hdr->obj_head + hdr->free
-                   * (1ULL << (o + KMEM_SLAB_BASE_ORDER)));
-    hdr->marks[hdr->free] = 1;
+    /* Take the first free object from the bitmap, which spans at most a
+       couple of words. */
+    for ( w = 0; 0 == hdr->bitmap[w]; w++ ) {
+        /* Skip the words without free objects */
+    }
+    i = (w << 6) + __builtin_ctzll(hdr->bitmap[w]);
+    hdr->bitmap[w] &= ~(1ULL << (i & 63));
+    ptr = (void *)((reg_t)hdr->obj_head + (reg_t)i * hdr->size);
     hdr->nused++;
-
     if ( hdr->nr <= hdr->nused ) {
         /* Becomes full */
-        hdr->free = -1;
-        kmem->slab.gslabs[o].partial = hdr->next;
-        /* Prepend to the full list */
-        hdr->next = kmem->slab.gslabs[o].full;
-        kmem->slab.gslabs[o].full = hdr;
-    } else {
-        /* Prepend to the partial list */
-        hdr->next = kmem->slab.gslabs[o].partial;
-        kmem->slab.gslabs[o].partial = hdr;
-        /* Search free space for the next allocation */
-        for ( i = 0; i < hdr->nr; i++ ) {
-            if ( 0 == hdr->marks[i] ) {
-                hdr->free = i;
-                break;
-            }
-        }
+        _kmem_slab_remove(&list->partial, hdr);
+        _kmem_slab_insert(&list->full, hdr);
     }
 
     return ptr;
 }
 
 /*
- * Allocate memory from the slab allocator
+ * Return an object to its slab in the list; the caller must hold the lock of
+ * the list
  */
-static void *
-_kmalloc_pages(struct kmem *kmem, size_t size)
+static void
+_kmem_slab_put(struct kmem_slab_free_list *list, struct kmem_slab *hdr,
+               void *ptr)
 {
-    void *ptr;
+    u64 off;
+    u64 i;
 
-    /* Lock */
-    spin_lock(&kmem->slab_lock);
+    /* Resolve the index of the object */
+    off = (u64)ptr - (u64)hdr->obj_head;
+    if ( (u64)ptr < (u64)hdr->obj_head || 0 != off % hdr->size ) {
+        /* Invalid pointer */
+        return;
+    }
+    i = off / hdr->size;
+    if ( i >= (u64)hdr->nr || (hdr->bitmap[i >> 6] & (1ULL << (i & 63))) ) {
+        /* Invalid pointer or not allocated */
+        return;
+    }
 
-    /* Large object: Page allocator */
-    ptr = kmem_alloc_pages(kmem, DIV_CEIL(size, PAGESIZE));
+    if ( hdr->nused >= hdr->nr ) {
+        /* Full to partial */
+        _kmem_slab_remove(&list->full, hdr);
+        _kmem_slab_insert(&list->partial, hdr);
+    }
+    hdr->bitmap[i >> 6] |= 1ULL << (i & 63);
+    hdr->nused--;
+    if ( hdr->nused <= 0 ) {
+        /* Partial to free */
+        _kmem_slab_remove(&list->partial, hdr);
+        _kmem_slab_insert(&list->free, hdr);
+        list->nfree++;
+    }
+}
 
-    /* Unlock */
-    spin_unlock(&kmem->slab_lock);
+/*
+ * Insert a slab to the head of a list
+ */
+static void
+_kmem_slab_insert(struct kmem_slab **head, struct kmem_slab *hdr)
+{
+    hdr->prev = NULL;
+    hdr->next = *head;
+    if ( NULL != *head ) {
+        (*head)->prev = hdr;
+    }
+    *head = hdr;
+}
 
-    return ptr;
+/*
+ * Remove a slab from a list
+ */
+static void
+_kmem_slab_remove(struct kmem_slab **head, struct kmem_slab *hdr)
+{
+    if ( NULL == hdr->prev ) {
+        *head = hdr->next;
+    } else {
+        hdr->prev->next = hdr->next;
+    }
+    if ( NULL != hdr->next ) {
+        hdr->next->prev = hdr->prev;
+    }
+    hdr->next = NULL;
+    hdr->prev = NULL;
 }
 
 /*
@@ -275,6 +813,16 @@ _kmalloc_pages(struct kmem *kmem, size_t size)
  *
  * DESCRIPTION
  *      The kfree() function deallocates the memory allocation pointed by ptr.
+ *      The slab of the object is resolved from the owner of the page
+ *      containing ptr, so the cost does not depend on the number of objects.
+ *      Slab objects are first cached in the per-processor magazines, and
+ *      returned to the slabs only when no magazine is available.  When more
+ *      than KMEM_SLAB_FREE_HIGH slabs of a size class become empty, the empty
+ *      slabs down to KMEM_SLAB_FREE_LOW are returned to the page allocator.
+ *      An object allocated by kmem_cache_alloc() or from the segregated fit is
+ *      returned to its cache, and a large object is returned to the page
+ *      allocator with kmem_free_pages().  A slab object that is not allocated,
+ *      e.g., one freed twice, is ignored before it is cached.
  *
  * RETURN VALUES
  *      The kfree() function does not return a value.
@@ -282,95 +830,630 @@ _kmalloc_pages(struct kmem *kmem, size_t size)
 void
 kfree(void *ptr)
 {
+    struct kmem_class_counter *cnt;
+    struct kmem_mag_cache *mc;
+    struct kmem_slab *hdr;
+    int cpu;
+
+    if ( NULL == ptr ) {
+        return;
+    }
+
+    /* Resolve the slab from the page */
+    hdr = _kmem_slab_lookup(g_kmem, ptr);
+    if ( NULL == hdr ) {
+        /* Free pages */
+        spin_lock(&g_kmem->slab_lock);
+        kmem_free_pages(g_kmem, ptr);
+        spin_unlock(&g_kmem->slab_lock);
+        return;
+    }
+    if ( NULL != hdr->cache ) {
+        /* Object of an object cache (or of the segregated fit) */
+        kmem_cache_free(hdr->cache, ptr);
+        return;
+    }
+
+    /* Try to cache the object in the magazines of this processor */
+    cpu = this_cpu_id();
+    cnt = _kmem_counter(g_kmem, cpu, hdr->order);
+    if ( cpu >= 0 && cpu < MAX_CPUS ) {
+        mc = &g_kmem->slab.pcpu[cpu].caches[hdr->order];
+        if ( _kmem_mag_check(mc, hdr, ptr, 1) < 0 ) {
+            /* Invalid pointer or double free */
+            return;
+        }
+        if ( _kmem_mag_put(mc, &g_kmem->slab.depots[hdr->order], ptr, 1)
+             >= 0 ) {
+            if ( NULL != cnt ) {
+                cnt->nfree_fast++;
+            }
+            return;
+        }
+    }
+
+    /* Free a slab object */
+    if ( NULL != cnt ) {
+        cnt->nfree_slow++;
+    }
+    _kmem_slab_free(g_kmem, hdr, ptr);
+}
+
+/*
+ * Create an object cache
+ *
+ * SYNOPSIS
+ *      struct kmem_cache *
+ *      kmem_cache_create(const char *name, size_t size, size_t align,
+ *                        void (*ctor)(void *));
+ *
+ * DESCRIPTION
+ *      The kmem_cache_create() function creates a cache of objects of size
+ *      bytes aligned at align bytes (a power of two; the pointer size if
+ *      zero).  The cache has its own slabs whose objects are packed at the
+ *      exact object size, and its own per-processor magazines unless the
+ *      objects are larger than KMEM_MAG_MAX_OBJ_SIZE.  The size is rounded up
+ *      to the alignment, so that the objects of a cache aligned at
+ *      KMEM_CACHE_LINE never share a cache line; such an alignment is
+ *      recommended for the objects frequently written by different processors.
+ *      The slabs are colored, i.e., the objects of consecutive slabs start at
+ *      different offsets in the slack of the slabs.  The slab header of the
+ *      objects not smaller than the page size is allocated apart from the
+ *      slab, so that the objects are packed in the pages.  If ctor is not
+ *      NULL, it is called once for each object when a slab is created, and the
+ *      objects are cached in the constructed state; i.e., an object must be
+ *      freed in its constructed state.
+ *
+ * RETURN VALUES
+ *      The kmem_cache_create() function returns a pointer to the created
+ *      cache.  If there is an error, it returns NULL.
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+                  void (*ctor)(void *))
+{
+    struct kmem_cache *cache;
+
+    /* Check the alignment and round up the object size */
+    if ( 0 == align ) {
+        align = sizeof(void *);
+    }
+    if ( 0 != (align & (align - 1)) || align > PAGESIZE || 0 == size ) {
+        return NULL;
+    }
+    size = CEIL(size, align);
+
+    cache = kmalloc(sizeof(struct kmem_cache));
+    if ( NULL == cache ) {
+        return NULL;
+    }
+    kmemset(cache, 0, sizeof(struct kmem_cache));
+    kstrlcpy(cache->name, name, KMEM_CACHE_NAME_LEN);
+    cache->size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->stat = -1;
+    cache->offslab = size >= PAGESIZE;
+    cache->npages = _kmem_cache_npages(size, cache->offslab);
+    if ( cache->npages <= 0 ) {
+        kfree(cache);
+        return NULL;
+    }
+    cache->nr = _kmem_slab_nr(cache->npages, size, cache->offslab);
+
+    /* Per-processor magazines; the large objects are not cached in the
+       magazines, which cannot be flushed by the other processors */
+    if ( size <= KMEM_MAG_MAX_OBJ_SIZE ) {
+        cache->pcpu = kcalloc(MAX_CPUS, sizeof(struct kmem_mag_cache));
+        if ( NULL == cache->pcpu ) {
+            kfree(cache);
+            return NULL;
+        }
+    }
+
+    /* Register the cache */
+    spin_lock(&g_kmem->slab_lock);
+    cache->next = g_kmem->slab.caches;
+    g_kmem->slab.caches = cache;
+    spin_unlock(&g_kmem->slab_lock);
+
+    return cache;
+}
+
+/*
+ * Allocate an object from an object cache
+ *
+ * SYNOPSIS
+ *      void *
+ *      kmem_cache_alloc(struct kmem_cache *cache);
+ *
+ * DESCRIPTION
+ *      The kmem_cache_alloc() function allocates an object from the cache.
+ *      The object is in the constructed state if the cache has a constructor.
+ *
+ * RETURN VALUES
+ *      The kmem_cache_alloc() function returns a pointer to the allocated
+ *      object.  If there is an error, it returns NULL.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *cache)
+{
+    struct kmem_class_counter *cnt;
+    struct kmem_slab *hdr;
+    struct kmem_slab *offhdr;
+    void *ptr;
+    int cpu;
     int i;
-    int j;
-    int found;
-    u64 asz;
+
+    /* Try the magazines of this processor first */
+    cpu = this_cpu_id();
+    cnt = _kmem_counter(g_kmem, cpu, cache->stat);
+    if ( NULL != cache->pcpu && cpu >= 0 && cpu < MAX_CPUS ) {
+        ptr = _kmem_mag_get(&cache->pcpu[cpu], &cache->depot,
+                            KMEM_MAG_TAGGED(cache));
+        if ( NULL != ptr ) {
+            if ( NULL != cnt ) {
+                cnt->nalloc_fast++;
+            }
+            return ptr;
+        }
+    }
+    if ( NULL != cnt ) {
+        cnt->nalloc_slow++;
+    }
+
+    _kmem_slab_lock(g_kmem, &cache->lock, cache->stat);
+
+    if ( NULL == cache->slabs.partial && NULL == cache->slabs.free ) {
+        /* Allocate the slab header apart from the slab first, since
+           kmalloc() takes the slab lock */
+        offhdr = NULL;
+        if ( cache->offslab ) {
+            offhdr = kmalloc(sizeof(struct kmem_slab)
+                             + DIV_CEIL(cache->nr, 64) * sizeof(u64));
+            if ( NULL == offhdr ) {
+                spin_unlock(&cache->lock);
+                return NULL;
+            }
+        }
+        /* Create a new slab, and construct all the objects in it */
+        _kmem_slab_lock(g_kmem, &g_kmem->slab_lock, cache->stat);
+        hdr = _kmem_slab_new(g_kmem, cache->npages, cache->size, cache->align,
+                             offhdr, cache->color);
+        spin_unlock(&g_kmem->slab_lock);
+        if ( NULL == hdr ) {
+            kfree(offhdr);
+            spin_unlock(&cache->lock);
+            return NULL;
+        }
+        cache->color++;
+        hdr->cache = cache;
+        if ( NULL != cache->ctor ) {
+            for ( i = 0; i < hdr->nr; i++ ) {
+                cache->ctor((void *)((reg_t)hdr->obj_head
+                                     + (reg_t)i * cache->size));
+            }
+        }
+        _kmem_slab_insert(&cache->slabs.free, hdr);
+        cache->slabs.nfree++;
+        if ( NULL != cnt ) {
+            cnt->nslab_created++;
+        }
+    }
+    ptr = _kmem_slab_get(&cache->slabs);
+
+    spin_unlock(&cache->lock);
+
+    return ptr;
+}
+
+/*
+ * Free an object to an object cache
+ *
+ * SYNOPSIS
+ *      void
+ *      kmem_cache_free(struct kmem_cache *cache, void *ptr);
+ *
+ * DESCRIPTION
+ *      The kmem_cache_free() function returns the object pointed by ptr to the
+ *      cache.  The object must be in the constructed state if the cache has a
+ *      constructor.  An object that is not allocated from the cache, e.g., one
+ *      freed twice, is ignored before it is cached in the magazines.
+ *
+ * RETURN VALUES
+ *      The kmem_cache_free() function does not return a value.
+ */
+void
+kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+    struct kmem_class_counter *cnt;
     struct kmem_slab *hdr;
-    struct kmem_slab **hdrp;
+    int cpu;
+
+    if ( NULL == ptr ) {
+        return;
+    }
+
+    hdr = _kmem_slab_lookup(g_kmem, ptr);
+    if ( NULL == hdr || cache != hdr->cache ) {
+        /* Not an object of this cache */
+        return;
+    }
+
+    /* Try to cache the object in the magazines of this processor */
+    cpu = this_cpu_id();
+    cnt = _kmem_counter(g_kmem, cpu, cache->stat);
+    if ( NULL != cache->pcpu && cpu >= 0 && cpu < MAX_CPUS ) {
+        if ( _kmem_mag_check(&cache->pcpu[cpu], hdr, ptr,
+                             KMEM_MAG_TAGGED(cache)) < 0 ) {
+            /* Invalid pointer or double free */
+            return;
+        }
+        if ( _kmem_mag_put(&cache->pcpu[cpu], &cache->depot, ptr,
+                           KMEM_MAG_TAGGED(cache)) >= 0 ) {
+            if ( NULL != cnt ) {
+                cnt->nfree_fast++;
+            }
+            return;
+        }
+    }
+    if ( NULL != cnt ) {
+        cnt->nfree_slow++;
+    }
+
+    /* Return the object to its slab */
+    _kmem_slab_free(g_kmem, hdr, ptr);
+}
+
+/*
+ * Release the memory cached by the kernel memory allocator
+ *
+ * SYNOPSIS
+ *      int
+ *      kmem_shrink(void);
+ *
+ * DESCRIPTION
+ *      The kmem_shrink() function returns the objects in the full magazines of
+ *      the depots to their slabs, frees the magazines in the depots, and then
+ *      returns all the empty slabs of the size classes and the object caches
+ *      to the page allocator.  The magazines loaded on the processors are not
+ *      touched.  This function is registered as a shrinker of the physical
+ *      memory by kmem_init().
+ *
+ * RETURN VALUES
+ *      The kmem_shrink() function returns the number of the pages released.
+ */
+int
+kmem_shrink(void)
+{
+    struct kmem_cache *cache;
+    struct kmem_cache *caches;
+    int n;
+    int o;
 
-    /* Lock */
     spin_lock(&g_kmem->slab_lock);
+    caches = g_kmem->slab.caches;
+    spin_unlock(&g_kmem->slab_lock);
 
-    if ( 0 == (u64)ptr % SUPERPAGESIZE ) {
-        /* Free pages */
-        //kmem_free_pages(ptr);
-    } else {
-        /* Search for each order */
-        for ( i = 0; i < KMEM_SLAB_BASE_ORDER; i++ ) {
-            asz = (1 << (i + KMEM_SLAB_BASE_ORDER));
-
-            /* Search from partial */
-            hdrp = &g_kmem->slab.gslabs[i].partial;
-
-            /* Continue until the corresponding object found */
-            while ( NULL != *hdrp ) {
-                hdr = *hdrp;
-
-                found = -1;
-                for ( j = 0; j < hdr->nr; j++ ) {
-                    if ( ptr == (void *)((u64)hdr->obj_head + j * asz) ) {
-                        /* Found */
-                        found = j;
-                        break;
-                    }
-                }
-                if ( found >= 0 ) {
-                    hdr->nused--;
-                    hdr->marks[found] = 0;
-                    hdr->free = found;
-                    if ( hdr->nused <= 0 ) {
-                        /* To free list */
-                        *hdrp = hdr->next;
-                        hdr->next = g_kmem->slab.gslabs[i].free;
-                        g_kmem->slab.gslabs[i].free = hdr;
-                    }
-                    spin_unlock(&g_kmem->slab_lock);
-                    return;
-                }
-                hdrp = &hdr->next;
+    /* Flush the depots first since the magazines are slab objects; the
+       caches are never destroyed, so the list is walked without the lock. */
+    n = 0;
+    for ( o = 0; o < KMEM_SLAB_ORDER; o++ ) {
+        n += _kmem_depot_flush(g_kmem, &g_kmem->slab.depots[o]);
+    }
+    for ( cache = caches; NULL != cache; cache = cache->next ) {
+        n += _kmem_depot_flush(g_kmem, &cache->depot);
+    }
+
+    /* Release the empty slabs */
+    for ( cache = caches; NULL != cache; cache = cache->next ) {
+        n += _kmem_slab_trim(g_kmem, &cache->lock, &cache->slabs);
+    }
+    for ( o = 0; o < KMEM_SLAB_ORDER; o++ ) {
+        n += _kmem_slab_trim(g_kmem, &g_kmem->slab_lock,
+                             &g_kmem->slab.gslabs[o]);
+    }
+
+    return n;
+}
+
+/*
+ * Get the statistics of the kernel memory allocator
+ *
+ * SYNOPSIS
+ *      void
+ *      kmem_stat(struct kmem_stat *st);
+ *
+ * DESCRIPTION
+ *      The kmem_stat() function fills the structure pointed by st with the
+ *      statistics of the size classes of kmalloc().  The per-processor
+ *      counters are summed up, and the partial and empty slabs are counted
+ *      under the lock of the slabs.  The counters are updated without any lock
+ *      by their own processors, so the sums are not an atomic snapshot.
+ *
+ * RETURN VALUES
+ *      The kmem_stat() function does not return a value.
+ */
+void
+kmem_stat(struct kmem_stat *st)
+{
+    struct kmem_class_counter *cnt;
+    struct kmem_class_stat *cs;
+    struct kmem_slab_free_list *list;
+    struct kmem_cache *cache;
+    struct kmem_slab *hdr;
+    spinlock_t *lock;
+    int cpu;
+    int c;
+
+    kmemset(st, 0, sizeof(struct kmem_stat));
+
+    for ( c = 0; c < KMEM_NCLASSES && c < KMEM_STAT_NCLASSES; c++ ) {
+        cs = &st->classes[c];
+        if ( c < KMEM_SLAB_ORDER ) {
+            /* Generic slab */
+            cs->size = 1ULL << (c + KMEM_SLAB_BASE_ORDER);
+            lock = &g_kmem->slab_lock;
+            list = &g_kmem->slab.gslabs[c];
+        } else {
+            /* Segregated fit */
+            cache = g_kmem->slab.sfit[c - KMEM_SLAB_ORDER];
+            if ( NULL == cache ) {
+                continue;
             }
+            cs->size = cache->size;
+            lock = &cache->lock;
+            list = &cache->slabs;
+        }
 
-            /* Search from full */
-            hdrp = &g_kmem->slab.gslabs[i].full;
+        /* Sum up the per-processor counters */
+        for ( cpu = 0; NULL != g_kmem->slab.stats && cpu < MAX_CPUS; cpu++ ) {
+            cnt = &g_kmem->slab.stats[cpu].classes[c];
+            cs->nalloc_fast += cnt->nalloc_fast;
+            cs->nalloc_slow += cnt->nalloc_slow;
+            cs->nfree_fast += cnt->nfree_fast;
+            cs->nfree_slow += cnt->nfree_slow;
+            cs->nslab_created += cnt->nslab_created;
+            cs->nslab_released += cnt->nslab_released;
+            cs->lock_cycles += cnt->lock_cycles;
+        }
 
-            /* Continue until the corresponding object found */
-            while ( NULL != *hdrp ) {
-                hdr = *hdrp;
+        /* Slabs */
+        spin_lock(lock);
+        for ( hdr = list->partial; NULL != hdr; hdr = hdr->next ) {
+            cs->npartial++;
+        }
+        cs->nempty = list->nfree;
+        spin_unlock(lock);
+    }
+}
 
-                found = -1;
-                for ( j = 0; j < hdr->nr; j++ ) {
-                    if ( ptr == (void *)((u64)hdr->obj_head + j * asz) ) {
-                        /* Found */
-                        found = j;
-                        break;
-                    }
-                }
-                if ( found >= 0 ) {
-                    hdr->nused--;
-                    hdr->marks[found] = 0;
-                    hdr->free = found;
-                    if ( hdr->nused <= 0 ) {
-                        /* To free list */
-                        *hdrp = hdr->next;
-                        hdr->next = g_kmem->slab.gslabs[i].free;
-                        g_kmem->slab.gslabs[i].free = hdr;
-                    } else {
-                        /* To partial list */
-                        *hdrp = hdr->next;
-                        hdr->next = g_kmem->slab.gslabs[i].partial;
-                        g_kmem->slab.gslabs[i].partial = hdr;
-                    }
-                    spin_unlock(&g_kmem->slab_lock);
-                    return;
+/*
+ * Return an object to its slab, and release the empty slabs of the list
+ * beyond KMEM_SLAB_FREE_HIGH; returns the number of the pages released
+ */
+static int
+_kmem_slab_free(struct kmem *kmem, struct kmem_slab *hdr, void *ptr)
+{
+    struct kmem_slab_free_list *list;
+    struct kmem_slab *slabs;
+    spinlock_t *lock;
+
+    if ( NULL == hdr->cache ) {
+        lock = &kmem->slab_lock;
+        list = &kmem->slab.gslabs[hdr->order];
+    } else {
+        lock = &hdr->cache->lock;
+        list = &hdr->cache->slabs;
+    }
+
+    _kmem_slab_lock(kmem, lock, _kmem_slab_class(hdr));
+    _kmem_slab_put(list, hdr, ptr);
+    slabs = _kmem_slab_detach(list, KMEM_SLAB_FREE_HIGH, KMEM_SLAB_FREE_LOW);
+    spin_unlock(lock);
+
+    if ( NULL == slabs ) {
+        return 0;
+    }
+
+    return _kmem_slab_release(kmem, slabs);
+}
+
+/*
+ * Detach the empty slabs from the list down to low if the list has more than
+ * high empty slabs; the most recently emptied ones are kept.  Returns the
+ * detached slabs linked with the next pointers.  The caller must hold the lock
+ * of the list.
+ */
+static struct kmem_slab *
+_kmem_slab_detach(struct kmem_slab_free_list *list, int high, int low)
+{
+    struct kmem_slab *slabs;
+    struct kmem_slab *hdr;
+    struct kmem_slab *next;
+    int i;
+
+    if ( list->nfree <= high ) {
+        return NULL;
+    }
+
+    hdr = list->free;
+    for ( i = 0; i < low; i++ ) {
+        hdr = hdr->next;
+    }
+    slabs = NULL;
+    while ( NULL != hdr ) {
+        next = hdr->next;
+        _kmem_slab_remove(&list->free, hdr);
+        list->nfree--;
+        hdr->next = slabs;
+        slabs = hdr;
+        hdr = next;
+    }
+
+    return slabs;
+}
+
+/*
+ * Return the detached slabs to the page allocator, and free the headers
+ * allocated apart from the slabs; returns the number of the pages released
+ */
+static int
+_kmem_slab_release(struct kmem *kmem, struct kmem_slab *slabs)
+{
+    struct kmem_class_counter *cnt;
+    struct kmem_slab *offhdrs;
+    struct kmem_slab *hdr;
+    struct kmem_slab *next;
+    void *base;
+    int cpu;
+    int n;
+
+    n = 0;
+    offhdrs = NULL;
+    cpu = this_cpu_id();
+    _kmem_slab_lock(kmem, &kmem->slab_lock, _kmem_slab_class(slabs));
+    for ( hdr = slabs; NULL != hdr; hdr = next ) {
+        /* N.B., the header is released with the pages unless off-slab */
+        next = hdr->next;
+        cnt = _kmem_counter(kmem, cpu, _kmem_slab_class(hdr));
+        if ( NULL != cnt ) {
+            cnt->nslab_released++;
+        }
+        base = _kmem_slab_base(hdr);
+        if ( (void *)hdr != base ) {
+            hdr->next = offhdrs;
+            offhdrs = hdr;
+        }
+        n += hdr->npages;
+        _kmem_slab_owner(kmem, base, hdr->npages, NULL);
+        kmem_free_pages(kmem, base);
+    }
+    spin_unlock(&kmem->slab_lock);
+
+    /* Free the off-slab headers (kfree() takes the slab lock) */
+    for ( hdr = offhdrs; NULL != hdr; hdr = next ) {
+        next = hdr->next;
+        kfree(hdr);
+    }
+
+    return n;
+}
+
+/*
+ * Release all the empty slabs of a list protected by lock; returns the number
+ * of the pages released
+ */
+static int
+_kmem_slab_trim(struct kmem *kmem, spinlock_t *lock,
+                struct kmem_slab_free_list *list)
+{
+    struct kmem_slab *slabs;
+
+    spin_lock(lock);
+    slabs = _kmem_slab_detach(list, 0, 0);
+    spin_unlock(lock);
+
+    if ( NULL == slabs ) {
+        return 0;
+    }
+
+    return _kmem_slab_release(kmem, slabs);
+}
+
+/*
+ * Return the objects in the full magazines of the depot to their slabs, and
+ * free all the magazines of the depot; returns the number of the pages
+ * released
+ */
+static int
+_kmem_depot_flush(struct kmem *kmem, struct kmem_depot *depot)
+{
+    struct kmem_magazine *mags;
+    struct kmem_magazine *mag;
+    struct kmem_magazine *next;
+    struct kmem_slab *hdr;
+    int n;
+    int i;
+
+    /* Take all the magazines */
+    spin_lock(&depot->lock);
+    mag = depot->full;
+    while ( NULL != mag && NULL != mag->next ) {
+        mag = mag->next;
+    }
+    if ( NULL != mag ) {
+        mag->next = depot->empty;
+        mags = depot->full;
+    } else {
+        mags = depot->empty;
+    }
+    depot->full = NULL;
+    depot->empty = NULL;
+    spin_unlock(&depot->lock);
+
+    n = 0;
+    for ( mag = mags; NULL != mag; mag = next ) {
+        next = mag->next;
+        for ( i = 0; i < mag->nr; i++ ) {
+            hdr = _kmem_slab_lookup(kmem, mag->objs[i]);
+            if ( NULL != hdr ) {
+                /* Clear the tag before the object leaves the magazine */
+                if ( KMEM_MAG_TAGGED(hdr->cache) ) {
+                    *(u64 *)mag->objs[i] = 0;
                 }
-                hdrp = &hdr->next;
+                n += _kmem_slab_free(kmem, hdr, mag->objs[i]);
             }
         }
+        /* The magazine itself is an object of a generic slab */
+        hdr = _kmem_slab_lookup(kmem, mag);
+        if ( NULL != hdr ) {
+            n += _kmem_slab_free(kmem, hdr, mag);
+        }
     }
 
-    /* Unlock */
-    spin_unlock(&g_kmem->slab_lock);
+    return n;
+}
+
+/*
+ * Determine the number of pages of a slab for objects of size bytes; the
+ * smallest number (a power of two) of pages wasting no more than 1/8 of the
+ * slab is chosen, or the one wasting the least if there is no such number.
+ * Returns -1 if the object is too large.
+ */
+static int
+_kmem_cache_npages(size_t size, int offslab)
+{
+    size_t npages;
+    size_t nr;
+    size_t waste;
+    size_t best;
+    size_t bwaste;
+
+    best = 0;
+    bwaste = 0;
+    for ( npages = 1; npages <= KMEM_CACHE_MAX_PAGES; npages <<= 1 ) {
+        nr = _kmem_slab_nr(npages, size, offslab);
+        if ( 0 == nr ) {
+            continue;
+        }
+        /* N.B., the header is counted as waste */
+        waste = npages * PAGESIZE - nr * size;
+        if ( waste * 8 <= npages * PAGESIZE ) {
+            return npages;
+        }
+        if ( 0 == best || waste * best < bwaste * npages ) {
+            best = npages;
+            bwaste = waste;
+        }
+    }
+
+    /* Accept a larger waste */
+    if ( best > 0 ) {
+        return best;
+    }
+
+    return -1;
 }
 
 /*
@@ -26,10 +26,44 @@
 
 extern struct kmem *g_kmem;
 
+#if PMEM_STAT_NZONES != PMEM_NUM_ZONES
+#error "PMEM_STAT_NZONES must be equal to PMEM_NUM_ZONES"
+#endif
+#if PMEM_STAT_NORDERS != PMEM_MAX_BUDDY_ORDER + 1
+#error "PMEM_STAT_NORDERS must be equal to PMEM_MAX_BUDDY_ORDER + 1"
+#endif
+
 /* Prototype declarations of static functions */
-static int _pmem_buddy_split(struct pmem *, struct pmem_buddy *, int);
-static void
-_pmem_buddy_merge(struct pmem *, struct pmem_buddy *, struct pmem_page *, int);
+static int _pmem_policy_domain(struct pmem *, struct pmem_policy *);
+static int _pmem_fallback_zones(struct pmem *, int, int *);
+static void _pmem_policy_stat(struct pmem *, int, u64, u64);
+static u32 _pmem_block_lookup(struct pmem *, void *, int *, int *);
+static size_t _pmem_zero_pool_take(struct pmem *, int, size_t, void **);
+static int _pmem_clear_pages(void *, int);
+static struct pmem_pcpu * _pmem_this_pcpu(struct pmem *);
+static void _pmem_clear_owner(struct pmem *, u32);
+static void _pmem_alloc_stat(struct pmem *, int, void *, u64);
+static void _pmem_check_low(struct pmem *, int, int);
+static void _pmem_free_stat(struct pmem *, int, u64);
+static int _pmem_lat_bucket(u64);
+static void _pmem_frag_index(struct pmem_zone_stat *);
+static void * _pmem_compact_alloc(struct pmem *, int *, int, int, int);
+static int _pmem_compact_count(struct pmem *, int, u64, int);
+static void * _pmem_compact_block(struct pmem *, int, u64, int);
+static int _pmem_migrate(struct pmem *, int, u32);
+static u32 _pmem_buddy_alloc(struct pmem *, int, int);
+static void _pmem_buddy_free(struct pmem *, int, u32, int);
+static void * _pmem_pcp_alloc(struct pmem *, int, int);
+static void _pmem_pcp_free(struct pmem *, int, u32, int);
+static u32 _pmem_buddy_merge(struct pmem *, int, u32, int *);
+static u32 _pmem_buddy_first(struct pmem *, int, int);
+static void _pmem_buddy_insert(struct pmem *, int, u32, int);
+static void _pmem_buddy_remove(struct pmem *, int, u32, int);
+#ifdef PMEM_BUDDY_BITMAP
+static u64 _pmem_bitmap_find(struct pmem_bitmap *, u64);
+static void _pmem_bitmap_set(struct pmem_bitmap *, u64);
+static void _pmem_bitmap_clear(struct pmem_bitmap *, u64);
+#endif
 
 
 /*
@@ -42,7 +76,12 @@ _pmem_buddy_merge(struct pmem *, struct pmem_buddy *, struct pmem_page *, int);
  * DESCRIPTION
  *      The pmem_alloc_pages() function allocates 2^order pages of physical
  *      memory from the zone of a physical memory region specified by the zone
- *      argument.
+ *      argument.  Low-order pages are served from the page frame cache of the
+ *      calling processor, and the buddy system of the zone is accessed only
+ *      when the cache needs to be refilled; pages of the contiguous memory
+ *      zone (PMEM_ZONE_CMA) are never cached.  If the zone runs out of space
+ *      while the initialization of some pages is deferred, the pages of the
+ *      domain of the zone are initialized on demand.
  *
  * RETURN VALUES
  *      The pmem_alloc_pages() function returns a pointer to allocated physical
@@ -51,45 +90,51 @@ _pmem_buddy_merge(struct pmem *, struct pmem_buddy *, struct pmem_page *, int);
 void *
 pmem_alloc_pages(int zone, int order)
 {
-    int ret;
     u32 idx;
     struct pmem *pmem;
-    size_t i;
+    void *a;
+    u64 t0;
 
     /* Get the pmem data structure from the global variable */
     pmem = g_kmem->pmem;
 
-    /* Check the order */
-    if ( order > PMEM_MAX_BUDDY_ORDER ) {
-        return NULL;
-    }
-
-    /* Split the upper-order's buddy first if needed */
-    ret = _pmem_buddy_split(pmem, &pmem->zones[zone].buddy, order);
-    if ( ret < 0 ) {
+    /* Check the zone and the order */
+    if ( zone < 0 || zone >= PMEM_NUM_ZONES ) {
         return NULL;
     }
-
-    /* Obtain the contiguous pages from the head */
-    idx = pmem->zones[zone].buddy.heads[order];
-    if ( PMEM_INVAL_INDEX == idx ) {
+    if ( order < 0 || order > PMEM_MAX_BUDDY_ORDER ) {
         return NULL;
     }
-    pmem->zones[zone].buddy.heads[order] = pmem->pages[idx].next;
 
-    /* Ensure the allocated pages are free */
-    for ( i = 0; i < (1ULL << order); i++ ) {
-        if ( !PMEM_IS_FREE(&pmem->pages[idx + i])
-             || pmem->pages[idx + i].order != order ) {
-            return NULL;
+    t0 = rdtsc();
+    for ( ;; ) {
+        if ( order <= PMEM_PCP_MAX_ORDER && PMEM_ZONE_CMA != zone ) {
+            /* Try the per-processor cache first for low-order pages */
+            a = _pmem_pcp_alloc(pmem, zone, order);
+        } else {
+            /* Allocate from the buddy system of the zone */
+            spin_lock(&pmem->zones[zone].lock);
+            idx = _pmem_buddy_alloc(pmem, zone, order);
+            spin_unlock(&pmem->zones[zone].lock);
+            a = PMEM_INVAL_INDEX == idx ? NULL : (void *)PAGE_ADDR(idx);
+        }
+        if ( NULL != a || 0 == pmem->ndeferred || PMEM_ZONE_CMA == zone ) {
+            break;
+        }
+        /* Initialize a deferred section of the domain, and retry */
+        if ( arch_memory_init_deferred(PMEM_ZONE_DOMAIN(zone)) <= 0 ) {
+            break;
         }
     }
-    /* Mark as used */
-    for ( i = 0; i < (1ULL << order); i++ ) {
-        pmem->pages[idx + i].flags |= PMEM_USED;
+
+    if ( NULL == a && 0 == order ) {
+        /* Take a page from the pre-zeroed pool as the last resort */
+        (void)_pmem_zero_pool_take(pmem, zone, 1, &a);
     }
+    _pmem_alloc_stat(pmem, zone, a, rdtsc() - t0);
+    _pmem_check_low(pmem, zone, NULL == a);
 
-    return (void *)PAGE_ADDR(idx);
+    return a;
 }
 
 /*
@@ -123,7 +168,8 @@ pmem_alloc_page(int zone)
  * DESCRIPTION
  *      The pmem_alloc_superpage() function allocates a superpages of physical
  *      memory from the zone of a physical memory region specified by the zone
- *      argument.
+ *      argument.  If the buddy system of the zone is fragmented, movable pages
+ *      are migrated to rebuild a free superpage.
  *
  * RETURN VALUES
  *      The pmem_alloc_superpage() function returns a pointer to allocated
@@ -132,7 +178,135 @@ pmem_alloc_page(int zone)
 void *
 pmem_alloc_superpage(int zone)
 {
-    return pmem_alloc_pages(zone, SP_SHIFT);
+    struct pmem *pmem;
+    struct pmem_pcpu *pc;
+    void *a;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
+
+    a = pmem_alloc_pages(zone, SP_SHIFT);
+    if ( NULL != a ) {
+        pc = _pmem_this_pcpu(pmem);
+        if ( NULL != pc ) {
+            pc->sp_direct++;
+        }
+        return a;
+    }
+    if ( zone < 0 || zone >= PMEM_NUM_ZONES ) {
+        return NULL;
+    }
+
+    /* Try compaction */
+    return _pmem_compact_alloc(pmem, &zone, 1, SP_SHIFT, 0);
+}
+
+/*
+ * Allocate 2^order pages following a NUMA allocation policy
+ *
+ * SYNOPSIS
+ *      void *
+ *      pmem_policy_alloc_pages(struct pmem_policy *policy, int order,
+ *                              int flags);
+ *
+ * DESCRIPTION
+ *      The pmem_policy_alloc_pages() function allocates 2^order pages of
+ *      physical memory from the zone selected by the allocation policy
+ *      specified by the policy argument.  PMEM_POLICY_LOCAL selects the domain
+ *      of the calling processor, PMEM_POLICY_PREFERRED selects the domain
+ *      specified in the policy, and PMEM_POLICY_INTERLEAVE selects the domains
+ *      in round-robin.  If the selected domain has no space, the other
+ *      domains, the UMA zone, and the LOWMEM zone are tried in this order.  If
+ *      the policy argument is NULL, PMEM_POLICY_LOCAL is used.
+ *
+ *      If PMEM_ZERO is specified in the flags argument, the allocated pages are
+ *      filled with zeros.  A single page is taken from the pool of pre-zeroed
+ *      pages first, and the other pages are zeroed on the allocation.  If
+ *      PMEM_MOVABLE is specified and the order is 0, the page can be migrated
+ *      by compaction once its owner is set by pmem_set_owner(); such a page is
+ *      lent from the contiguous memory zone first.  Requests of
+ *      superpages or larger take a compaction step on the zones if the buddy
+ *      systems cannot serve them, unless PMEM_NOCOMPACT is specified; the
+ *      zones are compacted by the idle processors in either case.
+ *
+ * RETURN VALUES
+ *      The pmem_policy_alloc_pages() function returns a pointer to allocated
+ *      physical memory.  If there is an error, it returns NULL.
+ */
+void *
+pmem_policy_alloc_pages(struct pmem_policy *policy, int order, int flags)
+{
+    struct pmem *pmem;
+    struct pmem_pcpu *pc;
+    int zones[PMEM_NUM_ZONES];
+    int pooled;
+    int n;
+    int i;
+    void *a;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
+
+    if ( (PMEM_MOVABLE & flags) && 0 == order ) {
+        /* Borrow a page from the contiguous memory zone */
+        a = pmem_alloc_pages(PMEM_ZONE_CMA, 0);
+        if ( NULL != a ) {
+            if ( (PMEM_ZERO & flags) && _pmem_clear_pages(a, 0) < 0 ) {
+                pmem_free_pages(a);
+                return NULL;
+            }
+            pmem->pages[PAGE_INDEX(a)].flags |= PMEM_MIGRATABLE;
+            return a;
+        }
+    }
+
+    /* Build the fallback chain from the domain selected by the policy */
+    n = _pmem_fallback_zones(pmem, _pmem_policy_domain(pmem, policy), zones);
+
+    for ( i = 0; i < n; i++ ) {
+        a = NULL;
+        pooled = 0;
+        if ( (PMEM_ZERO & flags) && 0 == order ) {
+            /* Try the pre-zeroed pool first */
+            pooled = _pmem_zero_pool_take(pmem, zones[i], 1, &a);
+        }
+        if ( NULL == a ) {
+            a = pmem_alloc_pages(zones[i], order);
+            if ( NULL != a && (PMEM_ZERO & flags)
+                 && _pmem_clear_pages(a, order) < 0 ) {
+                pmem_free_pages(a);
+                return NULL;
+            }
+        }
+        if ( NULL != a ) {
+            /* Update the statistics; only the blocks served by the buddy
+               system are counted */
+            if ( !pooled ) {
+                _pmem_policy_stat(pmem, zones[0], 0 == i, 0 != i);
+            }
+            pc = _pmem_this_pcpu(pmem);
+            if ( order >= SP_SHIFT && NULL != pc ) {
+                pc->sp_direct++;
+            }
+            if ( (PMEM_MOVABLE & flags) && 0 == order ) {
+                pmem->pages[PAGE_INDEX(a)].flags |= PMEM_MIGRATABLE;
+            }
+            return a;
+        }
+    }
+
+    if ( order < SP_SHIFT ) {
+        return NULL;
+    }
+
+    /* Rebuild a free block by migrating movable pages */
+    a = _pmem_compact_alloc(pmem, zones, n, order, flags);
+    if ( NULL != a && (PMEM_ZERO & flags) && _pmem_clear_pages(a, order) < 0 ) {
+        pmem_free_pages(a);
+        return NULL;
+    }
+
+    return a;
 }
 
 /*
@@ -144,7 +318,9 @@ pmem_alloc_superpage(int zone)
  *
  * DESCRIPTION
  *      The pmem_free_pages() function deallocates the physical memory
- *      allocation pointed by a.
+ *      allocation pointed by a.  If the allocation is shared by
+ *      pmem_ref_pages(), only one of its references is dropped, and the pages
+ *      are returned when the last reference is dropped.
  *
  * RETURN VALUES
  *      The pmem_free_pages() function does not return a value.
@@ -155,197 +331,1842 @@ pmem_free_pages(void *a)
     struct pmem *pmem;
     int order;
     int zone;
-    size_t i;
-    off_t idx;
+    u32 idx;
+    u64 t0;
 
     /* Get the pmem data structure from the global kmem variable */
     pmem = g_kmem->pmem;
 
-    /* Get the index of the first page of the memory space to be released */
-    idx = PAGE_INDEX(a);
+    t0 = rdtsc();
 
-    /* Check if the page index is within the physical memory space */
-    if ( (size_t)idx >= pmem->nr ) {
+    /* Get the first page of the memory space to be released */
+    idx = _pmem_block_lookup(pmem, a, &zone, &order);
+    if ( PMEM_INVAL_INDEX == idx ) {
         /* Invalid argument */
         return;
     }
-
-    /* Check the order and zone */
-    order = pmem->pages[idx].order;
-    zone = pmem->pages[idx].zone;
-    for ( i = 0; i < (1ULL << order); i++ ) {
-        if ( order != pmem->pages[idx + i].order
-             || zone != pmem->pages[idx + i].zone ) {
-            /* Invalid order or zone */
+    if ( pmem->pages[idx].refcnt > 0 ) {
+        /* Drop a reference of the shared block */
+        spin_lock(&pmem->zones[zone].lock);
+        if ( pmem->pages[idx].refcnt > 0 ) {
+            pmem->pages[idx].refcnt--;
+            spin_unlock(&pmem->zones[zone].lock);
             return;
         }
+        spin_unlock(&pmem->zones[zone].lock);
     }
+    _pmem_clear_owner(pmem, idx);
 
-    /* Unmark the used flag */
-    for ( i = 0; i < (1ULL << order); i++ ) {
-        pmem->pages[idx + i].flags &= ~PMEM_USED;
+    if ( order <= PMEM_PCP_MAX_ORDER && PMEM_ZONE_CMA != zone ) {
+        /* Return low-order pages to the per-processor cache */
+        _pmem_pcp_free(pmem, zone, idx, order);
+    } else {
+        /* Return the released pages to the buddy system */
+        spin_lock(&pmem->zones[zone].lock);
+        _pmem_buddy_free(pmem, zone, idx, order);
+        spin_unlock(&pmem->zones[zone].lock);
     }
-
-    /* Return the released pages to the buddy */
-    pmem->pages[idx].next = pmem->zones[zone].buddy.heads[order];
-    pmem->zones[zone].buddy.heads[order] = idx;
-
-    /* Merge buddies if possible */
-    _pmem_buddy_merge(pmem, &pmem->zones[zone].buddy, &pmem->pages[idx], order);
+    _pmem_free_stat(pmem, zone, rdtsc() - t0);
 }
 
 /*
- * Split the buddies so that we get at least one buddy at the order of o
+ * Allocate a batch of 2^order pages from the specified zone
+ *
+ * SYNOPSIS
+ *      size_t
+ *      pmem_alloc_pages_bulk(int zone, int order, size_t n, void **out);
+ *
+ * DESCRIPTION
+ *      The pmem_alloc_pages_bulk() function allocates up to n blocks of
+ *      2^order pages of physical memory from the zone specified by the zone
+ *      argument, and stores the addresses of the blocks to the array out.  The
+ *      blocks are not contiguous to each other.  The lock of the zone is taken
+ *      only once for the whole batch, and the page frame cache is bypassed.
+ *
+ * RETURN VALUES
+ *      The pmem_alloc_pages_bulk() function returns the number of the
+ *      allocated blocks, which is less than n if the zone runs out of space.
  */
-static int
-_pmem_buddy_split(struct pmem *pmem, struct pmem_buddy *buddy, int o)
+size_t
+pmem_alloc_pages_bulk(int zone, int order, size_t n, void **out)
 {
-    int ret;
-    struct pmem_page *p0;
-    struct pmem_page *p1;
-    u32 next;
+    struct pmem *pmem;
+    struct pmem_pcpu *pc;
     size_t i;
+    u32 idx;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
 
-    /* Check the head ofthe current order */
-    if ( PMEM_INVAL_INDEX != buddy->heads[o] ) {
-        /* At least one memory block is avaiable in this order, then nothing to
-           do here. */
+    /* Check the zone and the order */
+    if ( zone < 0 || zone >= PMEM_NUM_ZONES ) {
+        return 0;
+    }
+    if ( order < 0 || order > PMEM_MAX_BUDDY_ORDER ) {
         return 0;
     }
 
-    /* Check the order */
-    if ( o + 1 > PMEM_MAX_BUDDY_ORDER ) {
-        /* No space available */
-        return -1;
+    spin_lock(&pmem->zones[zone].lock);
+    for ( i = 0; i < n; i++ ) {
+        idx = _pmem_buddy_alloc(pmem, zone, order);
+        if ( PMEM_INVAL_INDEX == idx ) {
+            break;
+        }
+        out[i] = (void *)PAGE_ADDR(idx);
     }
+    spin_unlock(&pmem->zones[zone].lock);
 
-    /* Check the upper order */
-    if ( PMEM_INVAL_INDEX == buddy->heads[o + 1] ) {
-        /* The upper order is also empty, then try to split buddy at the one
-           more upper buddy. */
-        ret = _pmem_buddy_split(pmem, buddy, o + 1);
-        if ( ret < 0 ) {
-            /* Cannot get any */
-            return ret;
+    /* Update the statistics */
+    pc = _pmem_this_pcpu(pmem);
+    if ( NULL != pc ) {
+        pc->nalloc[zone] += i;
+        if ( i < n ) {
+            pc->nfail[zone]++;
         }
     }
+    _pmem_check_low(pmem, zone, i < n);
+
+    return i;
+}
+
+/*
+ * Allocate a batch of 2^order pages following a NUMA allocation policy
+ *
+ * SYNOPSIS
+ *      size_t
+ *      pmem_policy_alloc_pages_bulk(struct pmem_policy *policy, int order,
+ *                                   int flags, size_t n, void **out);
+ *
+ * DESCRIPTION
+ *      The pmem_policy_alloc_pages_bulk() function allocates up to n blocks of
+ *      2^order pages of physical memory like pmem_alloc_pages_bulk(), taking
+ *      the zones in the fallback chain of the allocation policy specified by
+ *      the policy argument (see pmem_policy_alloc_pages()) until n blocks are
+ *      allocated.  If PMEM_ZERO is specified in the flags argument, the blocks
+ *      are filled with zeros, and single pages are taken from the pool of
+ *      pre-zeroed pages first.  PMEM_MOVABLE marks single pages as movable, and
+ *      lends them from the contiguous memory zone first (see
+ *      pmem_policy_alloc_pages()).
+ *
+ * RETURN VALUES
+ *      The pmem_policy_alloc_pages_bulk() function returns the number of the
+ *      allocated blocks, which is less than n if all the zones in the chain run
+ *      out of space.
+ */
+size_t
+pmem_policy_alloc_pages_bulk(struct pmem_policy *policy, int order, int flags,
+                             size_t n, void **out)
+{
+    struct pmem *pmem;
+    int zones[PMEM_NUM_ZONES];
+    int nz;
+    int i;
+    size_t j;
+    size_t k;
+    size_t m;
+    size_t hit;
+    size_t miss;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
 
-    /* Save next at the upper order */
-    next = pmem->pages[buddy->heads[o + 1]].next;
-    /* Split it into two */
-    p0 = &pmem->pages[buddy->heads[o + 1]];
-    p1 = p0 + (1ULL << o);
+    /* Build the fallback chain from the domain selected by the policy */
+    nz = _pmem_fallback_zones(pmem, _pmem_policy_domain(pmem, policy), zones);
 
-    /* Set the order for all the pages in the pair */
-    for ( i = 0; i < (1ULL << (o + 1)); i++ ) {
-        p0[i].order = o;
+    m = 0;
+    if ( (PMEM_MOVABLE & flags) && 0 == order ) {
+        /* Borrow pages from the contiguous memory zone */
+        m = pmem_alloc_pages_bulk(PMEM_ZONE_CMA, 0, n, out);
+        if ( PMEM_ZERO & flags ) {
+            for ( j = 0; j < m; j++ ) {
+                if ( _pmem_clear_pages(out[j], 0) < 0 ) {
+                    pmem_free_pages_bulk(m, out);
+                    return 0;
+                }
+            }
+        }
+    }
+    hit = 0;
+    miss = 0;
+    for ( i = 0; i < nz && m < n; i++ ) {
+        if ( (PMEM_ZERO & flags) && 0 == order ) {
+            /* Take the pre-zeroed pages first */
+            m += _pmem_zero_pool_take(pmem, zones[i], n - m, out + m);
+        }
+        k = pmem_alloc_pages_bulk(zones[i], order, n - m, out + m);
+        if ( PMEM_ZERO & flags ) {
+            for ( j = m; j < m + k; j++ ) {
+                if ( _pmem_clear_pages(out[j], order) < 0 ) {
+                    pmem_free_pages_bulk(m + k, out);
+                    return 0;
+                }
+            }
+        }
+        m += k;
+        /* Only the blocks served by the buddy system are counted */
+        if ( 0 == i ) {
+            hit += k;
+        } else {
+            miss += k;
+        }
+    }
+    if ( (PMEM_MOVABLE & flags) && 0 == order ) {
+        for ( j = 0; j < m; j++ ) {
+            pmem->pages[PAGE_INDEX(out[j])].flags |= PMEM_MIGRATABLE;
+        }
     }
 
-    /* Insert it to the list */
-    p0->next = p1 - pmem->pages;
-    p1->next = buddy->heads[o];
-    buddy->heads[o] = p0 - pmem->pages;
-    /* Remove the split one from the upper order */
-    buddy->heads[o + 1] = next;
+    /* Update the statistics */
+    if ( nz > 0 ) {
+        _pmem_policy_stat(pmem, zones[0], hit, miss);
+    }
 
-    return 0;
+    return m;
 }
 
 /*
- * Merge buddies onto the upper order if possible
+ * Deallocate a batch of physical memory spaces
+ *
+ * SYNOPSIS
+ *      void
+ *      pmem_free_pages_bulk(size_t n, void **pages);
+ *
+ * DESCRIPTION
+ *      The pmem_free_pages_bulk() function deallocates the n physical memory
+ *      allocations pointed by the array pages.  The allocations are returned to
+ *      the buddy systems directly, and the lock of a zone is taken only once
+ *      for each run of consecutive allocations in the same zone.  A shared
+ *      allocation is released in the same way as pmem_free_pages().
+ *
+ * RETURN VALUES
+ *      The pmem_free_pages_bulk() function does not return a value.
  */
-static void
-_pmem_buddy_merge(struct pmem *pmem, struct pmem_buddy *buddy,
-                  struct pmem_page *off, int o)
-{
-    struct pmem_page *p0;
-    struct pmem_page *p1;
-    struct pmem_page *prev;
-    struct pmem_page *list;
-    size_t pi;
+void
+pmem_free_pages_bulk(size_t n, void **pages)
+{
+    struct pmem *pmem;
+    struct pmem_pcpu *pc;
+    int locked;
+    int order;
+    int zone;
     size_t i;
+    u32 idx;
 
-    /* Check the order first */
-    if ( o + 1 >= PMEM_MAX_BUDDY_ORDER ) {
-        /* Reached the maximum order, then do not merge anymore */
-        return;
+    /* Get the pmem data structure from the global kmem variable */
+    pmem = g_kmem->pmem;
+    pc = _pmem_this_pcpu(pmem);
+
+    locked = -1;
+    for ( i = 0; i < n; i++ ) {
+        idx = _pmem_block_lookup(pmem, pages[i], &zone, &order);
+        if ( PMEM_INVAL_INDEX == idx ) {
+            /* Invalid argument; skip it */
+            continue;
+        }
+        if ( zone != locked ) {
+            /* Switch the lock to the zone of this allocation */
+            if ( locked >= 0 ) {
+                spin_unlock(&pmem->zones[locked].lock);
+            }
+            spin_lock(&pmem->zones[zone].lock);
+            locked = zone;
+        }
+        if ( pmem->pages[idx].refcnt > 0 ) {
+            /* Drop a reference of the shared block */
+            pmem->pages[idx].refcnt--;
+            continue;
+        }
+        _pmem_clear_owner(pmem, idx);
+        _pmem_buddy_free(pmem, zone, idx, order);
+        if ( NULL != pc ) {
+            pc->nrelease[zone]++;
+        }
     }
+    if ( locked >= 0 ) {
+        spin_unlock(&pmem->zones[locked].lock);
+    }
+}
+
+/*
+ * Count the policy-based allocations at the first zone of the fallback chain
+ */
+static void
+_pmem_policy_stat(struct pmem *pmem, int zone, u64 hit, u64 miss)
+{
+    int cpu;
 
-    /* Check the page whether it's within the physical memory space */
-    pi = off - pmem->pages;
-    if ( pi >= pmem->nr ) {
-        /* Out of the physical memory region */
+    cpu = this_cpu_id();
+    if ( cpu < 0 || cpu >= MAX_CPUS ) {
         return;
     }
+    pmem->pcpu[cpu].hit[zone] += hit;
+    pmem->pcpu[cpu].miss[zone] += miss;
+}
 
-    /* Get the first page of the buddy at the upper order */
-    p0 = &pmem->pages[FLOOR(pi, PAGESIZE)];
-
-    /* Get the neighboring buddy */
-    p1 = p0 + (1ULL << o);
+/*
+ * Resolve the first page, the zone, and the order of the allocated block
+ * pointed by a; returns PMEM_INVAL_INDEX if a is not an allocated block
+ */
+static u32
+_pmem_block_lookup(struct pmem *pmem, void *a, int *zone, int *order)
+{
+    u64 idx;
 
-    /* Ensure that p0 and p1 are free */
-    if ( !PMEM_IS_FREE(p0) || !PMEM_IS_FREE(p1) ) {
-        return;
+    /* Check if the page index is within the physical memory space */
+    idx = PAGE_INDEX(a);
+    if ( idx >= pmem->nr ) {
+        return PMEM_INVAL_INDEX;
     }
 
-    /* Check the order of p1 */
-    if ( p0->order != o || p1->order != o ) {
-        /* Cannot merge because of the order mismatch */
-        return;
+    /* Check the order and zone; the first page of the block holds them */
+    *order = pmem->pages[idx].order;
+    *zone = pmem->pages[idx].zone;
+    if ( *order > PMEM_MAX_BUDDY_ORDER || idx + (1ULL << *order) > pmem->nr ) {
+        /* Invalid order, or not the first page of a block */
+        return PMEM_INVAL_INDEX;
+    }
+    if ( *zone >= PMEM_NUM_ZONES || !(PMEM_USED & pmem->pages[idx].flags) ) {
+        /* Invalid zone, or not allocated */
+        return PMEM_INVAL_INDEX;
     }
 
-    /* Remove both of the pair from the list of current order */
-    /* Try to remove p0 */
-    list = &pmem->pages[buddy->heads[o]];
-    prev = NULL;
-    while ( NULL != list ) {
-        if ( p0 == list ) {
-            if ( NULL == prev ) {
-                buddy->heads[o] = p0->next;
-            } else {
-                prev->next = p0->next;
-            }
-            break;
+    return idx;
+}
+
+/*
+ * Zero a free page and add it to the pool of pre-zeroed pages
+ *
+ * SYNOPSIS
+ *      int
+ *      pmem_zero_pool_fill(void);
+ *
+ * DESCRIPTION
+ *      The pmem_zero_pool_fill() function takes a free page from the first
+ *      zone in the local fallback chain whose pool of pre-zeroed pages is not
+ *      full, zeroes it, and adds it to the pool.  This is called by idle
+ *      processors with interrupts disabled, so that the zeroing latency is
+ *      removed from the allocation paths.
+ *
+ * RETURN VALUES
+ *      The pmem_zero_pool_fill() function returns the value of 1 if a page is
+ *      zeroed, and the value of 0 if there is nothing to do.
+ */
+int
+pmem_zero_pool_fill(void)
+{
+    struct pmem *pmem;
+    struct pmem_zone *z;
+    int zones[PMEM_NUM_ZONES];
+    int n;
+    int i;
+    u32 idx;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
+
+    n = _pmem_fallback_zones(pmem, this_cpu_domain(), zones);
+    for ( i = 0; i < n; i++ ) {
+        z = &pmem->zones[zones[i]];
+        if ( z->nzeroed >= PMEM_ZERO_POOL_SIZE ) {
+            /* This pool is full */
+            continue;
         }
-        /* Go to the next one */
-        prev = list;
-        if ( PMEM_INVAL_INDEX != list->next ) {
-            list = &pmem->pages[list->next];
-        } else {
-            list = NULL;
-        }
-    }
-    /* Try to remove p1 */
-    list = &pmem->pages[buddy->heads[o]];
-    prev = NULL;
-    while ( NULL != list ) {
-        if ( p1 == list ) {
-            if ( NULL == prev ) {
-                buddy->heads[o] = p1->next;
-            } else {
-                prev->next = p1->next;
-            }
-            break;
+
+        /* Take a free page */
+        spin_lock(&z->lock);
+        idx = _pmem_buddy_alloc(pmem, zones[i], 0);
+        spin_unlock(&z->lock);
+        if ( PMEM_INVAL_INDEX == idx ) {
+            continue;
         }
-        /* Go to the next one */
-        prev = list;
-        if ( PMEM_INVAL_INDEX != list->next ) {
-            list = &pmem->pages[list->next];
+
+        /* Zero the page without holding the lock */
+        if ( arch_clear_page((void *)PAGE_ADDR(idx)) < 0 ) {
+            spin_lock(&z->lock);
+            _pmem_buddy_free(pmem, zones[i], idx, 0);
+            spin_unlock(&z->lock);
+            return 0;
+        }
+
+        /* Add it to the pool unless the pool has been filled in the meantime */
+        spin_lock(&z->lock);
+        if ( z->nzeroed < PMEM_ZERO_POOL_SIZE ) {
+            z->zeroed[z->nzeroed++] = idx;
         } else {
-            list = NULL;
+            _pmem_buddy_free(pmem, zones[i], idx, 0);
         }
+        spin_unlock(&z->lock);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Take up to n pages from the pre-zeroed pool of the zone, and return the
+ * number of the pages taken
+ */
+static size_t
+_pmem_zero_pool_take(struct pmem *pmem, int zone, size_t n, void **out)
+{
+    struct pmem_zone *z;
+    size_t i;
+
+    z = &pmem->zones[zone];
+    if ( 0 == z->nzeroed ) {
+        return 0;
+    }
+
+    spin_lock(&z->lock);
+    for ( i = 0; i < n && z->nzeroed > 0; i++ ) {
+        out[i] = (void *)PAGE_ADDR(z->zeroed[--z->nzeroed]);
     }
+    spin_unlock(&z->lock);
+
+    return i;
+}
+
+/*
+ * Zero 2^order pages starting from a
+ */
+static int
+_pmem_clear_pages(void *a, int order)
+{
+    size_t i;
 
-    /* Set the order for all the pages in the pair */
-    for ( i = 0; i < (1ULL << (o + 1)); i++ ) {
-        p0[i].order = o + 1;
+    for ( i = 0; i < (1ULL << order); i++ ) {
+        if ( arch_clear_page(a + PAGE_ADDR(i)) < 0 ) {
+            return -1;
+        }
     }
 
-    /* Try to merge the upper order of buddies */
-    _pmem_buddy_merge(pmem, buddy, p0, o + 1);
+    return 0;
+}
+
+/*
+ * Set the owner of a movable page
+ *
+ * SYNOPSIS
+ *      void
+ *      pmem_set_owner(void *paddr, struct vmem_space *space, void *vaddr);
+ *
+ * DESCRIPTION
+ *      The pmem_set_owner() function records that the physical page specified
+ *      by the paddr argument is mapped to the virtual page vaddr of the virtual
+ *      memory space space.  A page allocated with PMEM_MOVABLE is migrated by
+ *      compaction only after its owner is set, and the owner is reset when the
+ *      page is released.
+ *
+ * RETURN VALUES
+ *      The pmem_set_owner() function does not return a value.
+ */
+void
+pmem_set_owner(void *paddr, struct vmem_space *space, void *vaddr)
+{
+    struct pmem *pmem;
+    u64 idx;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
+
+    idx = PAGE_INDEX(paddr);
+    if ( NULL == pmem->rmaps || idx >= pmem->nr ) {
+        return;
+    }
+    pmem->rmaps[idx].space = space;
+    pmem->rmaps[idx].vaddr = vaddr;
 }
 
+/*
+ * Add a reference to an allocation to share it
+ *
+ * SYNOPSIS
+ *      int
+ *      pmem_ref_pages(void *a);
+ *
+ * DESCRIPTION
+ *      The pmem_ref_pages() function adds a reference to the physical memory
+ *      allocation pointed by a, so that the allocation is shared, e.g., by the
+ *      virtual memory spaces mapping it copy-on-write.  Each reference is
+ *      dropped by pmem_free_pages().  A shared page is no longer migrated by
+ *      compaction because its owner cannot be identified.
+ *
+ * RETURN VALUES
+ *      If successful, the pmem_ref_pages() function returns the value of 0.  It
+ *      returns the value of -1 on failure.
+ */
+int
+pmem_ref_pages(void *a)
+{
+    struct pmem *pmem;
+    int order;
+    int zone;
+    u32 idx;
+
+    /* Get the pmem data structure from the global kmem variable */
+    pmem = g_kmem->pmem;
+
+    idx = _pmem_block_lookup(pmem, a, &zone, &order);
+    if ( PMEM_INVAL_INDEX == idx ) {
+        return -1;
+    }
+
+    spin_lock(&pmem->zones[zone].lock);
+    if ( pmem->pages[idx].refcnt >= 0xffff ) {
+        /* Too many references */
+        spin_unlock(&pmem->zones[zone].lock);
+        return -1;
+    }
+    pmem->pages[idx].refcnt++;
+    _pmem_clear_owner(pmem, idx);
+    spin_unlock(&pmem->zones[zone].lock);
+
+    return 0;
+}
+
+/*
+ * Get the number of the references to an allocation
+ *
+ * SYNOPSIS
+ *      int
+ *      pmem_page_refs(void *a);
+ *
+ * DESCRIPTION
+ *      The pmem_page_refs() function counts the references to the physical
+ *      memory allocation pointed by a, including the one of its allocator.
+ *
+ * RETURN VALUES
+ *      The pmem_page_refs() function returns the number of the references, or
+ *      the value of 0 if a is not an allocation.
+ */
+int
+pmem_page_refs(void *a)
+{
+    struct pmem *pmem;
+    int order;
+    int zone;
+    u32 idx;
+
+    /* Get the pmem data structure from the global kmem variable */
+    pmem = g_kmem->pmem;
+
+    idx = _pmem_block_lookup(pmem, a, &zone, &order);
+    if ( PMEM_INVAL_INDEX == idx ) {
+        return 0;
+    }
+
+    return pmem->pages[idx].refcnt + 1;
+}
+
+/*
+ * Compact a zone to allocate 2^order pages
+ *
+ * SYNOPSIS
+ *      void *
+ *      pmem_compact(int zone, int order);
+ *
+ * DESCRIPTION
+ *      The pmem_compact() function searches the zone specified by the zone
+ *      argument for the aligned block of 2^order pages that consists only of
+ *      free pages and movable pages, and requires the fewest migrations.  The
+ *      movable pages in the block are migrated to the other free pages of the
+ *      zone, and then the whole block is allocated.  A call searches at most
+ *      PMEM_COMPACT_SCAN blocks from where the previous call on the zone
+ *      stopped, so that the time taken does not grow with the memory size.
+ *      Nothing is compacted while the initialization of some pages is
+ *      deferred.
+ *
+ * RETURN VALUES
+ *      The pmem_compact() function returns a pointer to the allocated physical
+ *      memory.  If no block can be rebuilt, it returns NULL.
+ */
+void *
+pmem_compact(int zone, int order)
+{
+    struct pmem *pmem;
+    struct pmem_zone *z;
+    u64 start;
+    u64 b;
+    u64 best;
+    int min;
+    int nm;
+    int i;
+    void *a;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
+
+    /* Check the arguments */
+    if ( zone < 0 || zone >= PMEM_NUM_ZONES ) {
+        return NULL;
+    }
+    if ( order < 0 || order > PMEM_MAX_BUDDY_ORDER || NULL == pmem->rmaps ) {
+        return NULL;
+    }
+    /* The page array is scanned, so it must be initialized entirely */
+    if ( pmem->ndeferred > 0 ) {
+        return NULL;
+    }
+    z = &pmem->zones[zone];
+    start = ((u64)z->buddy.start + (1ULL << order) - 1)
+        & ~((1ULL << order) - 1);
+    if ( z->buddy.start >= z->buddy.end
+         || start + (1ULL << order) > z->buddy.end ) {
+        /* No block in this zone */
+        return NULL;
+    }
+
+    /* Only one compaction runs at a time */
+    spin_lock(&pmem->lock);
+
+    /* Find the block that requires the fewest migrations from the cursor */
+    b = ((u64)z->cursor + (1ULL << order) - 1) & ~((1ULL << order) - 1);
+    best = PMEM_INVAL_INDEX;
+    min = -1;
+    for ( i = 0; i < PMEM_COMPACT_SCAN; i++ ) {
+        if ( b < start || b + (1ULL << order) > z->buddy.end ) {
+            /* Wrap around */
+            b = start;
+        }
+        if ( pmem->pages[b].zone == zone ) {
+            spin_lock(&z->lock);
+            nm = _pmem_compact_count(pmem, zone, b, order);
+            spin_unlock(&z->lock);
+            if ( nm > 0 && (min < 0 || nm < min) ) {
+                best = b;
+                min = nm;
+            }
+        }
+        b += 1ULL << order;
+    }
+    z->cursor = b;
+
+    /* Migrate the pages in the block */
+    a = NULL;
+    if ( PMEM_INVAL_INDEX != best ) {
+        a = _pmem_compact_block(pmem, zone, best, order);
+    }
+
+    spin_unlock(&pmem->lock);
+
+    return a;
+}
+
+/*
+ * Compact zones in the background
+ *
+ * SYNOPSIS
+ *      int
+ *      pmem_compact_background(void);
+ *
+ * DESCRIPTION
+ *      The pmem_compact_background() function takes a compaction step (see
+ *      pmem_compact()) to rebuild a free superpage in the first zone of the
+ *      local fallback chain where a superpage allocation has failed.  The zone
+ *      is searched step by step until a superpage is rebuilt or the whole zone
+ *      has been searched.  This is called by idle processors with interrupts
+ *      disabled, which are enabled between the steps.
+ *
+ * RETURN VALUES
+ *      The pmem_compact_background() function returns the value of 1 if a
+ *      step is taken, and the value of 0 if there is nothing to do.
+ */
+int
+pmem_compact_background(void)
+{
+    struct pmem *pmem;
+    int zones[PMEM_NUM_ZONES];
+    int n;
+    int i;
+    void *a;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
+
+    n = _pmem_fallback_zones(pmem, this_cpu_domain(), zones);
+    for ( i = 0; i < n; i++ ) {
+        if ( pmem->zones[zones[i]].compact <= 0 ) {
+            continue;
+        }
+        pmem->zones[zones[i]].compact--;
+
+        /* Rebuild a superpage, and return it to the buddy system */
+        a = pmem_compact(zones[i], SP_SHIFT);
+        if ( NULL != a ) {
+            pmem->zones[zones[i]].compact = 0;
+            pmem_free_pages(a);
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Register a shrinker
+ *
+ * SYNOPSIS
+ *      int
+ *      pmem_register_shrinker(int (*shrinker)(void));
+ *
+ * DESCRIPTION
+ *      The pmem_register_shrinker() function registers the shrinker function,
+ *      which releases the memory cached by a subsystem when the free pages run
+ *      low.  The shrinker is called by the idle processors with interrupts
+ *      disabled, and returns the number of the pages released.
+ *
+ * RETURN VALUES
+ *      If successful, the pmem_register_shrinker() function returns the value
+ *      of 0.  Otherwise, it returns the value of -1.
+ */
+int
+pmem_register_shrinker(int (*shrinker)(void))
+{
+    struct pmem *pmem;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
+
+    spin_lock(&pmem->lock);
+    if ( pmem->nshrinkers >= PMEM_MAX_SHRINKERS ) {
+        spin_unlock(&pmem->lock);
+        return -1;
+    }
+    pmem->shrinkers[pmem->nshrinkers] = shrinker;
+    pmem->nshrinkers++;
+    spin_unlock(&pmem->lock);
+
+    return 0;
+}
+
+/*
+ * Run the shrinkers in the background
+ *
+ * SYNOPSIS
+ *      int
+ *      pmem_shrink_background(void);
+ *
+ * DESCRIPTION
+ *      The pmem_shrink_background() function calls the registered shrinkers if
+ *      the free pages of a zone ran low or an allocation failed since the last
+ *      call.  This function is called by the idle processors.
+ *
+ * RETURN VALUES
+ *      The pmem_shrink_background() function returns the value of 1 if the
+ *      shrinkers released pages, and the value of 0 if there is nothing to do.
+ */
+int
+pmem_shrink_background(void)
+{
+    struct pmem *pmem;
+    int n;
+    int i;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
+
+    if ( !pmem->shrink ) {
+        return 0;
+    }
+    pmem->shrink = 0;
+
+    n = 0;
+    for ( i = 0; i < pmem->nshrinkers; i++ ) {
+        n += pmem->shrinkers[i]();
+    }
+
+    return n > 0 ? 1 : 0;
+}
+
+/*
+ * Allocate 2^order physically contiguous pages for DMA
+ *
+ * SYNOPSIS
+ *      void *
+ *      pmem_alloc_contig_pages(int order);
+ *
+ * DESCRIPTION
+ *      The pmem_alloc_contig_pages() function allocates 2^order physically
+ *      contiguous pages from the contiguous memory zone (PMEM_ZONE_CMA), which
+ *      is reserved at the boot time and lent to movable pages while it is not
+ *      used for DMA.  If no free block is found in the zone, the movable pages
+ *      borrowing a block are migrated out of the zone to reclaim it.  If the
+ *      zone cannot serve the request, the pages are allocated from the LOWMEM
+ *      or the DMA zone, so that the pages are always below 4 GiB and
+ *      reachable by the devices limited to 32-bit addresses.  The pages are
+ *      released by pmem_free_pages().
+ *
+ * RETURN VALUES
+ *      The pmem_alloc_contig_pages() function returns the physical address of
+ *      the allocated pages.  If there is an error, it returns NULL.
+ */
+void *
+pmem_alloc_contig_pages(int order)
+{
+    void *a;
+
+    /* Check the order */
+    if ( order < 0 || order > PMEM_MAX_BUDDY_ORDER ) {
+        return NULL;
+    }
+
+    /* Take a free block from the contiguous memory zone */
+    a = pmem_alloc_pages(PMEM_ZONE_CMA, order);
+    if ( NULL != a ) {
+        return a;
+    }
+
+    /* Reclaim a block from the borrowers */
+    a = pmem_compact(PMEM_ZONE_CMA, order);
+    if ( NULL != a ) {
+        return a;
+    }
+
+    /* Fall back to the other zones below 4 GiB */
+    a = pmem_alloc_pages(PMEM_ZONE_LOWMEM, order);
+    if ( NULL != a ) {
+        return a;
+    }
+
+    return pmem_alloc_pages(PMEM_ZONE_DMA, order);
+}
+
+/*
+ * Take a snapshot of the statistics of the physical memory
+ *
+ * SYNOPSIS
+ *      void
+ *      pmem_stat(struct pmem_stat *st);
+ *
+ * DESCRIPTION
+ *      The pmem_stat() function fills the structure pointed by st with the
+ *      statistics of the physical memory: the number of usable and used pages,
+ *      the number of free blocks at each order, the fragmentation index at
+ *      each order for each zone, the allocation and failure counters summed
+ *      over the processors, and the latency histograms of pmem_alloc_pages()
+ *      and pmem_free_pages(), and the time spent to initialize the pages.  The
+ *      counters are read without taking locks, so the snapshot may be slightly
+ *      inconsistent.
+ *
+ * RETURN VALUES
+ *      The pmem_stat() function does not return a value.
+ */
+void
+pmem_stat(struct pmem_stat *st)
+{
+    struct pmem *pmem;
+    struct pmem_pcpu *pc;
+    struct pmem_zone_stat *zs;
+    int cpu;
+    int z;
+    int o;
+    int b;
+
+    /* Get the pmem data structure from the global variable */
+    pmem = g_kmem->pmem;
+
+    kmemset(st, 0, sizeof(struct pmem_stat));
+
+    /* Zones */
+    for ( z = 0; z < PMEM_NUM_ZONES; z++ ) {
+        zs = &st->zones[z];
+        zs->total = pmem->zones[z].total;
+        zs->used = pmem->zones[z].used;
+        for ( o = 0; o <= PMEM_MAX_BUDDY_ORDER; o++ ) {
+            zs->nfree[o] = pmem->zones[z].nfree[o];
+        }
+        _pmem_frag_index(zs);
+    }
+
+    /* Sum up the per-processor counters */
+    for ( cpu = 0; cpu < MAX_CPUS; cpu++ ) {
+        pc = &pmem->pcpu[cpu];
+        for ( z = 0; z < PMEM_NUM_ZONES; z++ ) {
+            st->zones[z].nalloc += pc->nalloc[z];
+            st->zones[z].nfail += pc->nfail[z];
+            st->zones[z].nrelease += pc->nrelease[z];
+        }
+        for ( b = 0; b < PMEM_LAT_NBUCKETS; b++ ) {
+            st->alloc_cycles[b] += pc->alloc_cycles[b];
+            st->free_cycles[b] += pc->free_cycles[b];
+        }
+    }
+
+    /* Initialization */
+    st->init_boot_cycles = pmem->init_boot_cycles;
+    st->init_deferred_cycles = pmem->init_deferred_cycles;
+    st->init_elapsed_cycles = pmem->init_elapsed_cycles;
+    st->init_pending = pmem->ndeferred;
+}
+
+/*
+ * Get the per-processor data of this processor; NULL if unknown
+ */
+static struct pmem_pcpu *
+_pmem_this_pcpu(struct pmem *pmem)
+{
+    int cpu;
+
+    cpu = this_cpu_id();
+    if ( cpu < 0 || cpu >= MAX_CPUS ) {
+        return NULL;
+    }
+
+    return &pmem->pcpu[cpu];
+}
+
+/*
+ * Count an allocation from the zone that took the cycles and returned a
+ */
+static void
+_pmem_alloc_stat(struct pmem *pmem, int zone, void *a, u64 cycles)
+{
+    struct pmem_pcpu *pc;
+
+    pc = _pmem_this_pcpu(pmem);
+    if ( NULL == pc ) {
+        return;
+    }
+    if ( NULL != a ) {
+        pc->nalloc[zone]++;
+    } else {
+        pc->nfail[zone]++;
+    }
+    pc->alloc_cycles[_pmem_lat_bucket(cycles)]++;
+}
+
+/*
+ * Request the shrinkers if the allocation from the zone failed or the free
+ * pages of the zone run low; the deferred pages are not counted yet, so it is
+ * not checked until all the pages are initialized
+ */
+static void
+_pmem_check_low(struct pmem *pmem, int zone, int failed)
+{
+    struct pmem_zone *z;
+
+    if ( PMEM_ZONE_CMA == zone || 0 != pmem->ndeferred ) {
+        /* The contiguous memory zone only lends pages */
+        return;
+    }
+    z = &pmem->zones[zone];
+    if ( failed || z->total - z->used < (z->total >> PMEM_LOW_SHIFT) ) {
+        pmem->shrink = 1;
+    }
+}
+
+/*
+ * Count a deallocation to the zone that took the cycles
+ */
+static void
+_pmem_free_stat(struct pmem *pmem, int zone, u64 cycles)
+{
+    struct pmem_pcpu *pc;
+
+    pc = _pmem_this_pcpu(pmem);
+    if ( NULL == pc ) {
+        return;
+    }
+    pc->nrelease[zone]++;
+    pc->free_cycles[_pmem_lat_bucket(cycles)]++;
+}
+
+/*
+ * Get the bucket of the latency histograms (log2 of the cycles)
+ */
+static int
+_pmem_lat_bucket(u64 cycles)
+{
+    int b;
+
+    b = 63 - __builtin_clzll(cycles | 1);
+    if ( b >= PMEM_LAT_NBUCKETS ) {
+        b = PMEM_LAT_NBUCKETS - 1;
+    }
+
+    return b;
+}
+
+/*
+ * Calculate the fragmentation index at each order from the free blocks of the
+ * zone; the index is 1 - (1 + free pages / 2^order) / free blocks if there is
+ * no free block of the order or upper orders (in thousandths)
+ */
+static void
+_pmem_frag_index(struct pmem_zone_stat *zs)
+{
+    u64 pages;
+    u64 blocks;
+    int o;
+
+    pages = 0;
+    blocks = 0;
+    for ( o = 0; o <= PMEM_MAX_BUDDY_ORDER; o++ ) {
+        pages += zs->nfree[o] << o;
+        blocks += zs->nfree[o];
+    }
+
+    /* From the highest order to track the availability of upper blocks */
+    for ( o = PMEM_MAX_BUDDY_ORDER; o >= 0; o-- ) {
+        if ( zs->nfree[o] > 0 || (o < PMEM_MAX_BUDDY_ORDER
+                                  && -1000 == zs->frag[o + 1]) ) {
+            /* The allocation at this order succeeds */
+            zs->frag[o] = -1000;
+        } else if ( 0 == blocks ) {
+            zs->frag[o] = 0;
+        } else {
+            zs->frag[o] = 1000
+                - (int)((1000 + ((pages * 1000) >> o)) / blocks);
+        }
+    }
+}
+
+/*
+ * Reset the owner of the page at the page index idx to be released
+ */
+static void
+_pmem_clear_owner(struct pmem *pmem, u32 idx)
+{
+    pmem->pages[idx].flags &= ~PMEM_MIGRATABLE;
+    if ( NULL != pmem->rmaps ) {
+        pmem->rmaps[idx].space = NULL;
+        pmem->rmaps[idx].vaddr = NULL;
+    }
+}
+
+/*
+ * Take a compaction step on the n zones to allocate 2^order pages after their
+ * buddy systems failed to serve a superpage request (unless PMEM_NOCOMPACT is
+ * specified in the flags), and request the background compaction of the whole
+ * zones to keep superpages available
+ */
+static void *
+_pmem_compact_alloc(struct pmem *pmem, int *zones, int n, int order,
+                    int flags)
+{
+    struct pmem_pcpu *pc;
+    struct pmem_zone *z;
+    int i;
+    void *a;
+
+    pc = _pmem_this_pcpu(pmem);
+    for ( i = 0; i < n; i++ ) {
+        z = &pmem->zones[zones[i]];
+        if ( z->buddy.start < z->buddy.end ) {
+            z->compact = ((z->buddy.end - z->buddy.start) >> SP_SHIFT)
+                / PMEM_COMPACT_SCAN + 1;
+        }
+    }
+    for ( i = 0; i < n && !(PMEM_NOCOMPACT & flags); i++ ) {
+        a = pmem_compact(zones[i], order);
+        if ( NULL != a ) {
+            if ( NULL != pc ) {
+                pc->sp_compacted++;
+            }
+            return a;
+        }
+    }
+    if ( NULL != pc ) {
+        pc->sp_fallback++;
+    }
+
+    return NULL;
+}
+
+/*
+ * Count the movable pages in the block of 2^order pages starting from the page
+ * index b; returns -1 if the block contains pages that cannot be migrated.  The
+ * caller must hold the lock of the zone.
+ */
+static int
+_pmem_compact_count(struct pmem *pmem, int zone, u64 b, int order)
+{
+    struct pmem_page *pg;
+    u64 end;
+    u64 j;
+    int n;
+    int o;
+
+    end = b + (1ULL << order);
+    n = 0;
+    for ( j = b; j < end; j += (1ULL << o) ) {
+        pg = &pmem->pages[j];
+        o = pg->order;
+        if ( pg->zone != zone || !(PMEM_USABLE & pg->flags)
+             || o > PMEM_MAX_BUDDY_ORDER || j + (1ULL << o) > end ) {
+            /* Not a head of a block in this zone, or a larger block */
+            return -1;
+        }
+        if ( !(PMEM_USED & pg->flags) ) {
+            /* Free block */
+            continue;
+        }
+        if ( 0 != o || !(PMEM_MIGRATABLE & pg->flags)
+             || NULL == pmem->rmaps[j].space ) {
+            /* Unmovable */
+            return -1;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Migrate the movable pages out of the block of 2^order pages starting from
+ * the page index b, and allocate the block
+ */
+static void *
+_pmem_compact_block(struct pmem *pmem, int zone, u64 b, int order)
+{
+    u64 end;
+    u64 j;
+    int o;
+
+    end = b + (1ULL << order);
+
+    /* Isolate the free blocks in the block from the buddy system so that the
+       destinations of the migrations are taken from the outside */
+    spin_lock(&pmem->zones[zone].lock);
+    if ( _pmem_compact_count(pmem, zone, b, order) < 0 ) {
+        /* Changed since the search */
+        spin_unlock(&pmem->zones[zone].lock);
+        return NULL;
+    }
+    for ( j = b; j < end; j += (1ULL << o) ) {
+        o = pmem->pages[j].order;
+        if ( !(PMEM_USED & pmem->pages[j].flags) ) {
+            _pmem_buddy_remove(pmem, zone, j, o);
+            pmem->pages[j].flags |= PMEM_USED;
+        }
+    }
+    spin_unlock(&pmem->zones[zone].lock);
+
+    /* Migrate the movable pages */
+    for ( j = b; j < end; j += (1ULL << o) ) {
+        o = pmem->pages[j].order;
+        if ( !(PMEM_MIGRATABLE & pmem->pages[j].flags) ) {
+            continue;
+        }
+        if ( _pmem_migrate(pmem, zone, j) < 0 ) {
+            /* Return the isolated and migrated pages to the buddy system;
+               the order is saved before the block is merged. */
+            spin_lock(&pmem->zones[zone].lock);
+            for ( j = b; j < end; j += (1ULL << o) ) {
+                o = pmem->pages[j].order;
+                if ( !(PMEM_MIGRATABLE & pmem->pages[j].flags) ) {
+                    _pmem_buddy_free(pmem, zone, j, o);
+                }
+            }
+            spin_unlock(&pmem->zones[zone].lock);
+            return NULL;
+        }
+    }
+
+    /* Turn the isolated pages into an allocated block */
+    spin_lock(&pmem->zones[zone].lock);
+    for ( j = b + 1; j < end; j++ ) {
+        pmem->pages[j].order = PMEM_INVAL_BUDDY_ORDER;
+        pmem->pages[j].flags &= ~PMEM_USED;
+    }
+    pmem->pages[b].order = order;
+    spin_unlock(&pmem->zones[zone].lock);
+
+    return (void *)PAGE_ADDR(b);
+}
+
+/*
+ * Migrate the movable page at the page index idx to a free page of the zone
+ */
+static int
+_pmem_migrate(struct pmem *pmem, int zone, u32 idx)
+{
+    struct pmem_rmap *rmap;
+    struct pmem_pcpu *pc;
+    int zones[PMEM_NUM_ZONES];
+    int n;
+    int i;
+    int dz;
+    u32 dst;
+    int ret;
+
+    /* Allocate the destination; pages lent from the contiguous memory zone
+       are moved out to the other zones if possible */
+    dst = PMEM_INVAL_INDEX;
+    dz = zone;
+    if ( PMEM_ZONE_CMA == zone ) {
+        n = _pmem_fallback_zones(pmem, this_cpu_domain(), zones);
+        for ( i = 0; i < n && PMEM_INVAL_INDEX == dst; i++ ) {
+            dz = zones[i];
+            spin_lock(&pmem->zones[dz].lock);
+            dst = _pmem_buddy_alloc(pmem, dz, 0);
+            spin_unlock(&pmem->zones[dz].lock);
+        }
+    }
+    if ( PMEM_INVAL_INDEX == dst ) {
+        dz = zone;
+        spin_lock(&pmem->zones[dz].lock);
+        dst = _pmem_buddy_alloc(pmem, dz, 0);
+        spin_unlock(&pmem->zones[dz].lock);
+    }
+    if ( PMEM_INVAL_INDEX == dst ) {
+        return -1;
+    }
+
+    /* Copy the page and remap the owner's virtual page */
+    rmap = &pmem->rmaps[idx];
+    ret = arch_migrate_page(rmap->space, rmap->vaddr, (void *)PAGE_ADDR(idx),
+                            (void *)PAGE_ADDR(dst));
+    if ( ret < 0 ) {
+        spin_lock(&pmem->zones[dz].lock);
+        _pmem_buddy_free(pmem, dz, dst, 0);
+        spin_unlock(&pmem->zones[dz].lock);
+        return -1;
+    }
+
+    /* Move the owner to the destination */
+    pmem->rmaps[dst] = *rmap;
+    pmem->pages[dst].flags |= PMEM_MIGRATABLE;
+    _pmem_clear_owner(pmem, idx);
+
+    pc = _pmem_this_pcpu(pmem);
+    if ( NULL != pc ) {
+        pc->migrated++;
+    }
+
+    return 0;
+}
+
+/*
+ * Resolve the domain that the policy selects; -1 if no domain is selected
+ */
+static int
+_pmem_policy_domain(struct pmem *pmem, struct pmem_policy *policy)
+{
+    int i;
+    int d;
+
+    if ( NULL == policy || PMEM_POLICY_LOCAL == policy->mode ) {
+        return this_cpu_domain();
+    } else if ( PMEM_POLICY_PREFERRED == policy->mode ) {
+        return policy->domain;
+    } else if ( PMEM_POLICY_INTERLEAVE == policy->mode ) {
+        /* Take the next domain that has pages */
+        for ( i = 0; i < PMEM_NUMA_MAX_DOMAINS; i++ ) {
+            d = (policy->next + i) % PMEM_NUMA_MAX_DOMAINS;
+            if ( d >= 0 && pmem->zones[PMEM_ZONE_NUMA(d)].total > 0 ) {
+                policy->next = d + 1;
+                return d;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Build the fallback chain of the zones starting from the domain d, and return
+ * the number of the zones in the chain
+ */
+static int
+_pmem_fallback_zones(struct pmem *pmem, int d, int *zones)
+{
+    int n;
+    int i;
+    int z;
+
+    if ( d < 0 || d >= PMEM_NUMA_MAX_DOMAINS ) {
+        d = 0;
+    }
+
+    n = 0;
+    /* NUMA zones from the domain d */
+    for ( i = 0; i < PMEM_NUMA_MAX_DOMAINS; i++ ) {
+        z = PMEM_ZONE_NUMA((d + i) % PMEM_NUMA_MAX_DOMAINS);
+        if ( pmem->zones[z].total > 0 ) {
+            zones[n++] = z;
+        }
+    }
+    /* Then the UMA zone and the low memory zone; the DMA zone is reserved */
+    if ( pmem->zones[PMEM_ZONE_UMA].total > 0 ) {
+        zones[n++] = PMEM_ZONE_UMA;
+    }
+    zones[n++] = PMEM_ZONE_LOWMEM;
+
+    return n;
+}
+
+/*
+ * Add 2^order pages starting from the page index idx to the buddy system
+ *
+ * SYNOPSIS
+ *      void
+ *      pmem_buddy_add(struct pmem *pmem, size_t idx, int order);
+ *
+ * DESCRIPTION
+ *      The pmem_buddy_add() function adds the free block of 2^order pages
+ *      starting from the page index specified by the idx argument to the buddy
+ *      system of its zone, and merges it with the free buddies already added.
+ *      The block must be aligned to its size and all the pages must belong to
+ *      the same zone.  This is used to construct the buddy system at the
+ *      initialization, also chunk by chunk for the deferred pages.
+ *
+ * RETURN VALUES
+ *      The pmem_buddy_add() function does not return a value.
+ */
+void
+pmem_buddy_add(struct pmem *pmem, size_t idx, int order)
+{
+    int zone;
+
+    zone = pmem->pages[idx].zone;
+
+    spin_lock(&pmem->zones[zone].lock);
+    /* Extend the range of this zone */
+    if ( pmem->zones[zone].buddy.start > idx ) {
+        pmem->zones[zone].buddy.start = idx;
+    }
+    if ( pmem->zones[zone].buddy.end < idx + (1ULL << order) ) {
+        pmem->zones[zone].buddy.end = idx + (1ULL << order);
+    }
+    /* The pages are counted as used until they are inserted */
+    pmem->zones[zone].total += 1ULL << order;
+    pmem->zones[zone].used += 1ULL << order;
+    _pmem_buddy_free(pmem, zone, idx, order);
+    spin_unlock(&pmem->zones[zone].lock);
+}
+
+/*
+ * Allocate 2^order pages from the buddy system of the zone; the caller must
+ * hold the lock of the zone.
+ */
+static u32
+_pmem_buddy_alloc(struct pmem *pmem, int zone, int order)
+{
+    int o;
+    u32 idx;
+
+    /* Find the smallest free block of the order or an upper order */
+    idx = PMEM_INVAL_INDEX;
+    for ( o = order; o <= PMEM_MAX_BUDDY_ORDER; o++ ) {
+        idx = _pmem_buddy_first(pmem, zone, o);
+        if ( PMEM_INVAL_INDEX != idx ) {
+            break;
+        }
+    }
+    if ( PMEM_INVAL_INDEX == idx ) {
+        /* No space available */
+        return PMEM_INVAL_INDEX;
+    }
+
+    /* Ensure the block is free */
+    if ( !PMEM_IS_FREE(&pmem->pages[idx]) || pmem->pages[idx].order != o ) {
+        return PMEM_INVAL_INDEX;
+    }
+    _pmem_buddy_remove(pmem, zone, idx, o);
+
+    /* Split the block, and return the upper halves to the buddy system */
+    while ( o > order ) {
+        o--;
+        _pmem_buddy_insert(pmem, zone, idx + (1UL << o), o);
+    }
+
+    /* Mark as used */
+    pmem->pages[idx].order = order;
+    pmem->pages[idx].flags |= PMEM_USED;
+
+    return idx;
+}
+
+/*
+ * Return 2^order pages starting from the page index idx to the buddy system of
+ * the zone; the caller must hold the lock of the zone.
+ */
+static void
+_pmem_buddy_free(struct pmem *pmem, int zone, u32 idx, int order)
+{
+    /* Unmark the used flag */
+    pmem->pages[idx].flags &= ~PMEM_USED;
+
+    /* Merge buddies if possible, then return the merged block to the buddy */
+    idx = _pmem_buddy_merge(pmem, zone, idx, &order);
+    _pmem_buddy_insert(pmem, zone, idx, order);
+}
+
+/*
+ * Allocate 2^order pages through the page frame cache of this processor.  Note
+ * that the cache is accessed only by the owner processor, and the page fault
+ * handler, the only interrupt handler allocating physical pages, is never
+ * raised inside the allocator (see task_prefault()), so the cache itself does
+ * not need any lock.
+ */
+static void *
+_pmem_pcp_alloc(struct pmem *pmem, int zone, int order)
+{
+    struct pmem_pcp_cache *pcp;
+    int cpu;
+    u32 idx;
+
+    /* Get the cache of this processor */
+    cpu = this_cpu_id();
+    if ( cpu < 0 || cpu >= MAX_CPUS ) {
+        /* Unknown processor, then go to the buddy system directly */
+        spin_lock(&pmem->zones[zone].lock);
+        idx = _pmem_buddy_alloc(pmem, zone, order);
+        spin_unlock(&pmem->zones[zone].lock);
+        if ( PMEM_INVAL_INDEX == idx ) {
+            return NULL;
+        }
+        return (void *)PAGE_ADDR(idx);
+    }
+    pcp = &pmem->pcpu[cpu].caches[zone][order];
+
+    if ( 0 == pcp->nr ) {
+        /* The cache is empty, then refill a batch from the buddy system */
+        spin_lock(&pmem->zones[zone].lock);
+        while ( pcp->nr < PMEM_PCP_BATCH ) {
+            idx = _pmem_buddy_alloc(pmem, zone, order);
+            if ( PMEM_INVAL_INDEX == idx ) {
+                break;
+            }
+            pcp->frames[pcp->nr++] = idx;
+        }
+        spin_unlock(&pmem->zones[zone].lock);
+        if ( 0 == pcp->nr ) {
+            /* No page available in this zone */
+            return NULL;
+        }
+    }
+
+    /* Take the most recently freed one (likely cache-hot) */
+    idx = pcp->frames[--pcp->nr];
+
+    return (void *)PAGE_ADDR(idx);
+}
+
+/*
+ * Release 2^order pages to the page frame cache of this processor
+ */
+static void
+_pmem_pcp_free(struct pmem *pmem, int zone, u32 idx, int order)
+{
+    struct pmem_pcp_cache *pcp;
+    int cpu;
+    int i;
+
+    /* Get the cache of this processor */
+    cpu = this_cpu_id();
+    if ( cpu < 0 || cpu >= MAX_CPUS ) {
+        /* Unknown processor, then go to the buddy system directly */
+        spin_lock(&pmem->zones[zone].lock);
+        _pmem_buddy_free(pmem, zone, idx, order);
+        spin_unlock(&pmem->zones[zone].lock);
+        return;
+    }
+    pcp = &pmem->pcpu[cpu].caches[zone][order];
+
+    if ( pcp->nr >= PMEM_PCP_SIZE ) {
+        /* The cache is full, then drain the oldest batch to the buddy system */
+        spin_lock(&pmem->zones[zone].lock);
+        for ( i = 0; i < PMEM_PCP_BATCH; i++ ) {
+            _pmem_buddy_free(pmem, zone, pcp->frames[i], order);
+        }
+        spin_unlock(&pmem->zones[zone].lock);
+        for ( i = PMEM_PCP_BATCH; i < (int)pcp->nr; i++ ) {
+            pcp->frames[i - PMEM_PCP_BATCH] = pcp->frames[i];
+        }
+        pcp->nr -= PMEM_PCP_BATCH;
+    }
+
+    /* Keep the frames as used in the cache */
+    pcp->frames[pcp->nr++] = idx;
+}
+
+/*
+ * Merge the block at the page index idx with its free buddies as long as
+ * possible.  The merged blocks are removed from the buddy system, and the page
+ * index of the resulting block is returned with its order updated in *o.
+ */
+static u32
+_pmem_buddy_merge(struct pmem *pmem, int zone, u32 idx, int *o)
+{
+    struct pmem_page *bp;
+    u32 bi;
+
+    while ( *o < PMEM_MAX_BUDDY_ORDER ) {
+        /* Get the neighboring buddy */
+        bi = idx ^ (1UL << *o);
+        if ( bi + (1ULL << *o) > pmem->nr ) {
+            /* Out of the physical memory region */
+            break;
+        }
+        bp = &pmem->pages[bi];
+
+        /* Ensure that the buddy is a free block of the same order and zone */
+        if ( !PMEM_IS_FREE(bp) || bp->order != *o || bp->zone != zone ) {
+            break;
+        }
+
+        /* Remove the buddy from the buddy system, and demote the head of the
+           upper half to a non-head page */
+        _pmem_buddy_remove(pmem, zone, bi, *o);
+        if ( bi < idx ) {
+            pmem->pages[idx].order = PMEM_INVAL_BUDDY_ORDER;
+            idx = bi;
+        } else {
+            bp->order = PMEM_INVAL_BUDDY_ORDER;
+        }
+        (*o)++;
+        pmem->pages[idx].order = *o;
+    }
+
+    return idx;
+}
+
+#ifdef PMEM_BUDDY_BITMAP
+
+/*
+ * Calculate the size of the bitmaps of the buddy system
+ *
+ * SYNOPSIS
+ *      size_t
+ *      pmem_buddy_size(size_t npg);
+ *
+ * DESCRIPTION
+ *      The pmem_buddy_size() function calculates the size of the data
+ *      structure that the buddy system requires in addition to the pmem and
+ *      pmem_page structures for npg pages.
+ *
+ * RETURN VALUES
+ *      The pmem_buddy_size() function returns the size in bytes.
+ */
+size_t
+pmem_buddy_size(size_t npg)
+{
+    size_t sz;
+    u64 nw;
+    int o;
+
+    sz = 0;
+    for ( o = 0; o <= PMEM_MAX_BUDDY_ORDER; o++ ) {
+        /* Sum up the words from the bottom level to the top level */
+        nw = DIV_CEIL(DIV_CEIL(npg, 1ULL << o), 64);
+        sz += nw * sizeof(u64);
+        while ( nw > 1 ) {
+            nw = DIV_CEIL(nw, 64);
+            sz += nw * sizeof(u64);
+        }
+    }
+
+    return sz;
+}
+
+/*
+ * Initialize the buddy system
+ *
+ * SYNOPSIS
+ *      void
+ *      pmem_buddy_init(struct pmem *pmem, void *data);
+ *
+ * DESCRIPTION
+ *      The pmem_buddy_init() function resets the buddy systems of all the
+ *      zones.  The data argument points to the memory space of the size
+ *      returned by pmem_buddy_size(), where the bitmaps are placed.
+ *
+ * RETURN VALUES
+ *      The pmem_buddy_init() function does not return a value.
+ */
+void
+pmem_buddy_init(struct pmem *pmem, void *data)
+{
+    struct pmem_bitmap *bm;
+    u64 *w;
+    u64 nw;
+    int i;
+    int o;
+
+    /* Place the bitmaps */
+    kmemset(data, 0, pmem_buddy_size(pmem->nr));
+    w = data;
+    for ( o = 0; o <= PMEM_MAX_BUDDY_ORDER; o++ ) {
+        bm = &pmem->bitmaps[o];
+        nw = DIV_CEIL(DIV_CEIL(pmem->nr, 1ULL << o), 64);
+        bm->nlevels = 0;
+        for ( ;; ) {
+            bm->nwords[bm->nlevels] = nw;
+            bm->levels[bm->nlevels] = w;
+            bm->nlevels++;
+            w += nw;
+            if ( nw <= 1 ) {
+                break;
+            }
+            nw = DIV_CEIL(nw, 64);
+        }
+    }
+
+    /* Reset the zones */
+    for ( i = 0; i < PMEM_NUM_ZONES; i++ ) {
+        pmem->zones[i].buddy.start = PMEM_INVAL_INDEX;
+        pmem->zones[i].buddy.end = 0;
+        for ( o = 0; o <= PMEM_MAX_BUDDY_ORDER; o++ ) {
+            pmem->zones[i].nfree[o] = 0;
+        }
+    }
+}
+
+/*
+ * Find the first free block at the order of o in the zone
+ */
+static u32
+_pmem_buddy_first(struct pmem *pmem, int zone, int o)
+{
+    struct pmem_buddy *buddy;
+    u64 b;
+
+    buddy = &pmem->zones[zone].buddy;
+    if ( 0 == pmem->zones[zone].nfree[o] ) {
+        return PMEM_INVAL_INDEX;
+    }
+
+    /* Search the range of the zone; the blocks of the other zones may be found
+       when the zones are interleaved, then skip them. */
+    b = buddy->start >> o;
+    for ( ;; ) {
+        b = _pmem_bitmap_find(&pmem->bitmaps[o], b);
+        if ( (u64)-1 == b || (b << o) >= buddy->end ) {
+            return PMEM_INVAL_INDEX;
+        }
+        if ( zone == pmem->pages[b << o].zone ) {
+            return b << o;
+        }
+        b++;
+    }
+}
+
+/*
+ * Insert the block at the page index idx to the buddy system at the order of o
+ */
+static void
+_pmem_buddy_insert(struct pmem *pmem, int zone, u32 idx, int o)
+{
+    pmem->pages[idx].order = o;
+    _pmem_bitmap_set(&pmem->bitmaps[o], idx >> o);
+    pmem->zones[zone].nfree[o]++;
+    pmem->zones[zone].used -= 1ULL << o;
+}
+
+/*
+ * Remove the block at the page index idx from the buddy system at the order of
+ * o
+ */
+static void
+_pmem_buddy_remove(struct pmem *pmem, int zone, u32 idx, int o)
+{
+    _pmem_bitmap_clear(&pmem->bitmaps[o], idx >> o);
+    pmem->zones[zone].nfree[o]--;
+    pmem->zones[zone].used += 1ULL << o;
+}
+
+/*
+ * Find the first set bit at or after the bit b; returns (u64)-1 if not found
+ */
+static u64
+_pmem_bitmap_find(struct pmem_bitmap *bm, u64 b)
+{
+    int l;
+    u64 w;
+    u64 wi;
+
+    /* Go up until a non-zero word is found at or after the position */
+    l = 0;
+    for ( ;; ) {
+        wi = b >> 6;
+        if ( wi >= bm->nwords[l] ) {
+            return (u64)-1;
+        }
+        w = bm->levels[l][wi] & (~0ULL << (b & 63));
+        if ( w ) {
+            b = (wi << 6) + __builtin_ctzll(w);
+            break;
+        }
+        if ( l + 1 >= bm->nlevels ) {
+            return (u64)-1;
+        }
+        /* Continue from the next word at the upper level */
+        b = wi + 1;
+        l++;
+    }
+
+    /* Go down to the bottom level following the first set bits */
+    while ( l > 0 ) {
+        l--;
+        b = (b << 6) + __builtin_ctzll(bm->levels[l][b]);
+    }
+
+    return b;
+}
+
+/*
+ * Set the bit b and the summary bits of the upper levels
+ */
+static void
+_pmem_bitmap_set(struct pmem_bitmap *bm, u64 b)
+{
+    int l;
+    u64 w;
+
+    for ( l = 0; l < bm->nlevels; l++ ) {
+        w = bm->levels[l][b >> 6];
+        bm->levels[l][b >> 6] = w | (1ULL << (b & 63));
+        if ( 0 != w ) {
+            /* The upper levels have already been set */
+            break;
+        }
+        b >>= 6;
+    }
+}
+
+/*
+ * Clear the bit b and the summary bits of the upper levels
+ */
+static void
+_pmem_bitmap_clear(struct pmem_bitmap *bm, u64 b)
+{
+    int l;
+    u64 w;
+
+    for ( l = 0; l < bm->nlevels; l++ ) {
+        w = bm->levels[l][b >> 6] & ~(1ULL << (b & 63));
+        bm->levels[l][b >> 6] = w;
+        if ( 0 != w ) {
+            /* The word is still non-zero */
+            break;
+        }
+        b >>= 6;
+    }
+}
+
+#else /* !PMEM_BUDDY_BITMAP */
+
+/*
+ * Calculate the size of the additional data structure of the buddy system
+ *
+ * SYNOPSIS
+ *      size_t
+ *      pmem_buddy_size(size_t npg);
+ *
+ * DESCRIPTION
+ *      The pmem_buddy_size() function calculates the size of the data
+ *      structure that the buddy system requires in addition to the pmem and
+ *      pmem_page structures for npg pages.  The free lists are linked through
+ *      the pmem_page structures, so no additional space is required.
+ *
+ * RETURN VALUES
+ *      The pmem_buddy_size() function returns the size in bytes.
+ */
+size_t
+pmem_buddy_size(size_t npg)
+{
+    (void)npg;
+
+    return 0;
+}
+
+/*
+ * Initialize the buddy system
+ *
+ * SYNOPSIS
+ *      void
+ *      pmem_buddy_init(struct pmem *pmem, void *data);
+ *
+ * DESCRIPTION
+ *      The pmem_buddy_init() function resets the buddy systems of all the
+ *      zones.  The data argument is not used by this backend.
+ *
+ * RETURN VALUES
+ *      The pmem_buddy_init() function does not return a value.
+ */
+void
+pmem_buddy_init(struct pmem *pmem, void *data)
+{
+    int i;
+    int o;
+
+    (void)data;
+
+    for ( i = 0; i < PMEM_NUM_ZONES; i++ ) {
+        pmem->zones[i].buddy.start = PMEM_INVAL_INDEX;
+        pmem->zones[i].buddy.end = 0;
+        for ( o = 0; o <= PMEM_MAX_BUDDY_ORDER; o++ ) {
+            pmem->zones[i].buddy.heads[o] = PMEM_INVAL_INDEX;
+            pmem->zones[i].nfree[o] = 0;
+        }
+    }
+}
+
+/*
+ * Get the first free block at the order of o in the zone
+ */
+static u32
+_pmem_buddy_first(struct pmem *pmem, int zone, int o)
+{
+    return pmem->zones[zone].buddy.heads[o];
+}
+
+/*
+ * Insert the block at the page index idx to the head of the list at the order
+ * of o
+ */
+static void
+_pmem_buddy_insert(struct pmem *pmem, int zone, u32 idx, int o)
+{
+    struct pmem_buddy *buddy;
+    u32 next;
+
+    buddy = &pmem->zones[zone].buddy;
+    next = buddy->heads[o];
+    pmem->pages[idx].order = o;
+    pmem->pages[idx].prev = PMEM_INVAL_INDEX;
+    pmem->pages[idx].next = next;
+    if ( PMEM_INVAL_INDEX != next ) {
+        pmem->pages[next].prev = idx;
+    }
+    buddy->heads[o] = idx;
+    pmem->zones[zone].nfree[o]++;
+    pmem->zones[zone].used -= 1ULL << o;
+}
+
+/*
+ * Remove the block at the page index idx from the list at the order of o
+ */
+static void
+_pmem_buddy_remove(struct pmem *pmem, int zone, u32 idx, int o)
+{
+    struct pmem_buddy *buddy;
+    u32 prev;
+    u32 next;
+
+    buddy = &pmem->zones[zone].buddy;
+    prev = pmem->pages[idx].prev;
+    next = pmem->pages[idx].next;
+    if ( PMEM_INVAL_INDEX == prev ) {
+        buddy->heads[o] = next;
+    } else {
+        pmem->pages[prev].next = next;
+    }
+    if ( PMEM_INVAL_INDEX != next ) {
+        pmem->pages[next].prev = prev;
+    }
+    pmem->pages[idx].prev = PMEM_INVAL_INDEX;
+    pmem->pages[idx].next = PMEM_INVAL_INDEX;
+    pmem->zones[zone].nfree[o]--;
+    pmem->zones[zone].used += 1ULL << o;
+}
+
+#endif /* PMEM_BUDDY_BITMAP */
+
 /*
  * Local variables:
  * tab-width: 4
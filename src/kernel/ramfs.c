@@ -90,11 +90,14 @@ ramfs_open(const char *path)
     }
 
     /* Create a fild descriptor */
-    fildes = kmalloc(sizeof(struct fildes));
+    fildes = kmem_cache_alloc(fildes_cache);
+    if ( NULL == fildes ) {
+        return -1;
+    }
     kmemset(fildes, 0, sizeof(struct fildes));
     data = kmalloc(sizeof(struct ramfs_fildes));
     if ( NULL == data ) {
-        kfree(fildes);
+        kmem_cache_free(fildes_cache, fildes);
         return -1;
     }
     data->content = (void *)((u64)ramfs->root + offset);
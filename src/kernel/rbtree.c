@@ -59,6 +59,21 @@ static struct rbtree_node * _uncle(struct rbtree_node *);
 static struct rbtree_node * _sibling(struct rbtree_node *);
 static int _is_leaf(struct rbtree_node *);
 
+/*
+ * Constructor of the object cache of the nodes
+ */
+void
+rbtree_node_ctor(void *obj)
+{
+    struct rbtree_node *node;
+
+    node = obj;
+    node->key = NULL;
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = NULL;
+}
+
 /*
  * Allocate new node
  */
@@ -67,17 +82,12 @@ _node_new(void)
 {
     struct rbtree_node *node;
 
-    node = kmalloc(sizeof(struct rbtree_node));
+    /* The node is initialized by the constructor of the cache */
+    node = kmem_cache_alloc(rbtree_node_cache);
     if ( NULL == node ) {
         return NULL;
     }
 
-    /* Initialize */
-    node->key = NULL;
-    node->left = NULL;
-    node->right = NULL;
-    node->parent = NULL;
-
     return node;
 }
 
@@ -87,7 +97,9 @@ _node_new(void)
 static void
 _node_delete(struct rbtree_node *node)
 {
-    kfree(node);
+    /* Restore the constructed state */
+    rbtree_node_ctor(node);
+    kmem_cache_free(rbtree_node_cache, node);
 }
 
 /*
@@ -467,7 +479,7 @@ _delete_one_child(struct rbtree_node **ptr)
     /* Delete one of leaves */
     _node_delete(leaf);
     /* Free deleted node */
-    kfree(node);
+    _node_delete(node);
     /* Root replacement */
     if ( NULL == child->parent ) {
         *ptr = child;
@@ -52,6 +52,7 @@ struct rbtree_iterator {
     int _need_to_free:1;
 };
 
+void rbtree_node_ctor(void *);
 struct rbtree *
 rbtree_init(struct rbtree *, int (*)(const void *, const void *));
 void rbtree_release(struct rbtree *);
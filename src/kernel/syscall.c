@@ -103,7 +103,7 @@ sys_fork_c(u64 *task, u64 *ret0, u64 *ret1)
     }
 
     /* Kernel task list entry */
-    l = kmalloc(sizeof(struct ktask_list));
+    l = kmem_cache_alloc(ktask_list_cache);
     if ( NULL == l ) {
         return - 1;
     }
@@ -111,7 +111,7 @@ sys_fork_c(u64 *task, u64 *ret0, u64 *ret1)
     /* Fork a process */
     np = proc_fork(this_ktask()->proc, this_ktask(), &nt);
     if ( NULL == np ) {
-        kfree(l);
+        kmem_cache_free(ktask_list_cache, l);
         return -1;
     }
     proc_table->procs[pid] = np;
@@ -685,6 +685,112 @@ sys_lseek(int fildes, off_t offset, int whence)
     return -1;
 }
 
+/*
+ * Get or set system information
+ *
+ * SYNOPSIS
+ *      int
+ *      sys___sysctl(const int *name, unsigned int namelen, void *oldp,
+ *                   size_t *oldlenp, const void *newp, size_t newlen);
+ *
+ * DESCRIPTION
+ *      The sys___sysctl() function retrieves the system information specified
+ *      by the management information base (MIB) style name of namelen
+ *      components, and copies it to the buffer oldp of *oldlenp bytes.  If
+ *      oldp is NULL, the size of the information is returned through oldlenp.
+ *      The following names are supported; all of them are read-only.
+ *
+ *              CTL_VM.VM_PMEM: struct pmem_stat, the statistics of the physical
+ *              memory allocator.
+ *
+ *              CTL_VM.VM_KMEM: struct kmem_stat, the statistics of the size
+ *              classes of the kernel memory allocator.
+ *
+ *              CTL_VM.VM_PROC.pid: struct proc_mem_stat, the memory usage of
+ *              the process pid.
+ *
+ * RETURN VALUES
+ *      Upon successful completion, the value 0 is returned; otherwise the value
+ *      -1 is returned.
+ */
+int
+sys___sysctl(const int *name, unsigned int namelen, void *oldp,
+             size_t *oldlenp, const void *newp, size_t newlen)
+{
+    if ( NULL == name || namelen < 2 || NULL == oldlenp ) {
+        return -1;
+    }
+    if ( NULL != newp ) {
+        /* Read-only */
+        return -1;
+    }
+
+    switch ( name[0] ) {
+    case CTL_VM:
+        switch ( name[1] ) {
+        case VM_PMEM:
+            if ( NULL == oldp ) {
+                *oldlenp = sizeof(struct pmem_stat);
+                return 0;
+            }
+            if ( *oldlenp < sizeof(struct pmem_stat) ) {
+                return -1;
+            }
+            /* The kernel stack is too small for the structure, then fill the
+               buffer of the caller directly; the buffer is prepared in advance
+               since it is written with the zone locks held */
+            if ( task_prefault(this_ktask(), oldp,
+                               sizeof(struct pmem_stat)) < 0 ) {
+                return -1;
+            }
+            pmem_stat((struct pmem_stat *)oldp);
+            *oldlenp = sizeof(struct pmem_stat);
+            return 0;
+        case VM_KMEM:
+            if ( NULL == oldp ) {
+                *oldlenp = sizeof(struct kmem_stat);
+                return 0;
+            }
+            if ( *oldlenp < sizeof(struct kmem_stat) ) {
+                return -1;
+            }
+            /* Written with the slab locks held */
+            if ( task_prefault(this_ktask(), oldp,
+                               sizeof(struct kmem_stat)) < 0 ) {
+                return -1;
+            }
+            kmem_stat((struct kmem_stat *)oldp);
+            *oldlenp = sizeof(struct kmem_stat);
+            return 0;
+        case VM_PROC:
+            if ( namelen < 3 || name[2] < 0 || name[2] >= PROC_NR
+                 || NULL == proc_table->procs[name[2]] ) {
+                return -1;
+            }
+            if ( NULL == oldp ) {
+                *oldlenp = sizeof(struct proc_mem_stat);
+                return 0;
+            }
+            if ( *oldlenp < sizeof(struct proc_mem_stat) ) {
+                return -1;
+            }
+            ((struct proc_mem_stat *)oldp)->resident
+                = proc_table->procs[name[2]]->mem_resident;
+            ((struct proc_mem_stat *)oldp)->virt
+                = proc_table->procs[name[2]]->mem_virtual;
+            *oldlenp = sizeof(struct proc_mem_stat);
+            return 0;
+        default:
+            ;
+        }
+        break;
+    default:
+        ;
+    }
+
+    return -1;
+}
+
 /*
  * Architecture specific system call
  */
@@ -31,6 +31,12 @@ static void
 _vmem_buddy_spg_merge(struct vmem_region *, struct vmem_superpage *, int);
 static int _vmem_buddy_pg_split(struct vmem_region *, int);
 static void _vmem_buddy_pg_merge(struct vmem_region *, struct vmem_page *, int);
+static void
+_vmem_spg_list_insert(struct vmem_region *, struct vmem_superpage *, int);
+static void
+_vmem_spg_list_remove(struct vmem_region *, struct vmem_superpage *, int);
+static void _vmem_pg_list_insert(struct vmem_region *, struct vmem_page *, int);
+static void _vmem_pg_list_remove(struct vmem_region *, struct vmem_page *, int);
 
 static struct vmem_region * _vmem_search_region(struct vmem_space *, void *);
 
@@ -59,7 +65,7 @@ vmem_alloc_pages(struct vmem_space *space, int order)
     }
 
     /* Allocate physical pages */
-    paddr = pmem_alloc_pages(PMEM_ZONE_LOWMEM, order);
+    paddr = pmem_policy_alloc_pages(NULL, order, 0);
     if ( NULL == paddr ) {
         return NULL;
     }
@@ -242,6 +248,7 @@ vmem_region_create(void)
         spgs[i].order = 0;
         spgs[i].flags = VMEM_SUPERPAGE | VMEM_USABLE;
         spgs[i].region = reg;
+        spgs[i].owner = NULL;
         spgs[i].next = NULL;
         spgs[i].prev = NULL;
     }
@@ -427,7 +434,7 @@ _vmem_buddy_order(struct vmem_region *reg, size_t pg)
     /* Check the order for contiguous usable pages */
     for ( o = 0; o <= VMEM_MAX_BUDDY_ORDER; o++ ) {
         for ( i = pg; i < pg + (1ULL << o); i++ ) {
-            if ( !VMEM_IS_FREE(&reg->superpages[pg]) ) {
+            if ( !VMEM_IS_FREE(&reg->superpages[i]) ) {
                 /* It contains an unusable page, then return the current order
                    minus 1, immediately. */
                 return o - 1;
@@ -454,7 +461,6 @@ _vmem_buddy_spg_split(struct vmem_region *reg, int o)
     int ret;
     struct vmem_superpage *p0;
     struct vmem_superpage *p1;
-    struct vmem_superpage *next;
     size_t i;
 
     /* Check the head of the current order */
@@ -479,10 +485,9 @@ _vmem_buddy_spg_split(struct vmem_region *reg, int o)
         }
     }
 
-    /* Save next at the upper order */
-    next = reg->spgheads[o + 1]->next;
-    /* Split it into two */
+    /* Remove the head of the upper order, and split it into two */
     p0 = reg->spgheads[o + 1];
+    _vmem_spg_list_remove(reg, p0, o + 1);
     p1 = p0 + (1ULL << o);
 
     /* Set the order for all the pages in the pair */
@@ -490,16 +495,9 @@ _vmem_buddy_spg_split(struct vmem_region *reg, int o)
         p0[i].order = o;
     }
 
-    /* Insert it to the list */
-    p0->prev = NULL;
-    p0->next = p1;
-    p1->prev = p0;
-    p1->next = reg->spgheads[o];
-    reg->spgheads[o]->prev = p1;
-    reg->spgheads[o] = p0;
-    /* Remove the split one from the upper order */
-    reg->spgheads[o + 1] = next;
-    next->prev = NULL;
+    /* Insert them to the list */
+    _vmem_spg_list_insert(reg, p1, o);
+    _vmem_spg_list_insert(reg, p0, o);
 
     return 0;
 }
@@ -546,24 +544,8 @@ _vmem_buddy_spg_merge(struct vmem_region *reg, struct vmem_superpage *off,
     }
 
     /* Remove both of the pair from the list of current order */
-    if ( p0->prev == NULL ) {
-        /* Head */
-        reg->spgheads[o] = p0->next;
-        reg->spgheads[o]->prev = NULL;
-    } else {
-        /* Otherwise */
-        p0->prev->next = p0->next;
-        p0->next->prev = p0->prev;
-    }
-    if ( p1->prev == NULL ) {
-        /* Head; note that this occurs if the p0 was the head and p1 was next to
-           p0. */
-        reg->spgheads[o] = p1->next;
-        reg->spgheads[o]->prev = NULL;
-    } else {
-        p1->prev->next = p1->next;
-        p1->next->prev = p1->prev;
-    }
+    _vmem_spg_list_remove(reg, p0, o);
+    _vmem_spg_list_remove(reg, p1, o);
 
     /* Set the order for all the pages in the pair */
     for ( i = 0; i < (1ULL << (o + 1)); i++ ) {
@@ -571,10 +553,7 @@ _vmem_buddy_spg_merge(struct vmem_region *reg, struct vmem_superpage *off,
     }
 
     /* Prepend it to the upper order */
-    p0->prev = NULL;
-    p0->next = reg->spgheads[o + 1];
-    reg->spgheads[o + 1]->prev = p0;
-    reg->spgheads[o + 1] = p0;
+    _vmem_spg_list_insert(reg, p0, o + 1);
 
     /* Try to merge the upper order of buddies */
     _vmem_buddy_spg_merge(reg, p0, o + 1);
@@ -589,7 +568,6 @@ _vmem_buddy_pg_split(struct vmem_region *reg, int o)
     int ret;
     struct vmem_page *p0;
     struct vmem_page *p1;
-    struct vmem_page *next;
     size_t i;
 
     /* Check the head of the current order */
@@ -614,10 +592,9 @@ _vmem_buddy_pg_split(struct vmem_region *reg, int o)
         }
     }
 
-    /* Save next at the upper order */
-    next = reg->pgheads[o + 1]->next;
-    /* Split it into two */
+    /* Remove the head of the upper order, and split it into two */
     p0 = reg->pgheads[o + 1];
+    _vmem_pg_list_remove(reg, p0, o + 1);
     p1 = p0 + (1ULL << o);
 
     /* Set the order for all the pages in the pair */
@@ -625,18 +602,9 @@ _vmem_buddy_pg_split(struct vmem_region *reg, int o)
         p0[i].order = o;
     }
 
-    /* Insert it to the list */
-    p0->prev = NULL;
-    p0->next = p1;
-    p1->prev = p0;
-    p1->next = reg->pgheads[o];
-    if ( NULL != reg->pgheads[o] ) {
-        reg->pgheads[o]->prev = p1;
-    }
-    reg->pgheads[o] = p0;
-    /* Remove the split one from the upper order */
-    reg->pgheads[o + 1] = next;
-    next->prev = NULL;
+    /* Insert them to the list */
+    _vmem_pg_list_insert(reg, p1, o);
+    _vmem_pg_list_insert(reg, p0, o);
 
     return 0;
 }
@@ -691,24 +659,8 @@ _vmem_buddy_pg_merge(struct vmem_region *reg, struct vmem_page *off, int o)
     }
 
     /* Remove both of the pair from the list of current order */
-    if ( p0->prev == NULL ) {
-        /* Head */
-        reg->pgheads[o] = p0->next;
-        reg->pgheads[o]->prev = NULL;
-    } else {
-        /* Otherwise */
-        p0->prev->next = p0->next;
-        p0->next->prev = p0->prev;
-    }
-    if ( p1->prev == NULL ) {
-        /* Head; note that this occurs if the p0 was the head and p1 was next to
-           p0. */
-        reg->pgheads[o] = p1->next;
-        reg->pgheads[o]->prev = NULL;
-    } else {
-        p1->prev->next = p1->next;
-        p1->next->prev = p1->prev;
-    }
+    _vmem_pg_list_remove(reg, p0, o);
+    _vmem_pg_list_remove(reg, p1, o);
 
     /* Set the order for all the pages in the pair */
     for ( i = 0; i < (1ULL << (o + 1)); i++ ) {
@@ -716,17 +668,78 @@ _vmem_buddy_pg_merge(struct vmem_region *reg, struct vmem_page *off, int o)
     }
 
     /* Prepend it to the upper order */
-    p0->prev = NULL;
-    p0->next = reg->pgheads[o + 1];
-    if ( NULL != reg->pgheads[o + 1] ) {
-        reg->pgheads[o + 1]->prev = p0;
-    }
-    reg->pgheads[o + 1] = p0;
+    _vmem_pg_list_insert(reg, p0, o + 1);
 
     /* Try to merge the upper order of buddies */
     _vmem_buddy_pg_merge(reg, p0, o + 1);
 }
 
+/*
+ * Insert superpages to the head of the list of the order o
+ */
+static void
+_vmem_spg_list_insert(struct vmem_region *reg, struct vmem_superpage *spg,
+                      int o)
+{
+    spg->prev = NULL;
+    spg->next = reg->spgheads[o];
+    if ( NULL != reg->spgheads[o] ) {
+        reg->spgheads[o]->prev = spg;
+    }
+    reg->spgheads[o] = spg;
+}
+
+/*
+ * Remove superpages from the list of the order o
+ */
+static void
+_vmem_spg_list_remove(struct vmem_region *reg, struct vmem_superpage *spg,
+                      int o)
+{
+    if ( NULL == spg->prev ) {
+        reg->spgheads[o] = spg->next;
+    } else {
+        spg->prev->next = spg->next;
+    }
+    if ( NULL != spg->next ) {
+        spg->next->prev = spg->prev;
+    }
+    spg->next = NULL;
+    spg->prev = NULL;
+}
+
+/*
+ * Insert pages to the head of the list of the order o
+ */
+static void
+_vmem_pg_list_insert(struct vmem_region *reg, struct vmem_page *pg, int o)
+{
+    pg->prev = NULL;
+    pg->next = reg->pgheads[o];
+    if ( NULL != reg->pgheads[o] ) {
+        reg->pgheads[o]->prev = pg;
+    }
+    reg->pgheads[o] = pg;
+}
+
+/*
+ * Remove pages from the list of the order o
+ */
+static void
+_vmem_pg_list_remove(struct vmem_region *reg, struct vmem_page *pg, int o)
+{
+    if ( NULL == pg->prev ) {
+        reg->pgheads[o] = pg->next;
+    } else {
+        pg->prev->next = pg->next;
+    }
+    if ( NULL != pg->next ) {
+        pg->next->prev = pg->prev;
+    }
+    pg->next = NULL;
+    pg->prev = NULL;
+}
+
 
 
 
@@ -906,6 +919,7 @@ vmem_buddy_alloc_pages(struct vmem_space *space, int order)
             /* Mark the contiguous pages as "used" */
             for ( i = 0; i < (1LL << order); i++ ) {
                 vpage[i].flags |= VMEM_USED;
+                vpage[i].owner = NULL;
             }
 
             /* Return the first page of the allocated pages */
@@ -1047,6 +1061,7 @@ vmem_grab_superpages(struct vmem_space *space, int order)
             /* Mark the contiguous superpages as "used" */
             for ( i = 0; i < (1LL << order); i++ ) {
                 spg[i].flags |= VMEM_USED;
+                spg[i].owner = NULL;
             }
 
             /* Return the first superpage of the allocated memory */
@@ -1094,11 +1109,7 @@ vmem_return_superpages(struct vmem_superpage *spg)
     }
 
     /* Return the released pages to the buddy */
-    spg->prev = NULL;
-    spg->next = reg->spgheads[order];
-    if ( NULL != reg->spgheads[order] ) {
-        reg->spgheads[order]->prev = spg;
-    }
+    _vmem_spg_list_insert(reg, spg, order);
 
     /* Merge buddies if possible */
     _vmem_buddy_spg_merge(reg, spg, order);
@@ -1144,6 +1155,7 @@ vmem_grab_pages(struct vmem_space *space, int order)
             /* Mark the contiguous superpages as "used" */
             for ( i = 0; i < (1LL << order); i++ ) {
                 pg[i].flags |= VMEM_USED;
+                pg[i].owner = NULL;
             }
 
             /* Return the first superpage of the allocated memory */
@@ -1195,16 +1207,83 @@ vmem_return_pages(struct vmem_page *pg)
     }
 
     /* Return the released pages to the buddy */
-    pg->prev = NULL;
-    pg->next = reg->pgheads[order];
-    if ( NULL != reg->pgheads[order] ) {
-        reg->pgheads[order]->prev = pg;
-    }
+    _vmem_pg_list_insert(reg, pg, order);
 
     /* Merge buddies if possible */
     _vmem_buddy_pg_merge(reg, pg, order);
 }
 
+/*
+ * Find the page data structure of a virtual address
+ *
+ * SYNOPSIS
+ *      struct vmem_page *
+ *      vmem_lookup_page(struct vmem_space *space, void *vaddr);
+ *
+ * DESCRIPTION
+ *      The vmem_lookup_page() function finds the page data structure of the
+ *      page containing the virtual address vaddr in the virtual memory space
+ *      specified by the space argument.
+ *
+ * RETURN VALUES
+ *      The vmem_lookup_page() function returns a pointer to the page data
+ *      structure.  It returns NULL if the address is not in any region, or if
+ *      the address is in a superpage that is not split into pages.
+ */
+struct vmem_page *
+vmem_lookup_page(struct vmem_space *space, void *vaddr)
+{
+    struct vmem_region *reg;
+    struct vmem_superpage *spg;
+    reg_t off;
+
+    /* Get the region */
+    reg = _vmem_search_region(space, vaddr);
+    if ( NULL == reg ) {
+        return NULL;
+    }
+
+    /* Get the superpage */
+    off = (reg_t)vaddr - (reg_t)reg->start;
+    spg = &reg->superpages[SUPERPAGE_INDEX(off)];
+    if ( VMEM_IS_SUPERPAGE(spg) || NULL == spg->u.page.pages ) {
+        return NULL;
+    }
+
+    return &spg->u.page.pages[PAGE_INDEX(off) & ((1ULL << SP_SHIFT) - 1)];
+}
+
+/*
+ * Find the superpage data structure of a virtual address
+ *
+ * SYNOPSIS
+ *      struct vmem_superpage *
+ *      vmem_lookup_superpage(struct vmem_space *space, void *vaddr);
+ *
+ * DESCRIPTION
+ *      The vmem_lookup_superpage() function finds the superpage data structure
+ *      of the superpage containing the virtual address vaddr in the virtual
+ *      memory space specified by the space argument.
+ *
+ * RETURN VALUES
+ *      The vmem_lookup_superpage() function returns a pointer to the superpage
+ *      data structure.  It returns NULL if the address is not in any region.
+ */
+struct vmem_superpage *
+vmem_lookup_superpage(struct vmem_space *space, void *vaddr)
+{
+    struct vmem_region *reg;
+
+    /* Get the region */
+    reg = _vmem_search_region(space, vaddr);
+    if ( NULL == reg ) {
+        return NULL;
+    }
+
+    return &reg->superpages[SUPERPAGE_INDEX((reg_t)vaddr
+                                            - (reg_t)reg->start)];
+}
+
 /*
  * Local variables:
  * tab-width: 4
@@ -26,6 +26,7 @@
 #include <string.h>
 #include <sys/syscall.h>
 #include <sys/mman.h>
+#include <sys/sysctl.h>
 #include <unistd.h>
 
 typedef __builtin_va_list va_list;
@@ -600,6 +601,25 @@ sysarch(int number, void *args)
     return syscall(SYS_sysarch, number, args);
 }
 
+/*
+ * Get or set system information
+ *
+ * SYNOPSIS
+ *      int
+ *      sysctl(const int *name, unsigned int namelen, void *oldp,
+ *             size_t *oldlenp, const void *newp, size_t newlen);
+ *
+ * DESCRIPTION
+ *      The sysctl() function retrieves the system information specified by the
+ *      management information base (MIB) style name.
+ */
+int
+sysctl(const int *name, unsigned int namelen, void *oldp, size_t *oldlenp,
+       const void *newp, size_t newlen)
+{
+    return syscall(SYS___sysctl, name, namelen, oldp, oldlenp, newp, newlen);
+}
+
 /*
  * Local variables:
  * tab-width: 4
@@ -42,7 +42,7 @@ _syscall:
 	movq	%rcx,%rdx
 	movq	%r8,%r10
 	movq	%r9,%r8
-	movq	-8(%rsp),%r9
+	movq	8(%rsp),%r9
 	syscall
 	ret
 
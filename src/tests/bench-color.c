@@ -0,0 +1,451 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Benchmark of the placement of the slab objects built for the host (see
+ * Makefile).  It runs a thread on each processor (or the number of threads
+ * given as the argument), and measures:
+ *
+ *  - coloring: each thread reads the first objects of its own slabs of a
+ *    1792-byte cache in a random order, and the cycles per load are compared
+ *    between the colored slabs and the slabs created without coloring; and
+ *  - false sharing: each thread increments a counter in its own object of a
+ *    48-byte cache, and the time per increment is compared between the cache
+ *    aligned at the pointer size and the cache aligned at the cache line.
+ *
+ * The objects are allocated by the main thread, since the allocators are
+ * built for a single processor; the threads only access them.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Arena for the data structures and the kernel virtual memory */
+#define ARENA_SIZE              (2ULL << 30)
+
+/* The number of the simulated physical pages (512 MiB) */
+#define NR_PAGES                (1ULL << 17)
+
+/* Cache line size */
+#define CACHE_LINE              64
+
+/* Coloring: the object size, the largest number of the slabs per thread, the
+   number of the loads per measurement, and the number of the measurements
+   (the best one is taken) */
+#define COLOR_OBJ_SIZE          1792
+#define COLOR_MAX_SLABS         128
+#define COLOR_LOADS             (1 << 20)
+#define COLOR_TRIALS            7
+
+/* False sharing: the object size, and the number of the increments */
+#define SHARE_OBJ_SIZE          48
+#define SHARE_INCS              (1 << 24)
+
+/* Prototype declarations of the kernel (see Makefile) */
+void * aos_kernel_kmem_cache_create(const char *, size_t, size_t,
+                                    void (*)(void *));
+void * aos_kernel_kmem_cache_alloc(void *);
+int aos_kernel_kmem_test_init(void *, size_t, size_t);
+int aos_kernel_kmem_test_uncolor(void *);
+unsigned long long aos_kernel_rdtsc(void);
+
+/*
+ * Thread
+ */
+struct worker {
+    pthread_t th;
+    /* Coloring: the first objects of the slabs of this thread, the number of
+       the objects to read, and the best cycles per load */
+    void **heads;
+    int nheads;
+    double cycles;
+    /* False sharing: the counter of this thread */
+    volatile unsigned long long *counter;
+};
+
+static struct worker *workers;
+static int nworkers;
+static int ncpus;
+static pthread_barrier_t barrier;
+
+/* Prototype declarations of static functions */
+static int cmp_ptr(const void *, const void *);
+static void ** slab_heads(void *, int, int);
+static void * color_job(void *);
+static void * share_job(void *);
+static double run(void *(*)(void *));
+static int bench_color(void);
+static int bench_share(void);
+
+/*
+ * Panic (called by the kernel)
+ */
+void
+aos_kernel_panic(const char *s)
+{
+    fprintf(stderr, "panic: %s\n", s);
+    abort();
+}
+
+/*
+ * Compare two pointers for qsort()
+ */
+static int
+cmp_ptr(const void *a, const void *b)
+{
+    if ( *(void *const *)a < *(void *const *)b ) {
+        return -1;
+    } else if ( *(void *const *)a > *(void *const *)b ) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Allocate the objects of nslabs slabs from the cache, and return the first
+ * objects of the slabs in the order of the address.  The objects of a slab
+ * are contiguous at the object size, and the slab header or the slack is
+ * placed between the objects of different slabs.  If uncolor is set, the
+ * color is reset before each allocation.
+ */
+static void **
+slab_heads(void *cache, int nslabs, int uncolor)
+{
+    void **objs;
+    void **heads;
+    size_t nobjs;
+    size_t i;
+    int n;
+
+    nobjs = (size_t)nslabs * aos_kernel_kmem_test_uncolor(cache);
+    objs = malloc(sizeof(void *) * nobjs);
+    heads = malloc(sizeof(void *) * nslabs);
+    if ( NULL == objs || NULL == heads ) {
+        return NULL;
+    }
+    for ( i = 0; i < nobjs; i++ ) {
+        if ( uncolor ) {
+            aos_kernel_kmem_test_uncolor(cache);
+        }
+        objs[i] = aos_kernel_kmem_cache_alloc(cache);
+        if ( NULL == objs[i] ) {
+            return NULL;
+        }
+    }
+    qsort(objs, nobjs, sizeof(void *), cmp_ptr);
+
+    n = 0;
+    for ( i = 0; i < nobjs; i++ ) {
+        if ( 0 == i || objs[i] != objs[i - 1] + COLOR_OBJ_SIZE ) {
+            if ( n >= nslabs ) {
+                return NULL;
+            }
+            heads[n++] = objs[i];
+        }
+    }
+    free(objs);
+    if ( n != nslabs ) {
+        return NULL;
+    }
+
+    return heads;
+}
+
+/*
+ * Read the first objects of the slabs of a thread in a loop
+ */
+static void *
+color_job(void *arg)
+{
+    struct worker *w;
+    void **p;
+    unsigned long long t0;
+    unsigned long long t1;
+    unsigned long long x;
+    double cycles;
+    int *order;
+    int i;
+    int j;
+    int k;
+
+    w = arg;
+
+    /* Chain the objects in a random order, so that the loads are not
+       followed by the prefetchers */
+    order = malloc(sizeof(int) * w->nheads);
+    if ( NULL == order ) {
+        return NULL;
+    }
+    for ( i = 0; i < w->nheads; i++ ) {
+        order[i] = i;
+    }
+    x = 88172645463325252ULL;
+    for ( i = w->nheads - 1; i > 0; i-- ) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        j = x % (i + 1);
+        k = order[i];
+        order[i] = order[j];
+        order[j] = k;
+    }
+    for ( i = 0; i < w->nheads; i++ ) {
+        *(void **)w->heads[order[i]] = w->heads[order[(i + 1) % w->nheads]];
+    }
+    free(order);
+
+    w->cycles = 0;
+    for ( i = 0; i < COLOR_TRIALS; i++ ) {
+        pthread_barrier_wait(&barrier);
+        p = w->heads[0];
+        t0 = aos_kernel_rdtsc();
+        for ( j = 0; j < COLOR_LOADS; j++ ) {
+            p = *p;
+        }
+        t1 = aos_kernel_rdtsc();
+        __asm__ __volatile__ ("" : : "r"(p));
+        cycles = (double)(t1 - t0) / COLOR_LOADS;
+        if ( 0 == i || cycles < w->cycles ) {
+            w->cycles = cycles;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Increment the counter of a thread
+ */
+static void *
+share_job(void *arg)
+{
+    struct worker *w;
+    int i;
+
+    w = arg;
+    pthread_barrier_wait(&barrier);
+    for ( i = 0; i < SHARE_INCS; i++ ) {
+        (*w->counter)++;
+    }
+
+    return NULL;
+}
+
+/*
+ * Run the job on the threads bound to the processors in turn, and return the
+ * elapsed time in seconds
+ */
+static double
+run(void *(*f)(void *))
+{
+    struct timespec ts0;
+    struct timespec ts1;
+    cpu_set_t set;
+    int i;
+
+    pthread_barrier_init(&barrier, NULL, nworkers);
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    for ( i = 0; i < nworkers; i++ ) {
+        pthread_create(&workers[i].th, NULL, f, &workers[i]);
+        CPU_ZERO(&set);
+        CPU_SET(i % ncpus, &set);
+        pthread_setaffinity_np(workers[i].th, sizeof(set), &set);
+    }
+    for ( i = 0; i < nworkers; i++ ) {
+        pthread_join(workers[i].th, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    pthread_barrier_destroy(&barrier);
+
+    return (ts1.tv_sec - ts0.tv_sec) + (ts1.tv_nsec - ts0.tv_nsec) / 1e9;
+}
+
+/*
+ * Compare the colored and the uncolored slabs
+ */
+static int
+bench_color(void)
+{
+    static const int nslabs[] = { 8, 16, 32, 64, 128 };
+    void *caches[2];
+    void **heads[2];
+    double cycles[2];
+    int i;
+    int j;
+    int k;
+
+    caches[0] = aos_kernel_kmem_cache_create("uncolored", COLOR_OBJ_SIZE,
+                                             CACHE_LINE, NULL);
+    caches[1] = aos_kernel_kmem_cache_create("colored", COLOR_OBJ_SIZE,
+                                             CACHE_LINE, NULL);
+    if ( NULL == caches[0] || NULL == caches[1] ) {
+        return -1;
+    }
+    for ( k = 0; k < 2; k++ ) {
+        heads[k] = slab_heads(caches[k], COLOR_MAX_SLABS * nworkers, !k);
+        if ( NULL == heads[k] ) {
+            return -1;
+        }
+    }
+
+    printf("coloring: first objects of the slabs of a %d-byte cache, "
+           "cycles per load\n", COLOR_OBJ_SIZE);
+    printf("%16s %10s %10s\n", "slabs/thread", "uncolored", "colored");
+    for ( i = 0; i < (int)(sizeof(nslabs) / sizeof(nslabs[0])); i++ ) {
+        for ( k = 0; k < 2; k++ ) {
+            for ( j = 0; j < nworkers; j++ ) {
+                workers[j].heads = heads[k] + j * COLOR_MAX_SLABS;
+                workers[j].nheads = nslabs[i];
+            }
+            run(color_job);
+            cycles[k] = 0;
+            for ( j = 0; j < nworkers; j++ ) {
+                cycles[k] += workers[j].cycles / nworkers;
+            }
+        }
+        printf("%16d %10.2f %10.2f\n", nslabs[i], cycles[0], cycles[1]);
+    }
+
+    free(heads[0]);
+    free(heads[1]);
+
+    return 0;
+}
+
+/*
+ * Compare the caches aligned at the pointer size and at the cache line
+ */
+static int
+bench_share(void)
+{
+    static const char *names[] = { "8", "64" };
+    static const size_t aligns[] = { 8, CACHE_LINE };
+    void *cache;
+    void *obj;
+    double sec;
+    int shared;
+    int i;
+    int j;
+    int k;
+
+    printf("false sharing: a %d-byte object per thread, ns per increment\n",
+           SHARE_OBJ_SIZE);
+    printf("%16s %10s %10s\n", "align", "ns/inc", "shared");
+    for ( k = 0; k < 2; k++ ) {
+        cache = aos_kernel_kmem_cache_create("share", SHARE_OBJ_SIZE,
+                                             aligns[k], NULL);
+        if ( NULL == cache ) {
+            return -1;
+        }
+        for ( i = 0; i < nworkers; i++ ) {
+            obj = aos_kernel_kmem_cache_alloc(cache);
+            if ( NULL == obj ) {
+                return -1;
+            }
+            memset(obj, 0, SHARE_OBJ_SIZE);
+            workers[i].counter = obj;
+        }
+        /* The number of the counters sharing a cache line with another */
+        shared = 0;
+        for ( i = 0; i < nworkers; i++ ) {
+            for ( j = 0; j < nworkers; j++ ) {
+                if ( i != j && (unsigned long)workers[i].counter / CACHE_LINE
+                     == (unsigned long)workers[j].counter / CACHE_LINE ) {
+                    shared++;
+                    break;
+                }
+            }
+        }
+        sec = run(share_job);
+        printf("%16s %10.2f %10d\n", names[k], sec * 1e9 / SHARE_INCS, shared);
+    }
+
+    return 0;
+}
+
+/*
+ * Main routine
+ */
+int
+main(int argc, const char *const argv[])
+{
+    void *arena;
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if ( ncpus < 1 ) {
+        ncpus = 1;
+    }
+    nworkers = argc > 1 ? atoi(argv[1]) : ncpus;
+    if ( nworkers < 1 ) {
+        fprintf(stderr, "Invalid number of threads: %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    workers = calloc(nworkers, sizeof(struct worker));
+    if ( NULL == workers ) {
+        return EXIT_FAILURE;
+    }
+
+    /* Reserve the arena without backing it */
+    arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ( MAP_FAILED == arena ) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    if ( aos_kernel_kmem_test_init(arena, ARENA_SIZE, NR_PAGES) < 0 ) {
+        fprintf(stderr, "Failed to initialize the kernel memory\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%d thread(s) on %d processor(s)\n", nworkers, ncpus);
+    if ( bench_color() < 0 ) {
+        fprintf(stderr, "Failed to run the coloring benchmark\n");
+        return EXIT_FAILURE;
+    }
+    if ( bench_share() < 0 ) {
+        fprintf(stderr, "Failed to run the false sharing benchmark\n");
+        return EXIT_FAILURE;
+    }
+
+    munmap(arena, ARENA_SIZE);
+    free(workers);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
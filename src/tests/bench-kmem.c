@@ -0,0 +1,582 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Benchmark of the kernel memory allocators (pmem, vmem, kmem, and the slab
+ * allocator) built for the host.  It replays allocation traces and reports
+ * the throughput, the internal fragmentation of the slabs (frag, in
+ * thousandths), and the peak footprint.  The built-in traces are generated
+ * with a fixed seed, and a trace can be given as a file of the lines
+ * "a <slot> <size>" (kmalloc) and "f <slot>" (kfree).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/* Arena for the data structures and the kernel virtual memory */
+#define ARENA_SIZE              (2ULL << 30)
+
+/* The number of the simulated physical pages (512 MiB) */
+#define NR_PAGES                (1ULL << 17)
+
+/* The idle loop is emulated every this number of operations */
+#define IDLE_INTERVAL           4096
+
+/* Operations */
+#define OP_ALLOC                0
+#define OP_FREE                 1
+
+/* Object caches replayed by the fork storm (-1 for kmalloc) */
+#define CACHE_KMALLOC           -1
+#define CACHE_PROC              0
+#define CACHE_KTASK             1
+#define NR_CACHES               2
+
+/* Prototype declarations of the kernel (see Makefile) */
+void * aos_kernel_kmalloc(size_t);
+void aos_kernel_kfree(void *);
+void * aos_kernel_kmem_cache_create(const char *, size_t, size_t,
+                                    void (*)(void *));
+void * aos_kernel_kmem_cache_alloc(void *);
+void aos_kernel_kmem_cache_free(void *, void *);
+int aos_kernel_kmem_shrink(void);
+int aos_kernel_pmem_shrink_background(void);
+int aos_kernel_kmem_test_init(void *, size_t, size_t);
+void aos_kernel_kmem_test_usage(size_t *, size_t *);
+int aos_kernel_kmem_test_frag(void);
+extern size_t aos_kernel_kmem_test_proc_size;
+extern size_t aos_kernel_kmem_test_ktask_size;
+
+/*
+ * An operation of a trace
+ */
+struct op {
+    int type;
+    int cache;
+    size_t slot;
+    size_t size;
+};
+
+/*
+ * Trace
+ */
+struct trace {
+    const char *name;
+    struct op *ops;
+    size_t n;
+    size_t max;
+    size_t nslots;
+};
+
+/*
+ * Object replayed in a slot
+ */
+struct slot {
+    void *ptr;
+    size_t size;
+    int cache;
+};
+
+/*
+ * Result of a replay
+ */
+struct result {
+    double elapsed;
+    size_t live;
+    size_t peak;
+    int frag;
+    size_t retained;
+};
+
+static void *caches[NR_CACHES];
+static unsigned long long rng = 88172645463325252ULL;
+
+/*
+ * Panic (called by the kernel)
+ */
+void
+aos_kernel_panic(const char *s)
+{
+    fprintf(stderr, "panic: %s\n", s);
+    abort();
+}
+
+/*
+ * Xorshift pseudo-random number generator
+ */
+static unsigned long long
+xrand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    return rng;
+}
+
+/*
+ * Log-uniform random size from a to b (exclusive)
+ */
+static size_t
+xrand_size(size_t a, size_t b)
+{
+    int o;
+    size_t s;
+
+    do {
+        o = 0;
+        while ( (a << (o + 1)) < b ) {
+            o++;
+        }
+        o = xrand() % (o + 1);
+        s = (a << o) + xrand() % (a << o);
+    } while ( s >= b );
+
+    return s;
+}
+
+/*
+ * Append an operation to the trace
+ */
+static void
+trace_push(struct trace *t, int type, int cache, size_t slot, size_t size)
+{
+    if ( t->n >= t->max ) {
+        t->max = t->max ? t->max * 2 : 4096;
+        t->ops = realloc(t->ops, sizeof(struct op) * t->max);
+        if ( NULL == t->ops ) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t->ops[t->n].type = type;
+    t->ops[t->n].cache = cache;
+    t->ops[t->n].slot = slot;
+    t->ops[t->n].size = size;
+    t->n++;
+    if ( slot + 1 > t->nslots ) {
+        t->nslots = slot + 1;
+    }
+}
+
+/*
+ * Shuffle the slots
+ */
+static void
+shuffle(size_t *a, size_t n)
+{
+    size_t i;
+    size_t j;
+    size_t tmp;
+
+    for ( i = n - 1; i > 0; i-- ) {
+        j = xrand() % (i + 1);
+        tmp = a[i];
+        a[i] = a[j];
+        a[j] = tmp;
+    }
+}
+
+/*
+ * Fork storm: bursts of processes are forked and exit in a random order, and
+ * one in 16 processes survives until the end.  A process consists of the
+ * process and task structures from the object caches, the kernel stack, the
+ * virtual memory space, and the file descriptors.
+ */
+static void
+gen_fork_storm(struct trace *t, int nrounds, int nprocs)
+{
+    static const size_t sizes[] = { 4096, 32, 256, 1536, 64, 64, 64 };
+    size_t nobjs;
+    size_t *procs;
+    size_t *survivors;
+    size_t nsurvivors;
+    size_t base;
+    size_t p;
+    size_t k;
+    int r;
+    int i;
+
+    nobjs = 2 + sizeof(sizes) / sizeof(sizes[0]);
+    procs = malloc(sizeof(size_t) * nprocs);
+    survivors = malloc(sizeof(size_t) * nrounds * nprocs);
+    if ( NULL == procs || NULL == survivors ) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    nsurvivors = 0;
+    base = 0;
+    for ( r = 0; r < nrounds; r++ ) {
+        /* Fork */
+        for ( i = 0; i < nprocs; i++ ) {
+            p = base + i * nobjs;
+            procs[i] = p;
+            trace_push(t, OP_ALLOC, CACHE_PROC, p,
+                       aos_kernel_kmem_test_proc_size);
+            trace_push(t, OP_ALLOC, CACHE_KTASK, p + 1,
+                       aos_kernel_kmem_test_ktask_size);
+            for ( k = 0; k < nobjs - 2; k++ ) {
+                trace_push(t, OP_ALLOC, CACHE_KMALLOC, p + 2 + k, sizes[k]);
+            }
+        }
+        base += nprocs * nobjs;
+
+        /* Exit */
+        shuffle(procs, nprocs);
+        for ( i = 0; i < nprocs; i++ ) {
+            if ( 0 == xrand() % 16 ) {
+                survivors[nsurvivors++] = procs[i];
+                continue;
+            }
+            for ( k = 0; k < nobjs; k++ ) {
+                trace_push(t, OP_FREE, 0, procs[i] + k, 0);
+            }
+        }
+    }
+
+    /* The survivors exit */
+    for ( p = 0; p < nsurvivors; p++ ) {
+        for ( k = 0; k < nobjs; k++ ) {
+            trace_push(t, OP_FREE, 0, survivors[p] + k, 0);
+        }
+    }
+
+    free(procs);
+    free(survivors);
+}
+
+/*
+ * Slab churn: small objects in a working set are replaced at random, and the
+ * working set shrinks to 1/16 and grows back at every phase
+ */
+static void
+gen_slab_churn(struct trace *t, size_t nslots, int nphases, size_t nops)
+{
+    static const size_t sizes[] = { 32, 48, 64, 96, 128, 192, 256, 512 };
+    char *live;
+    size_t s;
+    size_t i;
+    int ph;
+
+    live = calloc(nslots, 1);
+    if ( NULL == live ) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for ( ph = 0; ph < nphases; ph++ ) {
+        /* Grow */
+        for ( s = 0; s < nslots; s++ ) {
+            if ( !live[s] ) {
+                trace_push(t, OP_ALLOC, CACHE_KMALLOC, s,
+                           sizes[xrand() % (sizeof(sizes) / sizeof(sizes[0]))]);
+                live[s] = 1;
+            }
+        }
+        /* Churn */
+        for ( i = 0; i < nops; i++ ) {
+            s = xrand() % nslots;
+            trace_push(t, OP_FREE, 0, s, 0);
+            trace_push(t, OP_ALLOC, CACHE_KMALLOC, s,
+                       sizes[xrand() % (sizeof(sizes) / sizeof(sizes[0]))]);
+        }
+        /* Shrink */
+        for ( s = 0; s < nslots; s++ ) {
+            if ( 0 != xrand() % 16 ) {
+                trace_push(t, OP_FREE, 0, s, 0);
+                live[s] = 0;
+            }
+        }
+    }
+    for ( s = 0; s < nslots; s++ ) {
+        if ( live[s] ) {
+            trace_push(t, OP_FREE, 0, s, 0);
+        }
+    }
+
+    free(live);
+}
+
+/*
+ * Mixed sizes: objects of 60% small (16 B-1 KiB), 30% medium (1-64 KiB), 9%
+ * large (64 KiB-1 MiB), and 1% huge (1-4 MiB) sizes are replaced at random
+ */
+static void
+gen_mixed(struct trace *t, size_t nslots, size_t nops)
+{
+    size_t s;
+    size_t i;
+    size_t size;
+    int r;
+
+    for ( i = 0; i < nslots + nops; i++ ) {
+        r = xrand() % 100;
+        if ( r < 60 ) {
+            size = xrand_size(16, 1024);
+        } else if ( r < 90 ) {
+            size = xrand_size(1024, 65536);
+        } else if ( r < 99 ) {
+            size = xrand_size(65536, 1 << 20);
+        } else {
+            size = xrand_size(1 << 20, 4 << 20);
+        }
+        if ( i < nslots ) {
+            s = i;
+        } else {
+            s = xrand() % nslots;
+            trace_push(t, OP_FREE, 0, s, 0);
+        }
+        trace_push(t, OP_ALLOC, CACHE_KMALLOC, s, size);
+    }
+    for ( s = 0; s < nslots; s++ ) {
+        trace_push(t, OP_FREE, 0, s, 0);
+    }
+}
+
+/*
+ * Load a trace from a file
+ */
+static int
+load_trace(struct trace *t, const char *fname)
+{
+    FILE *fp;
+    char type;
+    size_t slot;
+    size_t size;
+    int ret;
+
+    fp = fopen(fname, "r");
+    if ( NULL == fp ) {
+        return -1;
+    }
+    for ( ;; ) {
+        ret = fscanf(fp, " %c %zu", &type, &slot);
+        if ( 2 != ret ) {
+            break;
+        }
+        if ( 'a' == type ) {
+            if ( 1 != fscanf(fp, "%zu", &size) ) {
+                break;
+            }
+            trace_push(t, OP_ALLOC, CACHE_KMALLOC, slot, size);
+        } else if ( 'f' == type ) {
+            trace_push(t, OP_FREE, 0, slot, 0);
+        } else {
+            break;
+        }
+    }
+    ret = feof(fp) ? 0 : -1;
+    fclose(fp);
+
+    return ret;
+}
+
+/*
+ * Replay a trace on the kernel memory allocators initialized on the arena
+ */
+static int
+replay(struct trace *t, void *arena, struct result *res)
+{
+    struct slot *slots;
+    struct op *op;
+    struct timespec ts0;
+    struct timespec ts1;
+    size_t live;
+    size_t cur;
+    size_t i;
+
+    slots = calloc(t->nslots, sizeof(struct slot));
+    if ( NULL == slots ) {
+        return -1;
+    }
+
+    /* Initialize the allocators on the zero-filled arena; the contents left
+       by the previous trace, e.g., the tags of the objects in the magazines,
+       must not be seen by this one */
+    madvise(arena, ARENA_SIZE, MADV_DONTNEED);
+    if ( aos_kernel_kmem_test_init(arena, ARENA_SIZE, NR_PAGES) < 0 ) {
+        fprintf(stderr, "Failed to initialize the kernel memory\n");
+        return -1;
+    }
+    caches[CACHE_PROC] = aos_kernel_kmem_cache_create(
+        "proc", aos_kernel_kmem_test_proc_size, 0, NULL);
+    caches[CACHE_KTASK] = aos_kernel_kmem_cache_create(
+        "ktask", aos_kernel_kmem_test_ktask_size, 64, NULL);
+    if ( NULL == caches[CACHE_PROC] || NULL == caches[CACHE_KTASK] ) {
+        return -1;
+    }
+    aos_kernel_kmem_test_usage(&cur, &res->peak);
+
+    /* Replay */
+    live = 0;
+    res->live = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    for ( i = 0; i < t->n; i++ ) {
+        op = &t->ops[i];
+        if ( OP_ALLOC == op->type ) {
+            if ( NULL != slots[op->slot].ptr ) {
+                fprintf(stderr, "Slot %zu is in use at %zu\n", op->slot, i);
+                return -1;
+            }
+            if ( CACHE_KMALLOC == op->cache ) {
+                slots[op->slot].ptr = aos_kernel_kmalloc(op->size);
+            } else {
+                slots[op->slot].ptr
+                    = aos_kernel_kmem_cache_alloc(caches[op->cache]);
+            }
+            if ( NULL == slots[op->slot].ptr ) {
+                fprintf(stderr, "Out of memory at %zu (%zu bytes)\n", i,
+                        op->size);
+                return -1;
+            }
+            slots[op->slot].size = op->size;
+            slots[op->slot].cache = op->cache;
+            live += op->size;
+            if ( live > res->live ) {
+                res->live = live;
+            }
+        } else {
+            if ( NULL == slots[op->slot].ptr ) {
+                continue;
+            }
+            if ( CACHE_KMALLOC == slots[op->slot].cache ) {
+                aos_kernel_kfree(slots[op->slot].ptr);
+            } else {
+                aos_kernel_kmem_cache_free(caches[slots[op->slot].cache],
+                                           slots[op->slot].ptr);
+            }
+            slots[op->slot].ptr = NULL;
+            live -= slots[op->slot].size;
+        }
+        if ( 0 == (i + 1) % IDLE_INTERVAL ) {
+            aos_kernel_pmem_shrink_background();
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    res->elapsed = (ts1.tv_sec - ts0.tv_sec)
+        + (ts1.tv_nsec - ts0.tv_nsec) / 1e9;
+    res->frag = aos_kernel_kmem_test_frag();
+    aos_kernel_kmem_test_usage(&cur, &res->peak);
+
+    /* Release the objects left, and the memory cached by the allocators */
+    for ( i = 0; i < t->nslots; i++ ) {
+        if ( NULL == slots[i].ptr ) {
+            continue;
+        }
+        if ( CACHE_KMALLOC == slots[i].cache ) {
+            aos_kernel_kfree(slots[i].ptr);
+        } else {
+            aos_kernel_kmem_cache_free(caches[slots[i].cache], slots[i].ptr);
+        }
+    }
+    aos_kernel_kmem_shrink();
+    aos_kernel_kmem_test_usage(&res->retained, &cur);
+
+    free(slots);
+
+    return 0;
+}
+
+/*
+ * Report the result of a replay
+ */
+static void
+report(struct trace *t, struct result *res)
+{
+    printf("%-12s %10zu %10.3f %10zu %10zu %8.1f%% %6d %10zu\n", t->name, t->n,
+           t->n / res->elapsed / 1e6, res->peak >> 10, res->live >> 10,
+           res->peak ? 100.0 * (1.0 - (double)res->live / res->peak) : 0.0,
+           res->frag, res->retained >> 10);
+}
+
+/*
+ * Main routine
+ */
+int
+main(int argc, const char *const argv[])
+{
+    struct trace traces[4];
+    struct result res;
+    void *arena;
+    int n;
+    int i;
+
+    /* Reserve the arena without backing it */
+    arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ( MAP_FAILED == arena ) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    /* Traces */
+    memset(traces, 0, sizeof(traces));
+    n = 0;
+    if ( argc > 1 ) {
+        traces[n].name = argv[1];
+        if ( load_trace(&traces[n], argv[1]) < 0 ) {
+            fprintf(stderr, "Failed to load the trace: %s\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        n++;
+    } else {
+        traces[n].name = "fork-storm";
+        gen_fork_storm(&traces[n], 64, 512);
+        n++;
+        traces[n].name = "slab-churn";
+        gen_slab_churn(&traces[n], 65536, 8, 262144);
+        n++;
+        traces[n].name = "mixed-sizes";
+        gen_mixed(&traces[n], 2048, 262144);
+        n++;
+    }
+
+    printf("%-12s %10s %10s %10s %10s %9s %6s %10s\n", "trace", "ops",
+           "Mops/s", "peak(KiB)", "live(KiB)", "overhead", "frag", "kept(KiB)");
+    for ( i = 0; i < n; i++ ) {
+        if ( replay(&traces[i], arena, &res) < 0 ) {
+            fprintf(stderr, "Failed to replay the trace: %s\n",
+                    traces[i].name);
+            return EXIT_FAILURE;
+        }
+        report(&traces[i], &res);
+        free(traces[i].ops);
+    }
+
+    munmap(arena, ARENA_SIZE);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,606 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Architecture-dependent functions for the kernel memory allocators built for
+ * the host (see Makefile).  This file is compiled in the same way as the
+ * kernel, and its symbols are prefixed with aos_kernel together with the
+ * allocators.  The kernel memory is placed on an arena given by the host, and
+ * the physical pages are simulated with the page indices only; the physical
+ * addresses are never dereferenced.
+ */
+
+#include <aos/const.h>
+#include "../kernel/kernel.h"
+
+/* The number of superpages of the kernel region created at the
+   initialization; the rest of the arena is left to the regions added on
+   demand */
+#define KMEM_TEST_INIT_SPGS     64
+
+/* The first superpage of the simulated physical pages is not usable so that
+   the physical address 0 is never returned */
+#define KMEM_TEST_LBOUND        (1ULL << SP_SHIFT)
+
+/* The physical address mapped to a superpage is tagged with this bit in the
+   mapping table */
+#define KMEM_TEST_SUPERPAGE     1
+
+extern struct kmem *g_kmem;
+
+/* Object sizes replayed by the fork storm */
+size_t kmem_test_proc_size = sizeof(struct proc);
+size_t kmem_test_ktask_size = sizeof(struct ktask);
+
+/* Kernel memory on the arena: the virtual address window and the physical
+   addresses mapped to its pages */
+static struct {
+    void *base;
+    size_t npg;
+    u64 *v2p;
+    /* The number of the mapped pages (footprint), and its peak */
+    size_t mapped;
+    size_t peak;
+} _kmem_test;
+
+/* Prototype declarations of static functions */
+static int _kmem_test_v2p(void *, size_t *);
+static int _kmem_test_map(void *, void *, void **, size_t);
+static void * _kmem_test_carve(void **, void *, size_t);
+static void
+_kmem_test_slab_usage(struct kmem_slab_free_list *, size_t *, size_t *);
+
+/*
+ * Initialize the kernel memory allocators on the arena
+ *
+ * SYNOPSIS
+ *      int
+ *      kmem_test_init(void *arena, size_t size, size_t npg);
+ *
+ * DESCRIPTION
+ *      The kmem_test_init() function constructs the physical memory manager of
+ *      npg simulated pages and the kernel memory on the memory space of size
+ *      bytes pointed by arena, in the same way as arch_memory_init() and
+ *      kmem_init().  The data structures are placed at the head of the arena,
+ *      and the rest aligned to the superpage is used as the kernel virtual
+ *      memory.  The first KMEM_TEST_INIT_SPGS superpages of it form the
+ *      kernel region, and the rest is reserved for the regions added on
+ *      demand.
+ *
+ * RETURN VALUES
+ *      If successful, the kmem_test_init() function returns the value of 0.
+ *      It returns the value of -1 on failure.
+ */
+int
+kmem_test_init(void *arena, size_t size, size_t npg)
+{
+    void *cur;
+    void *end;
+    struct pmem *pmem;
+    struct kmem *kmem;
+    struct vmem_space *space;
+    struct vmem_region *reg;
+    struct vmem_superpage *spgs;
+    void *data;
+    size_t i;
+    int o;
+
+    cur = arena;
+    end = arena + size;
+
+    /* Physical memory manager */
+    pmem = _kmem_test_carve(&cur, end, sizeof(struct pmem));
+    if ( NULL == pmem ) {
+        return -1;
+    }
+    pmem->nr = npg;
+    pmem->pages = _kmem_test_carve(&cur, end, npg * sizeof(struct pmem_page));
+    pmem->rmaps = _kmem_test_carve(&cur, end, npg * sizeof(struct pmem_rmap));
+    data = _kmem_test_carve(&cur, end, pmem_buddy_size(npg));
+    if ( NULL == pmem->pages || NULL == pmem->rmaps || NULL == data ) {
+        return -1;
+    }
+    pmem_buddy_init(pmem, data);
+
+    /* Kernel memory and its virtual memory space of a single region */
+    kmem = _kmem_test_carve(&cur, end, sizeof(struct kmem));
+    space = _kmem_test_carve(&cur, end, sizeof(struct vmem_space));
+    reg = _kmem_test_carve(&cur, end, sizeof(struct vmem_region));
+    spgs = _kmem_test_carve(&cur, end, sizeof(struct vmem_superpage)
+                            * KMEM_TEST_INIT_SPGS);
+    if ( NULL == kmem || NULL == space || NULL == reg || NULL == spgs ) {
+        return -1;
+    }
+
+    /* The mapping table covering the arena, and the virtual address window
+       following it */
+    _kmem_test.v2p = _kmem_test_carve(&cur, end,
+                                      PAGE_INDEX(size) * sizeof(u64));
+    if ( NULL == _kmem_test.v2p ) {
+        return -1;
+    }
+    _kmem_test.base = (void *)CEIL((reg_t)cur, SUPERPAGESIZE);
+    if ( _kmem_test.base + SUPERPAGE_ADDR(KMEM_TEST_INIT_SPGS) > end ) {
+        return -1;
+    }
+    _kmem_test.npg = SUPERPAGE_INDEX(end - _kmem_test.base) << SP_SHIFT;
+    _kmem_test.mapped = 0;
+    _kmem_test.peak = 0;
+
+    /* Initialize the region */
+    reg->start = _kmem_test.base;
+    reg->len = SUPERPAGE_ADDR(KMEM_TEST_INIT_SPGS);
+    reg->superpages = spgs;
+    reg->next = NULL;
+    for ( i = 0; i < KMEM_TEST_INIT_SPGS; i++ ) {
+        spgs[i].u.superpage.addr = 0;
+        spgs[i].order = VMEM_INVAL_BUDDY_ORDER;
+        spgs[i].flags = VMEM_USABLE | VMEM_GLOBAL | VMEM_SUPERPAGE;
+        spgs[i].region = reg;
+        spgs[i].owner = NULL;
+        spgs[i].next = NULL;
+        spgs[i].prev = NULL;
+    }
+    vmem_buddy_init(reg);
+    space->first_region = reg;
+    kmem->space = space;
+    kmem->pmem = pmem;
+    g_kmem = kmem;
+
+    /* Initialize the pages, and add the usable ones to the buddy system of the
+       LOWMEM zone */
+    for ( i = 0; i < npg; i++ ) {
+        pmem->pages[i].zone = PMEM_ZONE_LOWMEM;
+        pmem->pages[i].flags = PMEM_USABLE;
+        pmem->pages[i].order = PMEM_INVAL_BUDDY_ORDER;
+        if ( i < KMEM_TEST_LBOUND ) {
+            pmem->pages[i].flags |= PMEM_USED;
+        }
+    }
+    for ( i = KMEM_TEST_LBOUND; i < npg; i += (1ULL << o) ) {
+        for ( o = 0; o < PMEM_MAX_BUDDY_ORDER; o++ ) {
+            if ( 0 != (i & (1ULL << o)) || i + (2ULL << o) > npg ) {
+                break;
+            }
+        }
+        pmem_buddy_add(pmem, i, o);
+    }
+
+    /* Create the object caches */
+    return kmem_init();
+}
+
+/*
+ * Get the footprint of the kernel memory
+ *
+ * SYNOPSIS
+ *      void
+ *      kmem_test_usage(size_t *cur, size_t *peak);
+ *
+ * DESCRIPTION
+ *      The kmem_test_usage() function stores the number of bytes of the pages
+ *      mapped to the kernel memory to cur, and its peak since the last call
+ *      to peak.  The peak is reset to the current footprint.
+ *
+ * RETURN VALUES
+ *      The kmem_test_usage() function does not return a value.
+ */
+void
+kmem_test_usage(size_t *cur, size_t *peak)
+{
+    *cur = PAGE_ADDR(_kmem_test.mapped);
+    *peak = PAGE_ADDR(_kmem_test.peak);
+    _kmem_test.peak = _kmem_test.mapped;
+}
+
+/*
+ * Get the internal fragmentation of the slabs
+ *
+ * SYNOPSIS
+ *      int
+ *      kmem_test_frag(void);
+ *
+ * DESCRIPTION
+ *      The kmem_test_frag() function calculates the share of the pages of the
+ *      slabs (the generic slabs, the segregated fit, and the object caches)
+ *      that are not taken by the objects allocated from the slabs, i.e., the
+ *      free objects, the slab headers, and the slack.  The objects cached in
+ *      the magazines are counted as allocated.
+ *
+ * RETURN VALUES
+ *      The kmem_test_frag() function returns the internal fragmentation in
+ *      thousandths, or 0 if no slab exists.
+ */
+int
+kmem_test_frag(void)
+{
+    struct kmem_cache *cache;
+    size_t total;
+    size_t used;
+    int o;
+
+    total = 0;
+    used = 0;
+    for ( o = 0; o < KMEM_SLAB_ORDER; o++ ) {
+        _kmem_test_slab_usage(&g_kmem->slab.gslabs[o], &total, &used);
+    }
+    for ( cache = g_kmem->slab.caches; NULL != cache; cache = cache->next ) {
+        _kmem_test_slab_usage(&cache->slabs, &total, &used);
+    }
+    if ( 0 == total ) {
+        return 0;
+    }
+
+    return (total - used) * 1000 / total;
+}
+
+/*
+ * Reset the color of an object cache
+ *
+ * SYNOPSIS
+ *      int
+ *      kmem_test_uncolor(struct kmem_cache *cache);
+ *
+ * DESCRIPTION
+ *      The kmem_test_uncolor() function resets the color of the next slab of
+ *      the cache, so that the objects of the slabs created by the allocations
+ *      following each call are placed without coloring.
+ *
+ * RETURN VALUES
+ *      The kmem_test_uncolor() function returns the number of objects in a
+ *      slab of the cache.
+ */
+int
+kmem_test_uncolor(struct kmem_cache *cache)
+{
+    cache->color = 0;
+
+    return cache->nr;
+}
+
+/*
+ * Map contiguous physical pages to a virtual range of the kernel memory
+ */
+int
+arch_vmem_map_range(struct vmem_space *space, void *vaddr, void *paddr,
+                    size_t npg, int flags)
+{
+    return _kmem_test_map(vaddr, paddr, NULL, npg);
+}
+
+/*
+ * Map an array of physical pages to a virtual range of the kernel memory
+ */
+int
+arch_vmem_map_frames(struct vmem_space *space, void *vaddr, void **frames,
+                     size_t npg, int flags)
+{
+    return _kmem_test_map(vaddr, NULL, frames, npg);
+}
+
+/*
+ * Unmap a virtual range of the kernel memory
+ */
+int
+arch_vmem_unmap_range(struct vmem_space *space, void *vaddr, size_t npg)
+{
+    size_t idx;
+    size_t i;
+    int ret;
+
+    if ( _kmem_test_v2p(vaddr, &idx) < 0
+         || idx + npg > _kmem_test.npg ) {
+        return -1;
+    }
+    ret = 0;
+    for ( i = 0; i < npg; i++ ) {
+        if ( 0 == _kmem_test.v2p[idx + i] ) {
+            ret = -1;
+            continue;
+        }
+        /* A partially unmapped superpage is split into pages as the kernel
+           does, and the rest is kept mapped */
+        _kmem_test.v2p[idx + i] = 0;
+        _kmem_test.mapped--;
+    }
+
+    return ret;
+}
+
+/*
+ * Resolve the physical address mapped to a virtual address
+ */
+void *
+arch_vmem_addr_v2p(struct vmem_space *space, void *vaddr)
+{
+    size_t idx;
+
+    if ( _kmem_test_v2p(vaddr, &idx) < 0 || 0 == _kmem_test.v2p[idx] ) {
+        return NULL;
+    }
+
+    return (void *)((_kmem_test.v2p[idx] & ~(PAGESIZE - 1))
+                    + ((reg_t)vaddr & (PAGESIZE - 1)));
+}
+
+/*
+ * The upper bound of the kernel virtual memory
+ */
+void *
+arch_kmem_vaddr_max(void)
+{
+    return _kmem_test.base + PAGE_ADDR(_kmem_test.npg);
+}
+
+/*
+ * The width of the virtual address
+ */
+int
+arch_address_width(void)
+{
+    return 48;
+}
+
+/*
+ * Virtual memory spaces other than the kernel memory are not supported
+ */
+int
+arch_vmem_init(struct vmem_space *space)
+{
+    return -1;
+}
+
+/*
+ * Nothing to clear since the physical pages are not backed
+ */
+int
+arch_clear_page(void *paddr)
+{
+    return 0;
+}
+
+/*
+ * The pages of the kernel memory are not movable
+ */
+int
+arch_migrate_page(struct vmem_space *space, void *vaddr, void *src, void *dst)
+{
+    return -1;
+}
+
+/*
+ * No deferred initialization
+ */
+int
+arch_memory_init_deferred(int domain)
+{
+    return 0;
+}
+
+/*
+ * Single processor
+ */
+int
+this_cpu_id(void)
+{
+    return 0;
+}
+
+/*
+ * No proximity domain (UMA)
+ */
+int
+this_cpu_domain(void)
+{
+    return -1;
+}
+
+/*
+ * Read the time-stamp counter
+ */
+u64
+rdtsc(void)
+{
+    u32 lo;
+    u32 hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+
+    return ((u64)hi << 32) | lo;
+}
+
+/*
+ * Acquire a spin lock
+ */
+void
+spin_lock(u32 *lock)
+{
+    while ( __sync_lock_test_and_set(lock, 1) ) {
+        while ( *(volatile u32 *)lock ) {
+            __asm__ __volatile__ ("pause");
+        }
+    }
+}
+
+/*
+ * Release a spin lock
+ */
+void
+spin_unlock(u32 *lock)
+{
+    __sync_lock_release(lock);
+}
+
+/*
+ * The bit width of the value minus one, i.e., the order of the buddy system
+ * for the number of pages
+ */
+reg_t
+bitwidth(reg_t x)
+{
+    x--;
+    if ( 0 == x ) {
+        return 0;
+    }
+
+    return 64 - __builtin_clzll(x);
+}
+
+/*
+ * Fill a byte string
+ */
+void *
+kmemset(void *b, int c, size_t len)
+{
+    size_t i;
+
+    for ( i = 0; i < len; i++ ) {
+        *((u8 *)b + i) = c;
+    }
+
+    return b;
+}
+
+/*
+ * Copy a string
+ */
+size_t
+kstrlcpy(char *dst, const char *src, size_t n)
+{
+    size_t i;
+
+    for ( i = 0; i + 1 < n && '\0' != src[i]; i++ ) {
+        dst[i] = src[i];
+    }
+    if ( n > 0 ) {
+        dst[i] = '\0';
+    }
+    while ( '\0' != src[i] ) {
+        i++;
+    }
+
+    return i;
+}
+
+/*
+ * Resolve the index of the page of a virtual address in the window
+ */
+static int
+_kmem_test_v2p(void *vaddr, size_t *idx)
+{
+    if ( vaddr < _kmem_test.base
+         || vaddr >= _kmem_test.base + PAGE_ADDR(_kmem_test.npg) ) {
+        return -1;
+    }
+    *idx = PAGE_INDEX(vaddr - _kmem_test.base);
+
+    return 0;
+}
+
+/*
+ * Map the physical pages starting at paddr, or those in frames if it is not
+ * NULL, to npg pages from vaddr.  The aligned runs of contiguous pages are
+ * tagged as superpages in the same way as the kernel maps them.
+ */
+static int
+_kmem_test_map(void *vaddr, void *paddr, void **frames, size_t npg)
+{
+    size_t idx;
+    size_t i;
+    u64 pa;
+    u64 tag;
+
+    if ( _kmem_test_v2p(vaddr, &idx) < 0
+         || idx + npg > _kmem_test.npg ) {
+        return -1;
+    }
+    tag = 0;
+    for ( i = 0; i < npg; i++ ) {
+        pa = NULL != frames ? (u64)frames[i] : (u64)paddr + PAGE_ADDR(i);
+        if ( NULL == frames && 0 == ((idx + i) & ((1ULL << SP_SHIFT) - 1)) ) {
+            /* Use a superpage for an aligned run of contiguous pages */
+            tag = (0 == (pa & (SUPERPAGESIZE - 1))
+                   && npg - i >= (1ULL << SP_SHIFT))
+                ? KMEM_TEST_SUPERPAGE : 0;
+        }
+        if ( 0 == _kmem_test.v2p[idx + i] ) {
+            _kmem_test.mapped++;
+        }
+        _kmem_test.v2p[idx + i] = pa | tag;
+    }
+    if ( _kmem_test.mapped > _kmem_test.peak ) {
+        _kmem_test.peak = _kmem_test.mapped;
+    }
+
+    return 0;
+}
+
+/*
+ * Carve a page-aligned and zero-cleared space of size bytes from the arena
+ */
+static void *
+_kmem_test_carve(void **cur, void *end, size_t size)
+{
+    void *ptr;
+
+    ptr = (void *)CEIL((reg_t)*cur, PAGESIZE);
+    if ( ptr + size > end ) {
+        return NULL;
+    }
+    kmemset(ptr, 0, size);
+    *cur = ptr + size;
+
+    return ptr;
+}
+
+/*
+ * Add the bytes of the pages of the slabs in the list to total, and the bytes
+ * of the objects allocated from them to used
+ */
+static void
+_kmem_test_slab_usage(struct kmem_slab_free_list *list, size_t *total,
+                      size_t *used)
+{
+    struct kmem_slab *heads[3];
+    struct kmem_slab *hdr;
+    int i;
+
+    heads[0] = list->partial;
+    heads[1] = list->full;
+    heads[2] = list->free;
+    for ( i = 0; i < 3; i++ ) {
+        for ( hdr = heads[i]; NULL != hdr; hdr = hdr->next ) {
+            *total += PAGE_ADDR(hdr->npages);
+            *used += (size_t)hdr->nused * hdr->size;
+        }
+    }
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */